@@ -0,0 +1,24 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include "abortcontroller.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+AbortController::AbortController(QObject *parent) :
+    QObject(parent),
+    m_aborted(false)
+{
+}
+
+void AbortController::abort(const QJSValue &reason)
+{
+    if (m_aborted)
+        return;
+
+    m_aborted = true;
+    m_reason = reason;
+    emit abortedChanged();
+}
+
+} } }
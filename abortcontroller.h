@@ -0,0 +1,42 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef ABORTCONTROLLER_H
+#define ABORTCONTROLLER_H
+
+#include <QtCore/QObject>
+#include <QtQml/QJSValue>
+
+#include "qpm.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Cancels the requests it has been given to with signal(). One controller
+// can be shared by a group of requests, which are all aborted together.
+// Aborting is final; a new controller is needed for new requests.
+class AbortController : public QObject
+{
+    Q_OBJECT
+
+    Q_PROPERTY(bool aborted READ isAborted NOTIFY abortedChanged)
+    Q_PROPERTY(QJSValue reason READ reason NOTIFY abortedChanged)
+
+public:
+    explicit AbortController(QObject *parent = 0);
+
+    bool isAborted() const { return m_aborted; }
+    QJSValue reason() const { return m_reason; }
+
+    Q_INVOKABLE void abort(const QJSValue &reason = QJSValue());
+
+signals:
+    void abortedChanged();
+
+private:
+    bool m_aborted;
+    QJSValue m_reason;
+};
+
+} } }
+
+#endif // ABORTCONTROLLER_H
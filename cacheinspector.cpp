@@ -0,0 +1,247 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QSaveFile>
+#include <QtNetwork/QAbstractNetworkCache>
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtQml/QQmlEngine>
+
+#include <algorithm>
+
+#include "cacheinspector.h"
+#include "config.h"
+#include "memorycache.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+static const QString PINNED_FILE = QStringLiteral("/pinned");
+
+static const QString STATUS_NETWORK =      QStringLiteral("network");
+static const QString STATUS_REVALIDATED =  QStringLiteral("revalidated");
+
+struct CacheCounters
+{
+    CacheCounters() : hits(0), misses(0), revalidations(0) {}
+    quint64 hits;
+    quint64 misses;
+    quint64 revalidations;
+};
+
+Q_GLOBAL_STATIC(CacheCounters, cacheCounters)
+
+struct HostUsage
+{
+    HostUsage() : count(0), size(0) {}
+    QString host;
+    int count;
+    qint64 size;
+};
+
+static bool largerEntry(const CacheEntryInfo &a, const CacheEntryInfo &b)
+{
+    return a.size > b.size;
+}
+
+static bool largerHost(const HostUsage &a, const HostUsage &b)
+{
+    return a.size > b.size;
+}
+
+QSet<QUrl> readPinnedUrls(const QString &directory)
+{
+    QSet<QUrl> urls;
+    QFile file(directory + PINNED_FILE);
+    if (!file.open(QIODevice::ReadOnly))
+        return urls;
+
+    while (!file.atEnd()) {
+        QByteArray line = file.readLine().trimmed();
+        if (!line.isEmpty())
+            urls.insert(QUrl::fromEncoded(line));
+    }
+    return urls;
+}
+
+void writePinnedUrls(const QString &directory, const QSet<QUrl> &urls)
+{
+    if (urls.isEmpty()) {
+        QFile::remove(directory + PINNED_FILE);
+        return;
+    }
+
+    QSaveFile file(directory + PINNED_FILE);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning("Could not open file for writing: %s", qUtf8Printable(file.fileName()));
+        return;
+    }
+
+    foreach (const QUrl &url, urls) {
+        file.write(url.toEncoded());
+        file.write("\n");
+    }
+    file.commit();
+}
+
+CacheInspector::CacheInspector(QQmlEngine *engine, QObject *parent) :
+    QObject(parent),
+    m_engine(engine)
+{
+}
+
+QAbstractNetworkCache *CacheInspector::cache() const
+{
+    Config::instance()->init(m_engine);
+    return m_engine->networkAccessManager()->cache();
+}
+
+InspectableCache *CacheInspector::inspectable() const
+{
+    return qobject_cast<InspectableCache*>(cache());
+}
+
+double CacheInspector::size() const
+{
+    QAbstractNetworkCache *c = cache();
+    return c ? double(c->cacheSize()) : 0;
+}
+
+int CacheInspector::count() const
+{
+    InspectableCache *c = inspectable();
+    return c ? c->entries().size() : 0;
+}
+
+double CacheInspector::hits() const
+{
+    return double(cacheCounters()->hits);
+}
+
+double CacheInspector::misses() const
+{
+    return double(cacheCounters()->misses);
+}
+
+double CacheInspector::revalidations() const
+{
+    return double(cacheCounters()->revalidations);
+}
+
+double CacheInspector::memoryHits() const
+{
+    MemoryCache *memory = qobject_cast<MemoryCache*>(cache());
+    return memory ? double(memory->memoryHits()) : 0;
+}
+
+QJSValue CacheInspector::largest(int count) const
+{
+    QJSValue result = m_engine->newArray();
+    InspectableCache *c = inspectable();
+    if (!c)
+        return result;
+
+    QList<CacheEntryInfo> entries = c->entries();
+    std::sort(entries.begin(), entries.end(), largerEntry);
+
+    for (int i = 0; i < entries.size() && i < count; ++i) {
+        const CacheEntryInfo &entry = entries.at(i);
+        result.setProperty(quint32(i), createEntry(entry, c->isPinned(entry.url)));
+    }
+    return result;
+}
+
+QJSValue CacheInspector::hosts() const
+{
+    QJSValue result = m_engine->newArray();
+    InspectableCache *c = inspectable();
+    if (!c)
+        return result;
+
+    QHash<QString, HostUsage> usage;
+    foreach (const CacheEntryInfo &entry, c->entries()) {
+        HostUsage &host = usage[entry.url.host()];
+        host.host = entry.url.host();
+        host.count++;
+        host.size += entry.size;
+    }
+
+    QList<HostUsage> sorted = usage.values();
+    std::sort(sorted.begin(), sorted.end(), largerHost);
+
+    for (int i = 0; i < sorted.size(); ++i) {
+        QJSValue host = m_engine->newObject();
+        host.setProperty("host", sorted.at(i).host);
+        host.setProperty("count", sorted.at(i).count);
+        host.setProperty("size", double(sorted.at(i).size));
+        result.setProperty(quint32(i), host);
+    }
+    return result;
+}
+
+QJSValue CacheInspector::lookup(const QString &url) const
+{
+    InspectableCache *c = inspectable();
+    if (!c)
+        return QJSValue(QJSValue::NullValue);
+
+    CacheEntryInfo entry;
+    entry.size = 0;
+    QNetworkCacheMetaData metaData = c->peek(QUrl(url), &entry.size);
+    if (!metaData.isValid())
+        return QJSValue(QJSValue::NullValue);
+
+    entry.url = metaData.url();
+    entry.lastModified = metaData.lastModified();
+    entry.expirationDate = metaData.expirationDate();
+    return createEntry(entry, c->isPinned(entry.url));
+}
+
+bool CacheInspector::remove(const QString &url)
+{
+    QAbstractNetworkCache *c = cache();
+    return c && c->remove(QUrl(url));
+}
+
+bool CacheInspector::pin(const QString &url, bool pinned)
+{
+    InspectableCache *c = inspectable();
+    if (!c)
+        return false;
+
+    c->setPinned(QUrl(url), pinned);
+    return true;
+}
+
+void CacheInspector::resetStatistics()
+{
+    *cacheCounters() = CacheCounters();
+}
+
+void CacheInspector::recordCacheStatus(const QString &status)
+{
+    CacheCounters *counters = cacheCounters();
+    if (status == STATUS_NETWORK)
+        counters->misses++;
+    else if (status == STATUS_REVALIDATED)
+        counters->revalidations++;
+    else
+        counters->hits++;
+}
+
+QJSValue CacheInspector::createEntry(const CacheEntryInfo &entry, bool pinned) const
+{
+    QJSValue value = m_engine->newObject();
+    value.setProperty("url", entry.url.toString());
+    value.setProperty("size", double(entry.size));
+    value.setProperty("lastModified", entry.lastModified.isValid() ?
+                          m_engine->toScriptValue(entry.lastModified) :
+                          QJSValue(QJSValue::NullValue));
+    value.setProperty("expires", entry.expirationDate.isValid() ?
+                          m_engine->toScriptValue(entry.expirationDate) :
+                          QJSValue(QJSValue::NullValue));
+    value.setProperty("pinned", pinned);
+    return value;
+}
+
+} } }
@@ -0,0 +1,97 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef CACHEINSPECTOR_H
+#define CACHEINSPECTOR_H
+
+#include <QtCore/QDateTime>
+#include <QtCore/QList>
+#include <QtCore/QObject>
+#include <QtCore/QSet>
+#include <QtCore/QUrl>
+#include <QtNetwork/QNetworkCacheMetaData>
+#include <QtQml/QJSValue>
+
+#include "qpm.h"
+
+class QAbstractNetworkCache;
+class QQmlEngine;
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+struct CacheEntryInfo
+{
+    QUrl url;
+    qint64 size;
+    QDateTime lastModified;
+    QDateTime expirationDate;
+};
+
+// Implemented by the caches Config installs, so that their contents can be
+// listed and individual entries can be kept from being evicted.
+class InspectableCache
+{
+public:
+    virtual ~InspectableCache() {}
+
+    virtual QList<CacheEntryInfo> entries() = 0;
+
+    // Returns the meta data of an entry and the size it takes up, like
+    // entries() does, without reading the body, counting a hit or a miss or
+    // changing the order of eviction
+    virtual QNetworkCacheMetaData peek(const QUrl &, qint64 *size) = 0;
+
+    virtual bool isPinned(const QUrl &) const = 0;
+    virtual void setPinned(const QUrl &, bool) = 0;
+};
+
+// Pinned urls are kept in a plain text file next to the cache data
+QSet<QUrl> readPinnedUrls(const QString &directory);
+void writePinnedUrls(const QString &directory, const QSet<QUrl> &);
+
+// The object behind Request.cache
+class CacheInspector : public QObject
+{
+    Q_OBJECT
+
+    Q_PROPERTY(double size READ size)
+    Q_PROPERTY(int count READ count)
+    Q_PROPERTY(double hits READ hits)
+    Q_PROPERTY(double misses READ misses)
+    Q_PROPERTY(double revalidations READ revalidations)
+    Q_PROPERTY(double memoryHits READ memoryHits)
+
+public:
+    explicit CacheInspector(QQmlEngine *engine, QObject *parent = 0);
+
+    double size() const;
+    int count() const;
+    double hits() const;
+    double misses() const;
+    double revalidations() const;
+    double memoryHits() const;
+
+    Q_INVOKABLE QJSValue largest(int = 10) const;
+    Q_INVOKABLE QJSValue hosts() const;
+    Q_INVOKABLE QJSValue lookup(const QString &) const;
+    Q_INVOKABLE bool remove(const QString &);
+    Q_INVOKABLE bool pin(const QString &, bool = true);
+    Q_INVOKABLE void resetStatistics();
+
+    // Counts the outcome of a GET request by its response's cacheStatus
+    static void recordCacheStatus(const QString &);
+
+private:
+    QAbstractNetworkCache *cache() const;
+    InspectableCache *inspectable() const;
+    QJSValue createEntry(const CacheEntryInfo &, bool pinned) const;
+
+    QQmlEngine *m_engine;
+};
+
+} } }
+
+#define InspectableCache_iid "com.cutehacks.duperagent.InspectableCache"
+Q_DECLARE_INTERFACE(com::cutehacks::duperagent::InspectableCache, InspectableCache_iid)
+
+#endif // CACHEINSPECTOR_H
@@ -0,0 +1,60 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QHash>
+#include <QtCore/QReadWriteLock>
+
+#include "codecregistry.h"
+#include "mediatype.h"
+#include "serialization.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+struct CodecTable
+{
+    CodecTable()
+    {
+        factories.insert("application/json", &BodyCodecRegistry::createCodec<JsonCodec>);
+        factories.insert("+json", &BodyCodecRegistry::createCodec<JsonCodec>);
+        factories.insert("application/x-www-form-urlencoded",
+                         &BodyCodecRegistry::createCodec<FormUrlEncodedCodec>);
+        factories.insert("application/msgpack", &BodyCodecRegistry::createCodec<MessagePackCodec>);
+        factories.insert("application/x-msgpack", &BodyCodecRegistry::createCodec<MessagePackCodec>);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+        factories.insert("application/cbor", &BodyCodecRegistry::createCodec<CborCodec>);
+        factories.insert("+cbor", &BodyCodecRegistry::createCodec<CborCodec>);
+#endif
+    }
+
+    QReadWriteLock lock;
+    QHash<QByteArray, BodyCodecRegistry::Factory> factories;
+};
+
+Q_GLOBAL_STATIC(CodecTable, codecTable)
+
+void BodyCodecRegistry::registerCodec(const QByteArray &mediaType, Factory factory)
+{
+    CodecTable *table = codecTable();
+    QWriteLocker locker(&table->lock);
+    table->factories.insert(mediaType.toLower(), factory);
+}
+
+BodyCodec *BodyCodecRegistry::create(QQmlEngine *engine, const MediaType &mediaType)
+{
+    if (!mediaType.isValid())
+        return 0;
+
+    CodecTable *table = codecTable();
+    QReadLocker locker(&table->lock);
+
+    Factory factory = table->factories.value(mediaType.mimeType());
+    if (!factory) {
+        QByteArray suffix = mediaType.suffix();
+        if (!suffix.isEmpty())
+            factory = table->factories.value('+' + suffix);
+    }
+
+    return factory ? factory(engine) : 0;
+}
+
+} } }
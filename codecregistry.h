@@ -0,0 +1,52 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef CODECREGISTRY_H
+#define CODECREGISTRY_H
+
+#include <QtCore/QByteArray>
+
+#include "qpm.h"
+
+class QQmlEngine;
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+class BodyCodec;
+class MediaType;
+
+// Maps media types to the BodyCodec used to serialize request bodies and
+// parse response bodies. Codecs are registered either for a full media type
+// such as "application/json" or for a structured syntax suffix such as
+// "+json", which is used when no exact match exists.
+//
+// JSON, form encoding, MessagePack and (with Qt 5.12 or later) CBOR are
+// registered by default. Registering a codec for a type that already has one
+// replaces it.
+class BodyCodecRegistry
+{
+public:
+    typedef BodyCodec *(*Factory)(QQmlEngine *);
+
+    static void registerCodec(const QByteArray &mediaType, Factory);
+
+    template <typename T>
+    static void registerCodec(const QByteArray &mediaType)
+    {
+        registerCodec(mediaType, &createCodec<T>);
+    }
+
+    // Returns a new codec for the media type, or 0 if there is none. The
+    // caller takes ownership.
+    static BodyCodec *create(QQmlEngine *, const MediaType &);
+
+    template <typename T>
+    static BodyCodec *createCodec(QQmlEngine *engine)
+    {
+        return new T(engine);
+    }
+};
+
+} } }
+
+#endif // CODECREGISTRY_H
@@ -11,7 +11,23 @@ HEADERS += $$PWD/duperagent.h \
     $$PWD/promisemodule.h \
     $$PWD/networkactivityindicator.h \
     $$PWD/imageutils.h \
-    $$PWD/multipartsource.h
+    $$PWD/multipartsource.h \
+    $$PWD/mediatype.h \
+    $$PWD/textdecoder.h \
+    $$PWD/multipartparser.h \
+    $$PWD/codecregistry.h \
+    $$PWD/memorycache.h \
+    $$PWD/packcache.h \
+    $$PWD/prefetcher.h \
+    $$PWD/revalidator.h \
+    $$PWD/cacheinspector.h \
+    $$PWD/diskcache.h \
+    $$PWD/compressedcache.h \
+    $$PWD/requestqueue.h \
+    $$PWD/networkpool.h \
+    $$PWD/microtaskqueue.h \
+    $$PWD/deferred.h \
+    $$PWD/abortcontroller.h
 
 SOURCES += $$PWD/duperagent.cpp \
     $$PWD/request.cpp \
@@ -23,12 +39,34 @@ SOURCES += $$PWD/duperagent.cpp \
     $$PWD/promisemodule.cpp \
     $$PWD/networkactivityindicator.cpp \
     $$PWD/imageutils.cpp \
-    $$PWD/multipartsource.cpp
+    $$PWD/multipartsource.cpp \
+    $$PWD/mediatype.cpp \
+    $$PWD/textdecoder.cpp \
+    $$PWD/multipartparser.cpp \
+    $$PWD/codecregistry.cpp \
+    $$PWD/memorycache.cpp \
+    $$PWD/packcache.cpp \
+    $$PWD/prefetcher.cpp \
+    $$PWD/revalidator.cpp \
+    $$PWD/cacheinspector.cpp \
+    $$PWD/diskcache.cpp \
+    $$PWD/compressedcache.cpp \
+    $$PWD/requestqueue.cpp \
+    $$PWD/networkpool.cpp \
+    $$PWD/microtaskqueue.cpp \
+    $$PWD/deferred.cpp \
+    $$PWD/abortcontroller.cpp
 
 contains(QT_CONFIG, ssl) | contains(QT_CONFIG, openssl) | contains(QT_CONFIG, openssl-linked) {
     HEADERS += $$PWD/ssl.h
     SOURCES += $$PWD/ssl.cpp
 }
 
+greaterThan(QT_MAJOR_VERSION, 5) | greaterThan(QT_MINOR_VERSION, 5) {
+    QT *= quick
+    HEADERS += $$PWD/imageprovider.h
+    SOURCES += $$PWD/imageprovider.cpp
+}
+
 ios:OBJECTIVE_SOURCES += \
     $$PWD/networkactivityindicator_ios.mm
@@ -0,0 +1,250 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QBuffer>
+
+#include "compressedcache.h"
+#include "mediatype.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+static const QByteArray MARKER_HEADER = QByteArrayLiteral("X-Duperagent-Compressed");
+static const QByteArray MARKER_VALUE = QByteArrayLiteral("zlib");
+
+// zlib's fastest level; cache writes happen on the GUI thread
+static const int COMPRESSION_LEVEL = 1;
+
+// Bodies smaller than this are stored as they are, and compressed bodies have
+// to save at least an eighth of the size to be kept
+static const int MIN_COMPRESS_SIZE = 256;
+
+static bool isMarked(const QNetworkCacheMetaData &metaData)
+{
+    foreach (const QNetworkCacheMetaData::RawHeader &header, metaData.rawHeaders()) {
+        if (header.first == MARKER_HEADER)
+            return true;
+    }
+    return false;
+}
+
+static QNetworkCacheMetaData withoutMarker(const QNetworkCacheMetaData &metaData)
+{
+    QNetworkCacheMetaData::RawHeaderList headers = metaData.rawHeaders();
+    for (int i = headers.size() - 1; i >= 0; --i) {
+        if (headers.at(i).first == MARKER_HEADER)
+            headers.removeAt(i);
+    }
+
+    QNetworkCacheMetaData stripped(metaData);
+    stripped.setRawHeaders(headers);
+    return stripped;
+}
+
+static QNetworkCacheMetaData withMarker(const QNetworkCacheMetaData &metaData)
+{
+    QNetworkCacheMetaData::RawHeaderList headers = metaData.rawHeaders();
+    headers.append(qMakePair(MARKER_HEADER, MARKER_VALUE));
+
+    QNetworkCacheMetaData marked(metaData);
+    marked.setRawHeaders(headers);
+    return marked;
+}
+
+CompressedCache::CompressedCache(QAbstractNetworkCache *backing, QObject *parent) :
+    QAbstractNetworkCache(parent),
+    m_backing(backing)
+{
+    m_backing->setParent(this);
+}
+
+CompressedCache::~CompressedCache()
+{
+    qDeleteAll(m_preparing.keys());
+}
+
+bool CompressedCache::isCompressible(const QNetworkCacheMetaData &metaData)
+{
+    QByteArray contentType;
+    QByteArray contentEncoding;
+    foreach (const QNetworkCacheMetaData::RawHeader &header, metaData.rawHeaders()) {
+        if (qstricmp(header.first.constData(), "content-type") == 0)
+            contentType = header.second;
+        else if (qstricmp(header.first.constData(), "content-encoding") == 0)
+            contentEncoding = header.second.trimmed().toLower();
+    }
+
+    // QNetworkAccessManager only decodes gzip and deflate, other encodings
+    // end up in the cache as they were sent
+    if (!contentEncoding.isEmpty() && contentEncoding != "identity"
+            && contentEncoding != "gzip" && contentEncoding != "deflate") {
+        return false;
+    }
+
+    MediaType type(contentType);
+    if (!type.isValid())
+        return true;
+
+    QByteArray t = type.type();
+    QByteArray mimeType = type.mimeType();
+    if (t == "image")
+        return mimeType == "image/svg+xml" || mimeType == "image/bmp";
+    if (t == "audio" || t == "video" || t == "font")
+        return false;
+
+    return mimeType != "application/zip"
+            && mimeType != "application/gzip"
+            && mimeType != "application/x-gzip"
+            && mimeType != "application/x-bzip2"
+            && mimeType != "application/x-xz"
+            && mimeType != "application/x-7z-compressed"
+            && mimeType != "application/x-rar-compressed"
+            && mimeType != "application/pdf"
+            && mimeType != "application/font-woff";
+}
+
+QNetworkCacheMetaData CompressedCache::metaData(const QUrl &url)
+{
+    QNetworkCacheMetaData metaData = m_backing->metaData(url);
+    if (!isMarked(metaData))
+        return metaData;
+    return withoutMarker(metaData);
+}
+
+void CompressedCache::updateMetaData(const QNetworkCacheMetaData &metaData)
+{
+    // The body stays as it is, so the marker has to as well
+    if (isMarked(m_backing->metaData(metaData.url())))
+        m_backing->updateMetaData(withMarker(withoutMarker(metaData)));
+    else
+        m_backing->updateMetaData(metaData);
+}
+
+QIODevice *CompressedCache::data(const QUrl &url)
+{
+    // Looking at the metadata first lets QNetworkDiskCache reuse the file it
+    // opened for the data
+    bool compressed = isMarked(m_backing->metaData(url));
+
+    QIODevice *device = m_backing->data(url);
+    if (!device || !compressed)
+        return device;
+
+    QByteArray data = qUncompress(device->readAll());
+    delete device;
+    if (data.isEmpty()) {
+        qWarning("Removing corrupt cache entry: %s", qUtf8Printable(url.toString()));
+        m_backing->remove(url);
+        return 0;
+    }
+
+    QBuffer *buffer = new QBuffer();
+    buffer->setData(data);
+    buffer->open(QIODevice::ReadOnly);
+    return buffer;
+}
+
+bool CompressedCache::remove(const QUrl &url)
+{
+    QHash<QIODevice*, QNetworkCacheMetaData>::iterator it = m_preparing.begin();
+    while (it != m_preparing.end()) {
+        if (it.value().url() == url) {
+            delete it.key();
+            it = m_preparing.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    return m_backing->remove(url);
+}
+
+qint64 CompressedCache::cacheSize() const
+{
+    return m_backing->cacheSize();
+}
+
+QIODevice *CompressedCache::prepare(const QNetworkCacheMetaData &metaData)
+{
+    if (!metaData.isValid() || !metaData.saveToDisk())
+        return 0;
+
+    if (!isCompressible(metaData))
+        return m_backing->prepare(metaData);
+
+    // The whole body is needed to decide whether compressing it pays off
+    QBuffer *buffer = new QBuffer();
+    buffer->open(QIODevice::ReadWrite);
+    m_preparing.insert(buffer, metaData);
+    return buffer;
+}
+
+void CompressedCache::insert(QIODevice *device)
+{
+    QHash<QIODevice*, QNetworkCacheMetaData>::iterator it = m_preparing.find(device);
+    if (it == m_preparing.end()) {
+        m_backing->insert(device); // passed through by prepare()
+        return;
+    }
+
+    QNetworkCacheMetaData metaData = it.value();
+    m_preparing.erase(it);
+
+    QByteArray data = static_cast<QBuffer*>(device)->data();
+    delete device;
+
+    if (data.size() >= MIN_COMPRESS_SIZE) {
+        QByteArray compressed = qCompress(data, COMPRESSION_LEVEL);
+        if (compressed.size() <= data.size() - data.size() / 8) {
+            data = compressed;
+            metaData = withMarker(metaData);
+        }
+    }
+
+    QIODevice *backingDevice = m_backing->prepare(metaData);
+    if (!backingDevice)
+        return;
+
+    if (backingDevice->write(data) != data.size()) {
+        m_backing->remove(metaData.url());
+        return;
+    }
+    m_backing->insert(backingDevice);
+}
+
+void CompressedCache::clear()
+{
+    qDeleteAll(m_preparing.keys());
+    m_preparing.clear();
+    m_backing->clear();
+}
+
+QList<CacheEntryInfo> CompressedCache::entries()
+{
+    InspectableCache *backing = qobject_cast<InspectableCache*>(m_backing);
+    return backing ? backing->entries() : QList<CacheEntryInfo>();
+}
+
+QNetworkCacheMetaData CompressedCache::peek(const QUrl &url, qint64 *size)
+{
+    // The size is the compressed one, like entries() reports
+    InspectableCache *backing = qobject_cast<InspectableCache*>(m_backing);
+    if (!backing)
+        return QNetworkCacheMetaData();
+
+    QNetworkCacheMetaData metaData = backing->peek(url, size);
+    return isMarked(metaData) ? withoutMarker(metaData) : metaData;
+}
+
+bool CompressedCache::isPinned(const QUrl &url) const
+{
+    InspectableCache *backing = qobject_cast<InspectableCache*>(m_backing);
+    return backing && backing->isPinned(url);
+}
+
+void CompressedCache::setPinned(const QUrl &url, bool pinned)
+{
+    if (InspectableCache *backing = qobject_cast<InspectableCache*>(m_backing))
+        backing->setPinned(url, pinned);
+}
+
+} } }
@@ -0,0 +1,58 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef COMPRESSEDCACHE_H
+#define COMPRESSEDCACHE_H
+
+#include <QtCore/QHash>
+#include <QtNetwork/QAbstractNetworkCache>
+
+#include "qpm.h"
+#include "cacheinspector.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Compresses bodies on their way into another QAbstractNetworkCache and
+// decompresses them on the way out. Media types that are compressed already,
+// like JPEG images, are passed straight through, as are bodies that don't
+// shrink enough to be worth it. Compressed entries are marked with a header
+// that is never exposed to QNetworkAccessManager.
+class CompressedCache : public QAbstractNetworkCache, public InspectableCache
+{
+    Q_OBJECT
+    Q_INTERFACES(com::cutehacks::duperagent::InspectableCache)
+
+public:
+    // Takes ownership of the backing cache
+    explicit CompressedCache(QAbstractNetworkCache *backing, QObject *parent = 0);
+    ~CompressedCache();
+
+    QNetworkCacheMetaData metaData(const QUrl &);
+    void updateMetaData(const QNetworkCacheMetaData &);
+    QIODevice *data(const QUrl &);
+    bool remove(const QUrl &);
+    qint64 cacheSize() const;
+
+    QIODevice *prepare(const QNetworkCacheMetaData &);
+    void insert(QIODevice *);
+
+    QAbstractNetworkCache *backingCache() const { return m_backing; }
+
+    QList<CacheEntryInfo> entries();
+    QNetworkCacheMetaData peek(const QUrl &, qint64 *size);
+    bool isPinned(const QUrl &) const;
+    void setPinned(const QUrl &, bool);
+
+    static bool isCompressible(const QNetworkCacheMetaData &);
+
+public slots:
+    void clear();
+
+private:
+    QAbstractNetworkCache *m_backing;
+    QHash<QIODevice*, QNetworkCacheMetaData> m_preparing;
+};
+
+} } }
+
+#endif // COMPRESSEDCACHE_H
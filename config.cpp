@@ -2,20 +2,33 @@
 // License can be found in the LICENSE file.
 
 #include <QtCore/QStandardPaths>
-#include <QtNetwork/QNetworkDiskCache>
+#include <QtNetwork/QAbstractNetworkCache>
 #include <QtNetwork/QNetworkAccessManager>
 #include <QtNetwork/QNetworkProxyFactory>
 #include <QtCore/QString>
 #include <QtQml/QQmlEngine>
 
 #include "config.h"
+#include "compressedcache.h"
 #include "cookiejar.h"
+#include "diskcache.h"
+#include "memorycache.h"
+#include "networkpool.h"
+#include "packcache.h"
 
 namespace com { namespace cutehacks { namespace duperagent {
 
 static const char *PROP_CACHE           = "cache";
 static const char *PROP_CACHE_MAX_SIZE  = "maxSize";
 static const char *PROP_CACHE_LOC       = "location";
+static const char *PROP_CACHE_MEM_SIZE  = "memorySize";
+static const char *PROP_CACHE_ENGINE    = "engine";
+static const char *PROP_CACHE_COMPRESS  = "compress";
+
+static const char *CACHE_ENGINE_PACK    = "pack";
+
+static const qint64 DEFAULT_MEMORY_CACHE_SIZE = 2 * 1024 * 1024;
+static const qint64 DEFAULT_PACK_CACHE_SIZE = 50 * 1024 * 1024;
 
 static const char *PROP_COOKIE_JAR      = "cookieJar";
 static const char *PROP_COOKIE_JAR_LOC  = "location";
@@ -23,14 +36,41 @@ static const char *PROP_COOKIE_PERSIST  = "persistSessions";
 
 static const char *PROP_PROXY           = "proxy";
 
+static const char *PROP_QUEUE           = "queue";
+static const char *PROP_QUEUE_LOC       = "location";
+static const char *PROP_QUEUE_CONCURRENCY = "concurrency";
+
+static const int DEFAULT_QUEUE_CONCURRENCY = 2;
+
+static const char *PROP_NETWORK_POOL    = "networkPool";
+
 Q_GLOBAL_STATIC(Config, globalConfig)
 
+// A configuration option is either a boolean or an object with settings
+static bool isEnabled(const QVariant &option)
+{
+    return option.type() == QVariant::Map || option.toBool();
+}
+
 Config::Config() :
     m_doneInit(false),
+    m_initInBackground(false),
+    m_loader(0),
     m_noCache(false),
     m_noCookieJar(false),
-    m_maxCacheSize(-1)
+    m_systemProxy(false),
+    m_maxCacheSize(-1),
+    m_memoryCacheSize(DEFAULT_MEMORY_CACHE_SIZE),
+    m_compressCache(false),
+    m_persistSessionCookies(false),
+    m_queueConcurrency(DEFAULT_QUEUE_CONCURRENCY),
+    m_networkPoolSize(1)
+{
+}
+
+Config::~Config()
 {
+    delete m_loader;
 }
 
 void Config::init(QQmlEngine *engine)
@@ -41,38 +81,126 @@ void Config::init(QQmlEngine *engine)
     m_doneInit = true;
 
     QNetworkAccessManager *network = engine->networkAccessManager();
+    resolvePaths();
 
-    // Cache
-    if (!m_noCache) {
-        QNetworkDiskCache *cache = new QNetworkDiskCache();
-        if (m_cachePath.isEmpty()) {
-            m_cachePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
-                    + "/duperagent";
+    QAbstractNetworkCache *cache = 0;
+    CookieJar *cookieJar = 0;
+    bool loaded = false;
+
+    if (m_loader) {
+        // Usually done by now; otherwise this only waits for what is left
+        m_loader->wait();
+        if (hasSameStorage(m_loader->config())) {
+            cache = m_loader->takeCache();
+            cookieJar = m_loader->takeCookieJar();
+            loaded = true;
         }
-        cache->setCacheDirectory(m_cachePath);
-        if (m_maxCacheSize > 0)
-            cache->setMaximumCacheSize(m_maxCacheSize);
-        network->setCache(cache);
+        delete m_loader;
+        m_loader = 0;
     }
 
+    if (!loaded) {
+        cache = createCache();
+        cookieJar = createCookieJar(network);
+    }
+
+    // Cache
+    if (cache)
+        network->setCache(cache);
+
     // Proxy
     if (m_systemProxy) {
         QNetworkProxyFactory::setUseSystemConfiguration(true);
     }
 
     // Cookies
-    if (!m_noCookieJar) {
-        if (m_cookieJarPath.isEmpty()) {
-            m_cookieJarPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)
-                + "/duperagent_cookies.txt";
-        }
-        CookieJar *cj = new CookieJar(m_cookieJarPath, network);
-        if (m_persistSessionCookies)
-            cj->setPersistSessions(m_persistSessionCookies);
-        network->setCookieJar(cj);
+    if (cookieJar)
+        network->setCookieJar(cookieJar);
+
+    // Network pool, sharing the cache and cookie jar set up above
+    if (m_networkPoolSize > 1)
+        new NetworkPool(engine, m_networkPoolSize);
+}
+
+void Config::startBackgroundInit()
+{
+    if (!m_initInBackground || m_doneInit || m_loader)
+        return;
+
+    resolvePaths();
+    m_loader = new ConfigLoader(*this);
+    m_loader->start(QThread::LowPriority);
+}
+
+void Config::resolvePaths()
+{
+    if (m_cachePath.isEmpty()) {
+        m_cachePath = QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+                + "/duperagent";
+    }
+    if (m_cookieJarPath.isEmpty()) {
+        m_cookieJarPath = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)
+            + "/duperagent_cookies.txt";
     }
 }
 
+bool Config::hasSameStorage(const Config &other) const
+{
+    return m_noCache == other.m_noCache
+            && m_cachePath == other.m_cachePath
+            && m_cacheEngine == other.m_cacheEngine
+            && m_maxCacheSize == other.m_maxCacheSize
+            && m_memoryCacheSize == other.m_memoryCacheSize
+            && m_compressCache == other.m_compressCache
+            && m_noCookieJar == other.m_noCookieJar
+            && m_cookieJarPath == other.m_cookieJarPath
+            && m_persistSessionCookies == other.m_persistSessionCookies;
+}
+
+QAbstractNetworkCache *Config::createCache() const
+{
+    if (m_noCache)
+        return 0;
+
+    QAbstractNetworkCache *cache = 0;
+    if (m_cacheEngine == QLatin1String(CACHE_ENGINE_PACK)) {
+        cache = new PackCache(m_cachePath, m_maxCacheSize > 0 ?
+                                  m_maxCacheSize : DEFAULT_PACK_CACHE_SIZE);
+    } else {
+        DiskCache *diskCache = new DiskCache(m_cachePath);
+        if (m_maxCacheSize > 0)
+            diskCache->setMaximumCacheSize(m_maxCacheSize);
+        cache = diskCache;
+    }
+
+    if (m_compressCache)
+        cache = new CompressedCache(cache);
+
+    if (m_memoryCacheSize > 0)
+        cache = new MemoryCache(m_memoryCacheSize, cache);
+
+    return cache;
+}
+
+CookieJar *Config::createCookieJar(QObject *parent) const
+{
+    if (m_noCookieJar)
+        return 0;
+
+    CookieJar *cj = new CookieJar(m_cookieJarPath, parent);
+    if (m_persistSessionCookies)
+        cj->setPersistSessions(m_persistSessionCookies);
+    return cj;
+}
+
+QString Config::queuePath() const
+{
+    if (!m_queuePath.isEmpty())
+        return m_queuePath;
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation)
+            + "/duperagent_queue";
+}
+
 Config* Config::instance()
 {
     Config *instance = globalConfig;
@@ -81,37 +209,117 @@ Config* Config::instance()
 
 void Config::setOptions(const QJSValue &options)
 {
-    if (options.hasProperty(QString::fromLatin1(PROP_CACHE))) {
-        QJSValue cacheOptions = options.property(QString::fromLatin1(PROP_CACHE));
-        m_noCache = !cacheOptions.toBool();
-        if (cacheOptions.hasProperty(QString::fromLatin1(PROP_CACHE_MAX_SIZE))) {
-            m_maxCacheSize = cacheOptions.property(
+    setOptions(options.toVariant().toMap());
+}
+
+void Config::setOptions(const QVariantMap &options)
+{
+    if (options.contains(QString::fromLatin1(PROP_CACHE))) {
+        QVariant cache = options.value(QString::fromLatin1(PROP_CACHE));
+        QVariantMap cacheOptions = cache.toMap();
+        m_noCache = !isEnabled(cache);
+        if (cacheOptions.contains(QString::fromLatin1(PROP_CACHE_MAX_SIZE))) {
+            m_maxCacheSize = cacheOptions.value(
                         QString::fromLatin1(PROP_CACHE_MAX_SIZE)).toUInt();
         }
-        if (cacheOptions.hasProperty(QString::fromLatin1(PROP_CACHE_LOC))) {
-            m_cachePath = cacheOptions.property(
+        if (cacheOptions.contains(QString::fromLatin1(PROP_CACHE_LOC))) {
+            m_cachePath = cacheOptions.value(
                         QString::fromLatin1(PROP_CACHE_LOC)).toString();
         }
+        if (cacheOptions.contains(QString::fromLatin1(PROP_CACHE_ENGINE))) {
+            m_cacheEngine = cacheOptions.value(
+                        QString::fromLatin1(PROP_CACHE_ENGINE)).toString();
+        }
+        if (cacheOptions.contains(QString::fromLatin1(PROP_CACHE_COMPRESS))) {
+            m_compressCache = cacheOptions.value(
+                        QString::fromLatin1(PROP_CACHE_COMPRESS)).toBool();
+        }
+        if (cacheOptions.contains(QString::fromLatin1(PROP_CACHE_MEM_SIZE))) {
+            m_memoryCacheSize = cacheOptions.value(
+                        QString::fromLatin1(PROP_CACHE_MEM_SIZE)).toUInt();
+        }
     }
 
-    if (options.hasProperty(QString::fromLatin1(PROP_COOKIE_JAR))) {
-        QJSValue jarOptions = options.property(QString::fromLatin1(PROP_COOKIE_JAR));
-        m_noCookieJar = !jarOptions.toBool();
-        if (jarOptions.hasProperty(QString::fromLatin1(PROP_COOKIE_JAR_LOC))) {
-            m_cookieJarPath = jarOptions.property(
+    if (options.contains(QString::fromLatin1(PROP_COOKIE_JAR))) {
+        QVariant jar = options.value(QString::fromLatin1(PROP_COOKIE_JAR));
+        QVariantMap jarOptions = jar.toMap();
+        m_noCookieJar = !isEnabled(jar);
+        if (jarOptions.contains(QString::fromLatin1(PROP_COOKIE_JAR_LOC))) {
+            m_cookieJarPath = jarOptions.value(
                         QString::fromLatin1(PROP_COOKIE_JAR_LOC)).toString();
         }
-        if (jarOptions.hasProperty(QString::fromLatin1(PROP_COOKIE_PERSIST))) {
-            m_persistSessionCookies = jarOptions.property(
+        if (jarOptions.contains(QString::fromLatin1(PROP_COOKIE_PERSIST))) {
+            m_persistSessionCookies = jarOptions.value(
                         QString::fromLatin1(PROP_COOKIE_PERSIST)).toBool();
         }
     }
 
-    if (options.hasProperty(QString::fromLatin1(PROP_PROXY))) {
-        QJSValue proxyOptions = options.property(QString::fromLatin1(PROP_PROXY));
+    if (options.contains(QString::fromLatin1(PROP_QUEUE))) {
+        QVariantMap queueOptions = options.value(QString::fromLatin1(PROP_QUEUE)).toMap();
+        if (queueOptions.contains(QString::fromLatin1(PROP_QUEUE_LOC))) {
+            m_queuePath = queueOptions.value(
+                        QString::fromLatin1(PROP_QUEUE_LOC)).toString();
+        }
+        if (queueOptions.contains(QString::fromLatin1(PROP_QUEUE_CONCURRENCY))) {
+            m_queueConcurrency = queueOptions.value(
+                        QString::fromLatin1(PROP_QUEUE_CONCURRENCY)).toInt();
+        }
+    }
+
+    if (options.contains(QString::fromLatin1(PROP_NETWORK_POOL))) {
+        m_networkPoolSize = qMax(1, options.value(
+                                     QString::fromLatin1(PROP_NETWORK_POOL)).toInt());
+    }
+
+    if (options.contains(QString::fromLatin1(PROP_PROXY))) {
+        QVariant proxyOptions = options.value(QString::fromLatin1(PROP_PROXY));
         m_systemProxy = proxyOptions.toString() == QStringLiteral("system");
     }
 }
 
+ConfigLoader::ConfigLoader(const Config &config, QObject *parent) :
+    QThread(parent),
+    m_config(config),
+    m_target(QThread::currentThread()),
+    m_cache(0),
+    m_cookieJar(0)
+{
+}
+
+ConfigLoader::~ConfigLoader()
+{
+    wait();
+    delete m_cache;
+    delete m_cookieJar;
+}
+
+QAbstractNetworkCache *ConfigLoader::takeCache()
+{
+    QAbstractNetworkCache *cache = m_cache;
+    m_cache = 0;
+    return cache;
+}
+
+CookieJar *ConfigLoader::takeCookieJar()
+{
+    CookieJar *cookieJar = m_cookieJar;
+    m_cookieJar = 0;
+    return cookieJar;
+}
+
+void ConfigLoader::run()
+{
+    m_cache = m_config.createCache();
+    if (m_cache) {
+        // A disk cache doesn't scan its directory until its size is needed
+        m_cache->cacheSize();
+        m_cache->moveToThread(m_target);
+    }
+
+    m_cookieJar = m_config.createCookieJar();
+    if (m_cookieJar)
+        m_cookieJar->moveToThread(m_target);
+}
+
 } } }
 
@@ -5,32 +5,90 @@
 #define CONFIG_H
 
 #include <QGlobalStatic>
+#include <QtCore/QThread>
+#include <QtCore/QVariantMap>
 #include <QtQml/QJSValue>
 
 #include "qpm.h"
 
+class QAbstractNetworkCache;
 class QQmlEngine;
 
 namespace com { namespace cutehacks { namespace duperagent {
 
+class ConfigLoader;
+class CookieJar;
+
 class Config
 {
 public:
     Config();
+    ~Config();
     void init(QQmlEngine *);
     void setOptions(const QJSValue&);
+    void setOptions(const QVariantMap&);
+
+    // When enabled, the cache and cookie jar are created on a background
+    // thread as soon as the application object has been constructed, rather
+    // than by the first request. Has to be set before that.
+    void setInitInBackground(bool enabled) { m_initInBackground = enabled; }
+    bool initInBackground() const { return m_initInBackground; }
+    void startBackgroundInit();
 
     static Config* instance();
 
+    QAbstractNetworkCache *createCache() const;
+    CookieJar *createCookieJar(QObject *parent = 0) const;
+
+    QString queuePath() const;
+    int queueConcurrency() const { return m_queueConcurrency; }
+    int networkPoolSize() const { return m_networkPoolSize; }
+
 private:
+    void resolvePaths();
+    bool hasSameStorage(const Config &) const;
+
     bool m_doneInit;
+    bool m_initInBackground;
+    ConfigLoader *m_loader;
     bool m_noCache;
     bool m_noCookieJar;
     bool m_systemProxy;
     QString m_cachePath;
+    QString m_cacheEngine;
     qint64 m_maxCacheSize;
+    qint64 m_memoryCacheSize;
+    bool m_compressCache;
     QString m_cookieJarPath;
     bool m_persistSessionCookies;
+    QString m_queuePath;
+    int m_queueConcurrency;
+    int m_networkPoolSize;
+};
+
+// Creates the cache and cookie jar described by a copy of the configuration
+// on its own thread, and hands them over to the thread that started it.
+class ConfigLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit ConfigLoader(const Config &config, QObject *parent = 0);
+    ~ConfigLoader();
+
+    const Config &config() const { return m_config; }
+
+    QAbstractNetworkCache *takeCache();
+    CookieJar *takeCookieJar();
+
+protected:
+    void run();
+
+private:
+    Config m_config;
+    QThread *m_target;
+    QAbstractNetworkCache *m_cache;
+    CookieJar *m_cookieJar;
 };
 
 } } }
@@ -1,51 +1,293 @@
 // Copyright 2016 Cutehacks AS. All rights reserved.
 // License can be found in the LICENSE file.
 
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
 #include <QtCore/QDir>
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
+#include <QtCore/QSaveFile>
 #include <QtCore/QTextStream>
-#include <QtNetwork/QNetworkCookie>
+#include <QtCore/QTimerEvent>
+#include <QtCore/QUrl>
+#include <QtNetwork/QHostAddress>
+
+#include <algorithm>
 
 #include "cookiejar.h"
 
 namespace com { namespace cutehacks { namespace duperagent {
 
+// Changes are written out this many ms after the first one, so that all
+// cookies set by a response end up in a single write
+static const int SAVE_DELAY = 1000;
+
+// The limits browsers use per registrable domain and in total
+static const int MAX_COOKIES_PER_DOMAIN = 180;
+static const int MAX_COOKIES = 3000;
+
+// Cookies are bucketed by the registrable domain, the public suffix plus one
+// label, which every host a cookie can be sent to shares with it. Qt knows
+// the public suffixes, so sites under co.uk or github.io get buckets of
+// their own.
+static QString bucketKey(const QString &domain)
+{
+    QString key = domain.startsWith(QLatin1Char('.')) ? domain.mid(1) : domain;
+    key = key.toLower();
+
+    if (!QHostAddress(key).isNull())
+        return key;
+
+    QUrl url;
+    url.setHost(key);
+    QString suffix = url.topLevelDomain();
+    if (suffix.isEmpty() || suffix.length() >= key.length())
+        return key;
+
+    int dot = key.lastIndexOf(QLatin1Char('.'), key.length() - suffix.length() - 1);
+    return dot < 0 ? key : key.mid(dot + 1);
+}
+
+// The same matching rules QNetworkCookieJar::cookiesForUrl() uses
+static bool isParentDomain(const QString &domain, const QString &reference)
+{
+    if (!reference.startsWith(QLatin1Char('.')))
+        return domain == reference;
+
+    return domain.endsWith(reference) || domain == reference.midRef(1);
+}
+
+static bool isParentPath(const QString &path, const QString &reference)
+{
+    if (path.isEmpty())
+        return reference.isEmpty() || reference == QLatin1String("/");
+    if (!path.startsWith(reference))
+        return false;
+
+    return path.length() == reference.length() || reference.endsWith(QLatin1Char('/'))
+            || path.at(reference.length()) == QLatin1Char('/');
+}
+
+static bool isExpired(const QNetworkCookie &cookie, const QDateTime &now)
+{
+    return !cookie.isSessionCookie() && cookie.expirationDate() < now;
+}
+
+// Longer paths first, as RFC 6265 recommends
+static bool longerPath(const QNetworkCookie &a, const QNetworkCookie &b)
+{
+    return a.path().length() > b.path().length();
+}
+
 CookieJar::CookieJar(const QString &path, QObject *parent) :
     QNetworkCookieJar(parent),
     m_savePath(path),
-    m_persistSessions(false)
+    m_persistSessions(false),
+    m_saveTimer(-1),
+    m_count(0),
+    m_clock(0)
 {
     load();
+
+    // The jar isn't necessarily destroyed before the application exits
+    if (QCoreApplication::instance())
+        connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), this, SLOT(flush()));
 }
 
 CookieJar::~CookieJar()
 {
-    save();
+    flush();
+}
+
+QList<QNetworkCookie> CookieJar::cookiesForUrl(const QUrl &url) const
+{
+    QList<QNetworkCookie> result;
+
+    QString host = url.host().toLower();
+    QHash<QString, Bucket>::const_iterator bucket = m_buckets.constFind(bucketKey(host));
+    if (bucket == m_buckets.constEnd())
+        return result;
+
+    QString path = url.path();
+    QString scheme = url.scheme();
+    bool isEncrypted = scheme == QLatin1String("https") || scheme == QLatin1String("wss");
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    quint64 clock = ++m_clock;
+
+    foreach (const StoredCookie &stored, *bucket) {
+        const QNetworkCookie &cookie = stored.cookie;
+        if (!isParentDomain(host, cookie.domain()) || !isParentPath(path, cookie.path()))
+            continue;
+        if (isExpired(cookie, now) || (cookie.isSecure() && !isEncrypted))
+            continue;
+
+        stored.lastUsed = clock;
+        result.append(cookie);
+    }
+
+    std::stable_sort(result.begin(), result.end(), longerPath);
+    return result;
 }
 
 bool CookieJar::insertCookie(const QNetworkCookie &cookie)
 {
-    if (QNetworkCookieJar::insertCookie(cookie)) {
-        save(); // too aggressive to save on each insert?
+    bool removed = remove(cookie);
+
+    // An expired cookie is how servers delete one
+    bool inserted = !isExpired(cookie, QDateTime::currentDateTimeUtc()) && store(cookie);
+
+    if (removed || inserted)
+        scheduleSave();
+    return inserted;
+}
+
+bool CookieJar::updateCookie(const QNetworkCookie &cookie)
+{
+    if (!deleteCookie(cookie))
+        return false;
+    return insertCookie(cookie);
+}
+
+bool CookieJar::deleteCookie(const QNetworkCookie &cookie)
+{
+    if (remove(cookie)) {
+        scheduleSave();
         return true;
     }
     return false;
 }
 
-bool CookieJar::deleteCookie(const QNetworkCookie &cookie)
+bool CookieJar::store(const QNetworkCookie &cookie)
 {
-    if (QNetworkCookieJar::deleteCookie(cookie)) {
-        save();
-        return true;
+    // Done before taking the bucket, which this may erase
+    if (m_count >= MAX_COOKIES)
+        evictOldest();
+
+    Bucket &bucket = m_buckets[bucketKey(cookie.domain())];
+    if (bucket.size() >= MAX_COOKIES_PER_DOMAIN)
+        evict(bucket);
+
+    StoredCookie stored;
+    stored.cookie = cookie;
+    stored.lastUsed = ++m_clock;
+    bucket.append(stored);
+    m_count++;
+    return true;
+}
+
+bool CookieJar::remove(const QNetworkCookie &cookie)
+{
+    QHash<QString, Bucket>::iterator bucket = m_buckets.find(bucketKey(cookie.domain()));
+    if (bucket == m_buckets.end())
+        return false;
+
+    for (int i = 0; i < bucket->size(); ++i) {
+        if (bucket->at(i).cookie.hasSameIdentifier(cookie)) {
+            bucket->removeAt(i);
+            m_count--;
+            if (bucket->isEmpty())
+                m_buckets.erase(bucket);
+            return true;
+        }
     }
     return false;
 }
 
+// Makes room in a bucket by dropping an expired cookie, or the least
+// recently used one if none have expired
+void CookieJar::evict(Bucket &bucket)
+{
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    int victim = -1;
+    for (int i = 0; i < bucket.size(); ++i) {
+        if (isExpired(bucket.at(i).cookie, now)) {
+            victim = i;
+            break;
+        }
+        if (victim < 0 || bucket.at(i).lastUsed < bucket.at(victim).lastUsed)
+            victim = i;
+    }
+
+    if (victim >= 0) {
+        bucket.removeAt(victim);
+        m_count--;
+    }
+}
+
+void CookieJar::evictOldest()
+{
+    QHash<QString, Bucket>::iterator oldest = m_buckets.end();
+    int victim = -1;
+
+    QHash<QString, Bucket>::iterator it = m_buckets.begin();
+    for (; it != m_buckets.end(); ++it) {
+        for (int i = 0; i < it->size(); ++i) {
+            if (oldest == m_buckets.end() || it->at(i).lastUsed < oldest->at(victim).lastUsed) {
+                oldest = it;
+                victim = i;
+            }
+        }
+    }
+
+    if (oldest != m_buckets.end()) {
+        oldest->removeAt(victim);
+        m_count--;
+        if (oldest->isEmpty())
+            m_buckets.erase(oldest);
+    }
+}
+
+QList<QNetworkCookie> CookieJar::allCookies() const
+{
+    QList<QNetworkCookie> cookies;
+    cookies.reserve(m_count);
+    foreach (const Bucket &bucket, m_buckets) {
+        foreach (const StoredCookie &stored, bucket)
+            cookies.append(stored.cookie);
+    }
+    return cookies;
+}
+
+void CookieJar::setAllCookies(const QList<QNetworkCookie> &cookies)
+{
+    m_buckets.clear();
+    m_count = 0;
+    foreach (const QNetworkCookie &cookie, cookies) {
+        remove(cookie);
+        store(cookie);
+    }
+}
+
+void CookieJar::scheduleSave()
+{
+    if (m_saveTimer < 0)
+        m_saveTimer = startTimer(SAVE_DELAY);
+}
+
+void CookieJar::flush()
+{
+    if (m_saveTimer < 0)
+        return;
+
+    killTimer(m_saveTimer);
+    m_saveTimer = -1;
+    save();
+}
+
+void CookieJar::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() == m_saveTimer)
+        flush();
+    else
+        QNetworkCookieJar::timerEvent(event);
+}
+
 void CookieJar::save() const
 {
-    QFile file(m_savePath);
-    QDir dir = QFileInfo(file).dir();
+    // The old file stays in place until the new one has been written
+    // completely, so a crash can't leave a truncated cookie file behind
+    QSaveFile file(m_savePath);
+    QDir dir = QFileInfo(m_savePath).dir();
 
     if (!dir.mkpath(dir.absolutePath())) {
         qWarning("Could not create path for writing: %s", qUtf8Printable(dir.path()));
@@ -60,13 +302,18 @@ void CookieJar::save() const
     QTextStream out(&file);
     out.setCodec("UTF-8");
 
-    QList<QNetworkCookie> cookies = allCookies();
-    foreach (QNetworkCookie c, cookies) {
-        if (m_persistSessions || !c.isSessionCookie())
-            out << c.toRawForm() << endl;
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    foreach (const Bucket &bucket, m_buckets) {
+        foreach (const StoredCookie &stored, bucket) {
+            const QNetworkCookie &c = stored.cookie;
+            if ((m_persistSessions || !c.isSessionCookie()) && !isExpired(c, now))
+                out << c.toRawForm() << endl;
+        }
     }
 
-    file.close();
+    out.flush();
+    if (!file.commit())
+        qWarning("Could not write file: %s", qUtf8Printable(m_savePath));
 }
 
 void CookieJar::load()
@@ -97,15 +344,18 @@ void CookieJar::addCookie(const QString &cookieString)
     if (newCookies.length() == 0)
         return;
 
-    QList<QNetworkCookie> cookies = allCookies();
-    foreach (QNetworkCookie cookie, newCookies) {
+    foreach (const QNetworkCookie &cookie, newCookies) {
         bool found = false;
-        foreach (QNetworkCookie existing, cookies) {
-            if (cookie.hasSameIdentifier(existing)) {
-                found = true;
-                if (!existing.isHttpOnly())
-                    insertCookie(cookie);
-                break;
+        QHash<QString, Bucket>::const_iterator bucket =
+                m_buckets.constFind(bucketKey(cookie.domain()));
+        if (bucket != m_buckets.constEnd()) {
+            foreach (const StoredCookie &existing, *bucket) {
+                if (cookie.hasSameIdentifier(existing.cookie)) {
+                    found = true;
+                    if (!existing.cookie.isHttpOnly())
+                        insertCookie(cookie);
+                    break;
+                }
             }
         }
         if (!found)
@@ -121,16 +371,16 @@ void CookieJar::setPersistSessions(bool persist)
 void CookieJar::clearAll()
 {
     setAllCookies(QList<QNetworkCookie>());
-    save();
+    scheduleSave();
 }
 
 QString CookieJar::cookies() const
 {
     QStringList cookieString;
-    QList<QNetworkCookie> cookies = allCookies();
-    foreach (QNetworkCookie c, cookies) {
-        if (!c.isHttpOnly()) {
-            cookieString << c.toRawForm();
+    foreach (const Bucket &bucket, m_buckets) {
+        foreach (const StoredCookie &stored, bucket) {
+            if (!stored.cookie.isHttpOnly())
+                cookieString << stored.cookie.toRawForm();
         }
     }
 
@@ -4,10 +4,18 @@
 #ifndef COOKIEJAR_H
 #define COOKIEJAR_H
 
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtNetwork/QNetworkCookie>
 #include <QtNetwork/QNetworkCookieJar>
 
 namespace com { namespace cutehacks { namespace duperagent {
 
+// A QNetworkCookieJar that persists its cookies to disk. Cookies are kept
+// in buckets keyed by their registrable domain instead of one flat list, so
+// building the Cookie header for a request only looks at the cookies of that
+// site. Each site and the jar as a whole have a limit on
+// the number of cookies, beyond which the least recently used are evicted.
 class CookieJar : public QNetworkCookieJar
 {
     Q_OBJECT
@@ -16,7 +24,9 @@ public:
     CookieJar(const QString &path, QObject *parent = 0);
     ~CookieJar();
 
+    QList<QNetworkCookie> cookiesForUrl(const QUrl &) const;
     bool insertCookie(const QNetworkCookie &);
+    bool updateCookie(const QNetworkCookie &);
     bool deleteCookie(const QNetworkCookie &);
 
     QString cookies() const;
@@ -27,13 +37,41 @@ public:
 
     void clearAll();
 
+    // These replace QNetworkCookieJar's own storage, which is left empty
+    QList<QNetworkCookie> allCookies() const;
+    void setAllCookies(const QList<QNetworkCookie> &);
+
+public slots:
+    // Writes pending changes right away
+    void flush();
+
 protected:
     void save() const;
     void load();
+    void scheduleSave();
+    void timerEvent(QTimerEvent *);
 
 private:
+    struct StoredCookie
+    {
+        QNetworkCookie cookie;
+        mutable quint64 lastUsed;
+    };
+
+    typedef QList<StoredCookie> Bucket;
+
+    bool store(const QNetworkCookie &);
+    bool remove(const QNetworkCookie &);
+    void evict(Bucket &);
+    void evictOldest();
+
     QString m_savePath;
     bool m_persistSessions;
+    int m_saveTimer;
+
+    QHash<QString, Bucket> m_buckets;
+    int m_count;
+    mutable quint64 m_clock;
 };
 
 } } }
@@ -0,0 +1,75 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QVariant>
+#include <QtQml/QQmlEngine>
+
+#include "deferred.h"
+#include "promise.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// The factory is compiled once and kept on the engine
+static const char *FACTORY_PROPERTY = "_duperagent_deferred";
+
+static const char *FACTORY_SOURCE =
+    "(function() {"
+    "    var deferred = {};"
+    "    deferred.promise = new Promise(function(resolve, reject) {"
+    "        deferred.resolve = resolve;"
+    "        deferred.reject = reject;"
+    "    });"
+    "    return deferred;"
+    "})";
+
+static QJSValue factory(QQmlEngine *engine)
+{
+    QVariant cached = engine->property(FACTORY_PROPERTY);
+    if (cached.isValid())
+        return cached.value<QJSValue>();
+
+    QJSValue factory;
+    if (Deferred::nativeConstructor(engine).isCallable()) {
+        factory = engine->evaluate(QString::fromLatin1(FACTORY_SOURCE));
+        if (factory.isError()) {
+            qWarning("Could not create native promises: %s", qUtf8Printable(factory.toString()));
+            factory = QJSValue();
+        }
+    }
+    engine->setProperty(FACTORY_PROPERTY, QVariant::fromValue(factory));
+    return factory;
+}
+
+Deferred::Deferred(QQmlEngine *engine)
+{
+    QJSValue create = factory(engine);
+    if (create.isCallable()) {
+        QJSValue deferred = create.call();
+        m_promise = deferred.property("promise");
+        m_resolve = deferred.property("resolve");
+        m_reject = deferred.property("reject");
+    } else {
+        Promise *promise = new Promise(engine);
+        m_promise = promise->self();
+        m_resolve = m_promise.property("fulfill");
+        m_reject = m_promise.property("reject");
+    }
+}
+
+void Deferred::resolve(const QJSValue &value)
+{
+    m_resolve.call(QJSValueList() << value);
+}
+
+void Deferred::reject(const QJSValue &reason)
+{
+    m_reject.call(QJSValueList() << reason);
+}
+
+QJSValue Deferred::nativeConstructor(QQmlEngine *engine)
+{
+    QJSValue constructor = engine->globalObject().property("Promise");
+    return constructor.isCallable() ? constructor : QJSValue();
+}
+
+} } }
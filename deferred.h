@@ -0,0 +1,42 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include <QtQml/QJSValue>
+
+#include "qpm.h"
+
+class QQmlEngine;
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// A promise that is settled from C++, together with its resolving
+// functions. When the JavaScript engine has native promises (Qt 5.12 and
+// later) it is a native Promise, so that it works with anything else that
+// expects one. Otherwise it is one of our Promise objects.
+class Deferred
+{
+public:
+    Deferred() {}
+    explicit Deferred(QQmlEngine *);
+
+    bool isValid() const { return !m_promise.isUndefined(); }
+    QJSValue promise() const { return m_promise; }
+
+    void resolve(const QJSValue &);
+    void reject(const QJSValue &);
+
+    // The engine's Promise constructor, or undefined if it has none
+    static QJSValue nativeConstructor(QQmlEngine *);
+
+private:
+    QJSValue m_promise;
+    QJSValue m_resolve;
+    QJSValue m_reject;
+};
+
+} } }
+
+#endif // DEFERRED_H
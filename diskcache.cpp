@@ -0,0 +1,159 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDirIterator>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QMultiMap>
+
+#include "diskcache.h"
+
+#include <string.h>
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// File name suffix and directory QNetworkDiskCache uses for its entries
+static const QString DATA_SUFFIX = QStringLiteral(".d");
+static const QString PREPARED_DIR = QStringLiteral("/prepared/");
+static const QString DATA_DIR = QStringLiteral("data8/");
+
+// The file QNetworkDiskCache in Qt 5 stores the entry for a url in
+static QString entryPath(const QString &directory, const QUrl &url)
+{
+    QUrl cleanUrl = url;
+    cleanUrl.setPassword(QString());
+    cleanUrl.setFragment(QString());
+
+    QByteArray hash = QCryptographicHash::hash(cleanUrl.toEncoded(), QCryptographicHash::Sha1);
+    qlonglong prefix;
+    memcpy(&prefix, hash.constData(), sizeof(prefix));
+    QByteArray id = QByteArray::number(prefix, 36).left(8);
+    uint code = uint(id.at(id.length() - 1)) % 16;
+
+    QString path = directory;
+    if (!path.endsWith(QLatin1Char('/')))
+        path += QLatin1Char('/');
+    return path + DATA_DIR + QString::number(code, 16) + QLatin1Char('/')
+            + QString::fromLatin1(id) + DATA_SUFFIX;
+}
+
+DiskCache::DiskCache(const QString &directory, QObject *parent) :
+    QNetworkDiskCache(parent)
+{
+    setCacheDirectory(directory);
+    m_pinned = readPinnedUrls(directory);
+}
+
+QList<CacheEntryInfo> DiskCache::entries()
+{
+    QList<CacheEntryInfo> entries;
+    if (cacheDirectory().isEmpty())
+        return entries;
+
+    QDirIterator it(cacheDirectory(), QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        QString path = it.next();
+        if (!path.endsWith(DATA_SUFFIX) || path.contains(PREPARED_DIR))
+            continue;
+
+        QNetworkCacheMetaData metaData = fileMetaData(path);
+        if (!metaData.isValid())
+            continue;
+
+        CacheEntryInfo entry;
+        entry.url = metaData.url();
+        entry.size = it.fileInfo().size();
+        entry.lastModified = metaData.lastModified();
+        entry.expirationDate = metaData.expirationDate();
+        entries.append(entry);
+    }
+    return entries;
+}
+
+QNetworkCacheMetaData DiskCache::peek(const QUrl &url, qint64 *size)
+{
+    // Only reads the header of the entry's file
+    QNetworkCacheMetaData metaData = QNetworkDiskCache::metaData(url);
+    if (!metaData.isValid() || !size)
+        return metaData;
+
+    QFileInfo info(entryPath(cacheDirectory(), url));
+    if (info.exists()) {
+        *size = info.size();
+        return metaData;
+    }
+
+    // The layout of the cache directory is Qt's business, so look for the
+    // entry the slow way if it has changed
+    foreach (const CacheEntryInfo &entry, entries()) {
+        if (entry.url == metaData.url()) {
+            *size = entry.size;
+            break;
+        }
+    }
+    return metaData;
+}
+
+bool DiskCache::isPinned(const QUrl &url) const
+{
+    return m_pinned.contains(url);
+}
+
+void DiskCache::setPinned(const QUrl &url, bool pinned)
+{
+    if (pinned == m_pinned.contains(url))
+        return;
+
+    if (pinned)
+        m_pinned.insert(url);
+    else
+        m_pinned.remove(url);
+    writePinnedUrls(cacheDirectory(), m_pinned);
+}
+
+// Same policy as QNetworkDiskCache: the oldest files are removed until the
+// cache is down to 90% of its maximum size, except that pinned entries stay.
+qint64 DiskCache::expire()
+{
+    if (m_pinned.isEmpty())
+        return QNetworkDiskCache::expire();
+
+    if (cacheDirectory().isEmpty())
+        return 0;
+
+    QMultiMap<QDateTime, QString> files;
+    qint64 totalSize = 0;
+
+    QDirIterator it(cacheDirectory(), QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        QString path = it.next();
+        if (!path.endsWith(DATA_SUFFIX))
+            continue;
+
+        QFileInfo info = it.fileInfo();
+        QDateTime created = info.created();
+        files.insert(created.isValid() ? created : info.lastModified(), path);
+        totalSize += info.size();
+    }
+
+    qint64 goal = maximumCacheSize() * 9 / 10;
+    QMultiMap<QDateTime, QString>::const_iterator file = files.constBegin();
+    for (; file != files.constEnd() && totalSize >= goal; ++file) {
+        // Files that are still being written belong to QNetworkDiskCache
+        if (file.value().contains(PREPARED_DIR))
+            continue;
+
+        // Only the entries that are about to go are opened to check for pins
+        if (m_pinned.contains(fileMetaData(file.value()).url()))
+            continue;
+
+        qint64 size = QFileInfo(file.value()).size();
+        if (QFile::remove(file.value()))
+            totalSize -= size;
+    }
+
+    return totalSize;
+}
+
+} } }
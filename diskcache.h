@@ -0,0 +1,39 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <QtCore/QSet>
+#include <QtNetwork/QNetworkDiskCache>
+
+#include "qpm.h"
+#include "cacheinspector.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// QNetworkDiskCache with support for listing and pinning entries. Pinned
+// entries are skipped when the cache is trimmed to its maximum size.
+class DiskCache : public QNetworkDiskCache, public InspectableCache
+{
+    Q_OBJECT
+    Q_INTERFACES(com::cutehacks::duperagent::InspectableCache)
+
+public:
+    explicit DiskCache(const QString &directory, QObject *parent = 0);
+
+    QList<CacheEntryInfo> entries();
+    QNetworkCacheMetaData peek(const QUrl &, qint64 *size);
+    bool isPinned(const QUrl &) const;
+    void setPinned(const QUrl &, bool);
+
+protected:
+    qint64 expire();
+
+private:
+    QSet<QUrl> m_pinned;
+};
+
+} } }
+
+#endif // DISKCACHE_H
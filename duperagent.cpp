@@ -2,6 +2,7 @@
 // License can be found in the LICENSE file.
 
 #include <QtCore/QCoreApplication>
+#include <QtNetwork/QNetworkRequest>
 #include <QtQml/QQmlEngine>
 
 #include "duperagent.h"
@@ -11,21 +12,48 @@
 #include "promisemodule.h"
 #include "networkactivityindicator.h"
 #include "imageutils.h"
+#include "prefetcher.h"
+#include "cacheinspector.h"
+#include "requestqueue.h"
+#include "abortcontroller.h"
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 6, 0)
+#include "imageprovider.h"
+#endif
+
+#if QT_VERSION < QT_VERSION_CHECK(5, 6, 0)
+#include "jsvalueiterator.h"
+#else
+#include <QtQml/QJSValueIterator>
+typedef QJSValueIterator JSValueIterator;
+#endif
 
 namespace com { namespace cutehacks { namespace duperagent {
 
 static const char* DUPERAGENT_URI = "com.cutehacks.duperagent";
 
+static const char *PROP_PREFETCH_HEADERS        = "headers";
+static const char *PROP_PREFETCH_CONCURRENCY    = "concurrency";
+
 extern ContentTypeMap contentTypes;
 
 Request::Request(QQmlEngine *engine, QObject *parent) :
-    QObject(parent), m_engine(engine)
+    QObject(parent), m_engine(engine), m_prefetcher(0),
+    m_cache(new CacheInspector(engine, this))
 {
+    QQmlEngine::setObjectOwnership(m_cache, QQmlEngine::CppOwnership);
+
     contentTypes.insert("html", "text/html");
     contentTypes.insert("json", "application/json");
     contentTypes.insert("xml", "application/xml");
     contentTypes.insert("form", "application/x-www-form-urlencoded");
     contentTypes.insert("form-data", "application/x-www-form-urlencoded");
+    contentTypes.insert("cbor", "application/cbor");
+    contentTypes.insert("msgpack", "application/msgpack");
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 6, 0)
+    ImageProvider::install(engine);
+#endif
 }
 
 void Request::config(const QJSValue &options)
@@ -147,6 +175,64 @@ QJSValue Request::put(const QJSValue &url, const QJSValue &data, const QJSValue
     return proto->self();
 }
 
+void Request::prefetch(const QJSValue &urls, const QJSValue &options)
+{
+    Config::instance()->init(m_engine);
+
+    if (!m_prefetcher)
+        m_prefetcher = new Prefetcher(m_engine->networkAccessManager(), this);
+
+    if (options.hasProperty(QString::fromLatin1(PROP_PREFETCH_CONCURRENCY))) {
+        m_prefetcher->setMaxConcurrent(options.property(
+                    QString::fromLatin1(PROP_PREFETCH_CONCURRENCY)).toInt());
+    }
+
+    QNetworkRequest request;
+    QJSValue headers = options.property(QString::fromLatin1(PROP_PREFETCH_HEADERS));
+    if (headers.isObject()) {
+        JSValueIterator it(headers);
+        while (it.next()) {
+            request.setRawHeader(
+                        it.name().toUtf8(),
+                        it.value().toString().toUtf8());
+        }
+    }
+
+    if (urls.isArray()) {
+        quint32 length = urls.property("length").toUInt();
+        for (quint32 i = 0; i < length; i++) {
+            request.setUrl(QUrl(urls.property(i).toString()));
+            m_prefetcher->add(request);
+        }
+    } else {
+        request.setUrl(QUrl(urls.toString()));
+        m_prefetcher->add(request);
+    }
+}
+
+void Request::cancelPrefetch()
+{
+    if (m_prefetcher)
+        m_prefetcher->cancel();
+}
+
+QJSValue Request::abortController() const
+{
+    return m_engine->newQObject(new AbortController());
+}
+
+QObject *Request::cache() const
+{
+    return m_cache;
+}
+
+QObject *Request::queue() const
+{
+    QObject *queue = RequestQueue::instance(m_engine);
+    QQmlEngine::setObjectOwnership(queue, QQmlEngine::CppOwnership);
+    return queue;
+}
+
 QJSValue Request::cookie() const
 {
     Config::instance()->init(m_engine);
@@ -238,6 +324,11 @@ static void registerTypes()
         "ImageUtils",
         iu_provider);
 
+    qmlRegisterType<AbortController>(
+        DUPERAGENT_URI,
+        1, 0,
+        "AbortController");
+
     qmlRegisterUncreatableType<CacheControl>(
         DUPERAGENT_URI,
         1, 0,
@@ -251,6 +342,8 @@ static void registerTypes()
                 "Duperagent ResponseType enums.");
 
     qmlProtectModule(DUPERAGENT_URI, 1);
+
+    Config::instance()->startBackgroundInit();
 }
 
 Q_COREAPP_STARTUP_FUNCTION(registerTypes)
@@ -15,6 +15,9 @@ class QJsEngine;
 
 namespace com { namespace cutehacks { namespace duperagent {
 
+class Prefetcher;
+class CacheInspector;
+
 class ResponseType : public QObject {
     Q_OBJECT
     Q_ENUMS(Types)
@@ -36,6 +39,8 @@ public:
     Request(QQmlEngine *engine, QObject *parent = 0);
 
     Q_PROPERTY(QJSValue cookie READ cookie WRITE setCookie)
+    Q_PROPERTY(QObject *cache READ cache CONSTANT)
+    Q_PROPERTY(QObject *queue READ queue CONSTANT)
 
     Q_INVOKABLE void config(const QJSValue &);
 
@@ -57,6 +62,14 @@ public:
                               const QJSValue& = QJSValue(),
                               const QJSValue& = QJSValue()) const;
 
+    Q_INVOKABLE void prefetch(const QJSValue&, const QJSValue& = QJSValue());
+    Q_INVOKABLE void cancelPrefetch();
+
+    Q_INVOKABLE QJSValue abortController() const;
+
+    QObject *cache() const;
+    QObject *queue() const;
+
     QJSValue cookie() const;
     void setCookie(const QJSValue &);
 
@@ -64,6 +77,8 @@ public:
 
 private:
     QQmlEngine *m_engine;
+    Prefetcher *m_prefetcher;
+    CacheInspector *m_cache;
 };
 
 } } }
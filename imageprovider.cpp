@@ -0,0 +1,268 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QBuffer>
+#include <QtCore/QCache>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QEvent>
+#include <QtCore/QMutex>
+#include <QtCore/QMutexLocker>
+#include <QtCore/QScopedPointer>
+#include <QtCore/QSemaphore>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QThreadPool>
+#include <QtGui/QImageReader>
+#include <QtNetwork/QAbstractNetworkCache>
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtQml/QQmlEngine>
+
+#include "imageprovider.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+const char *ImageProvider::ID = "duperagent";
+
+// Upper bound for encoded image data kept in memory. Entries beyond this are
+// evicted and re-read from the network cache if they are requested again.
+static const int MAX_STORE_COST = 32 * 1024 * 1024;
+
+// Number of urls remembered for ids whose data may have been evicted. They
+// are what the network cache is asked for, and are dropped least recently
+// used first like the data.
+static const int MAX_STORE_SOURCES = 4096;
+
+// How long a decode job waits for the GUI thread to read the network cache.
+static const int CACHE_READ_TIMEOUT = 5000;
+
+class ImageStore
+{
+public:
+    ImageStore() : m_counter(0)
+    {
+        m_data.setMaxCost(MAX_STORE_COST);
+        m_sources.setMaxCost(MAX_STORE_SOURCES);
+    }
+
+    QString insert(const QUrl &source, const QByteArray &data)
+    {
+        QMutexLocker lock(&m_mutex);
+        QString id = QString::number(++m_counter);
+        m_sources.insert(id, new QUrl(source));
+        m_data.insert(id, new QByteArray(data), data.size());
+        return id;
+    }
+
+    bool lookup(const QString &id, QByteArray *data, QUrl *source)
+    {
+        QMutexLocker lock(&m_mutex);
+        QUrl *s = m_sources.object(id);
+        QByteArray *d = m_data.object(id);
+        if (s)
+            *source = *s;
+        if (d)
+            *data = *d;
+        return s || d;
+    }
+
+private:
+    QMutex m_mutex;
+    quint64 m_counter;
+    QCache<QString, QUrl> m_sources;
+    QCache<QString, QByteArray> m_data;
+};
+
+Q_GLOBAL_STATIC(ImageStore, imageStore)
+
+struct CacheRead
+{
+    QUrl url;
+    QByteArray data;
+    QSemaphore done;
+};
+
+static const QEvent::Type CACHE_READ_EVENT =
+        static_cast<QEvent::Type>(QEvent::registerEventType());
+
+class CacheReadEvent : public QEvent
+{
+public:
+    explicit CacheReadEvent(QSharedPointer<CacheRead> r) :
+        QEvent(CACHE_READ_EVENT),
+        read(r)
+    { }
+
+    ~CacheReadEvent()
+    {
+        // Wake the waiting decoder even if the event was never delivered
+        read->done.release();
+    }
+
+    QSharedPointer<CacheRead> read;
+};
+
+ImageCacheReader::ImageCacheReader(QQmlEngine *engine) :
+    QObject(0),
+    m_engine(engine)
+{ }
+
+QByteArray ImageCacheReader::read(const QUrl &url) const
+{
+    QAbstractNetworkCache *cache = m_engine->networkAccessManager()->cache();
+    if (!cache)
+        return QByteArray();
+
+    QScopedPointer<QIODevice> device(cache->data(url));
+    if (!device)
+        return QByteArray();
+
+    return device->readAll();
+}
+
+QByteArray ImageCacheReader::fetch(const QString &id)
+{
+    QByteArray data;
+    QUrl source;
+    if (!imageStore()->lookup(id, &data, &source) || !data.isEmpty())
+        return data;
+
+    // Post the cache read to our own thread and wait for the result here on
+    // the decoding thread.
+    QSharedPointer<CacheRead> read(new CacheRead);
+    read->url = source;
+    QCoreApplication::postEvent(this, new CacheReadEvent(read));
+    if (!read->done.tryAcquire(1, CACHE_READ_TIMEOUT))
+        return QByteArray();
+
+    return read->data;
+}
+
+bool ImageCacheReader::event(QEvent *e)
+{
+    if (e->type() == CACHE_READ_EVENT) {
+        CacheReadEvent *ev = static_cast<CacheReadEvent*>(e);
+        ev->read->data = read(ev->read->url);
+        return true;
+    }
+    return QObject::event(e);
+}
+
+ImageDecodeJob::ImageDecodeJob(ImageCacheReader *reader, const QString &id,
+                               const QSize &requestedSize) :
+    QObject(),
+    QRunnable(),
+    m_reader(reader),
+    m_id(id),
+    m_requestedSize(requestedSize)
+{ }
+
+void ImageDecodeJob::run()
+{
+    QByteArray data;
+    ImageCacheReader *cacheReader = m_reader.data();
+    if (cacheReader)
+        data = cacheReader->fetch(m_id);
+
+    if (data.isEmpty()) {
+        emit done(QImage(), QStringLiteral("Image data is no longer available: %1").arg(m_id));
+        return;
+    }
+
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer);
+
+    if (m_requestedSize.width() > 0 || m_requestedSize.height() > 0) {
+        QSize original = reader.size();
+        if (original.isValid()) {
+            QSize bounds = m_requestedSize;
+            if (bounds.width() <= 0)
+                bounds.setWidth(original.width() * bounds.height() / qMax(1, original.height()));
+            if (bounds.height() <= 0)
+                bounds.setHeight(original.height() * bounds.width() / qMax(1, original.width()));
+            reader.setScaledSize(original.scaled(bounds, Qt::KeepAspectRatio));
+        }
+    }
+
+    QImage image;
+    if (!reader.read(&image)) {
+        emit done(QImage(), reader.errorString());
+        return;
+    }
+
+    emit done(image, QString());
+}
+
+ImageResponse::ImageResponse(ImageCacheReader *reader, const QString &id,
+                             const QSize &requestedSize) :
+    QQuickImageResponse()
+{
+    ImageDecodeJob *job = new ImageDecodeJob(reader, id, requestedSize);
+    connect(job, &ImageDecodeJob::done, this, &ImageResponse::handleDone);
+    QThreadPool::globalInstance()->start(job);
+}
+
+QQuickTextureFactory *ImageResponse::textureFactory() const
+{
+    return QQuickTextureFactory::textureFactoryForImage(m_image);
+}
+
+QString ImageResponse::errorString() const
+{
+    return m_error;
+}
+
+void ImageResponse::handleDone(const QImage &image, const QString &error)
+{
+    m_image = image;
+    m_error = error;
+    emit finished();
+}
+
+ImageProvider::ImageProvider(QQmlEngine *engine) :
+    QQuickAsyncImageProvider(),
+    m_reader(new ImageCacheReader(engine))
+{ }
+
+QQuickImageResponse *ImageProvider::requestImageResponse(const QString &id,
+                                                         const QSize &requestedSize)
+{
+    return new ImageResponse(m_reader.data(), id, requestedSize);
+}
+
+void ImageProvider::install(QQmlEngine *engine)
+{
+    if (!engine->imageProvider(QString::fromLatin1(ID)))
+        engine->addImageProvider(QString::fromLatin1(ID), new ImageProvider(engine));
+}
+
+QUrl ImageProvider::insert(const QUrl &source, const QByteArray &data)
+{
+    QUrl url;
+    url.setScheme(QStringLiteral("image"));
+    url.setHost(QString::fromLatin1(ID));
+    url.setPath(QChar('/') + imageStore()->insert(source, data));
+    return url;
+}
+
+QByteArray ImageProvider::imageData(QQmlEngine *engine, const QUrl &url)
+{
+    QByteArray data;
+    QUrl source;
+    if (!imageStore()->lookup(url.path().mid(1), &data, &source))
+        return data;
+
+    if (data.isEmpty()) {
+        ImageProvider *provider = static_cast<ImageProvider*>(
+                    engine->imageProvider(QString::fromLatin1(ID)));
+        if (provider)
+            data = provider->m_reader->read(source);
+    }
+    return data;
+}
+
+bool ImageProvider::isImageUrl(const QUrl &url)
+{
+    return url.scheme() == QLatin1String("image") && url.host() == QLatin1String(ID);
+}
+
+} } }
@@ -0,0 +1,103 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef IMAGEPROVIDER_H
+#define IMAGEPROVIDER_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QPointer>
+#include <QtCore/QRunnable>
+#include <QtCore/QScopedPointer>
+#include <QtCore/QSize>
+#include <QtCore/QUrl>
+#include <QtGui/QImage>
+#include <QtQuick/QQuickAsyncImageProvider>
+
+#include "qpm.h"
+
+class QQmlEngine;
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Reads image data from the network cache on behalf of decoding threads. It
+// lives in the thread that owns the engine since the cache belongs to it.
+class ImageCacheReader : public QObject
+{
+public:
+    explicit ImageCacheReader(QQmlEngine *);
+
+    QByteArray read(const QUrl &) const;
+    QByteArray fetch(const QString &);
+
+protected:
+    bool event(QEvent *);
+
+private:
+    QQmlEngine *m_engine;
+};
+
+class ImageDecodeJob : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    ImageDecodeJob(ImageCacheReader *, const QString &, const QSize &);
+    void run();
+
+signals:
+    void done(const QImage &, const QString &);
+
+private:
+    QPointer<ImageCacheReader> m_reader;
+    QString m_id;
+    QSize m_requestedSize;
+};
+
+class ImageResponse : public QQuickImageResponse
+{
+    Q_OBJECT
+
+public:
+    ImageResponse(ImageCacheReader *, const QString &, const QSize &);
+
+    QQuickTextureFactory *textureFactory() const;
+    QString errorString() const;
+
+private slots:
+    void handleDone(const QImage &, const QString &);
+
+private:
+    QImage m_image;
+    QString m_error;
+};
+
+class ImageProvider : public QQuickAsyncImageProvider
+{
+public:
+    explicit ImageProvider(QQmlEngine *);
+
+    QQuickImageResponse *requestImageResponse(const QString &, const QSize &);
+
+    // Registers the image provider with the engine if it isn't already.
+    static void install(QQmlEngine *);
+
+    // Stores downloaded image data and returns an image://duperagent/<id>
+    // url that QML Image elements can load from.
+    static QUrl insert(const QUrl &source, const QByteArray &data);
+
+    // Returns the encoded image data for an image://duperagent url, falling
+    // back to the network cache if the in-memory copy has been evicted.
+    // Must be called from the thread that owns the engine.
+    static QByteArray imageData(QQmlEngine *, const QUrl &);
+
+    static bool isImageUrl(const QUrl &);
+
+    static const char *ID;
+
+private:
+    QScopedPointer<ImageCacheReader> m_reader;
+};
+
+} } }
+
+#endif // IMAGEPROVIDER_H
@@ -3,15 +3,227 @@
 
 #include <QtCore/QFileInfo>
 #include <QtCore/QBuffer>
+#include <QtCore/QThreadPool>
 #include <QtCore/QUrl>
 #include <QtGui/QImageReader>
 #include <QtQml/QQmlEngine>
 #include "imageutils.h"
 
+#if QT_VERSION >= QT_VERSION_CHECK(5, 6, 0)
+#include "imageprovider.h"
+#endif
+
 #include <QDebug>
 
 namespace com { namespace cutehacks { namespace duperagent {
 
+// Decoded pixels that ImageUtils.process() keeps in flight by default, about
+// 192 MB of 32-bit images
+static const qint64 DEFAULT_PIXEL_BUDGET = 48 * 1024 * 1024;
+
+ImageReadSettings ImageReadSettings::forSource(QQmlEngine *engine, const QString &source)
+{
+    ImageReadSettings settings;
+    if (source.startsWith(QStringLiteral("data:"))) {
+        int comma = source.indexOf(QChar(','));
+        QStringRef data = source.midRef(comma+1);
+        settings.data = QByteArray::fromBase64(data.toLatin1());
+#if QT_VERSION >= QT_VERSION_CHECK(5, 6, 0)
+    } else if (ImageProvider::isImageUrl(QUrl(source))) {
+        settings.data = ImageProvider::imageData(engine, QUrl(source));
+#endif
+    } else {
+        QUrl url(source);
+        settings.fileName = url.isLocalFile() ? url.toLocalFile() : source;
+    }
+    Q_UNUSED(engine);
+    return settings;
+}
+
+ImageReadTask::ImageReadTask(const ImageReadSettings &settings) :
+    QObject(0),
+    m_settings(settings)
+{
+    setAutoDelete(false);
+}
+
+void ImageReadTask::start()
+{
+    // Connected last so the receivers see the result before the task is gone
+    connect(this, SIGNAL(finished(QByteArray,QString,QString)), this, SLOT(deleteLater()));
+    QThreadPool::globalInstance()->start(this);
+}
+
+void ImageReadTask::run()
+{
+    QBuffer buffer;
+    QImageReader reader;
+    configure(&reader, &buffer, &m_settings);
+
+    QByteArray data;
+    QString mimeType;
+    QString error;
+    read(&reader, m_settings.format, m_settings.quality, &data, &mimeType, &error);
+
+    emit finished(data, mimeType, error);
+}
+
+void ImageReadTask::configure(QImageReader *reader, QBuffer *buffer,
+                              ImageReadSettings *settings)
+{
+    if (settings->fileName.isEmpty()) {
+        buffer->setBuffer(&settings->data);
+        reader->setDevice(buffer);
+    } else {
+        reader->setFileName(settings->fileName);
+    }
+
+    if (settings->scaledSize.isValid()) {
+        QSize scaledSize = settings->scaledSize;
+        if (settings->aspectRatioMode >= 0)
+            scaledSize = reader->size().scaled(
+                scaledSize, (Qt::AspectRatioMode)settings->aspectRatioMode);
+        reader->setScaledSize(scaledSize);
+    }
+    if (settings->clipRect.isValid())
+        reader->setClipRect(settings->clipRect);
+    if (settings->scaledClipRect.isValid())
+        reader->setScaledClipRect(settings->scaledClipRect);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    reader->setAutoTransform(settings->autoTransform);
+#endif
+}
+
+bool ImageReadTask::read(QImageReader *reader, const QByteArray &requestedFormat, int quality,
+                         QByteArray *data, QString *mimeType, QString *error)
+{
+    QByteArray format = requestedFormat.isEmpty() ? reader->format() : requestedFormat;
+
+    QImage img = reader->read();
+    if (img.isNull()) {
+        *error = reader->errorString();
+        return false;
+    }
+
+    QBuffer buffer(data);
+    buffer.open(QIODevice::WriteOnly);
+    img.save(&buffer, format.constData(), quality);
+    *mimeType = QStringLiteral("image/%1")
+        .arg(QString::fromLatin1(format.constData()));
+
+    return true;
+}
+
+ImageBatch::ImageBatch(QQmlEngine *engine, const QList<ImageReadSettings> &settings,
+                       QObject *parent) :
+    QObject(parent),
+    m_engine(engine),
+    m_settings(settings),
+    m_pixelBudget(DEFAULT_PIXEL_BUDGET),
+    m_pixelsInFlight(0),
+    m_maxConcurrent(qMax(1, QThreadPool::globalInstance()->maxThreadCount())),
+    m_next(0),
+    m_nextPixels(-1),
+    m_remaining(settings.size())
+{
+}
+
+QJSValue ImageBatch::start()
+{
+    m_deferred = Deferred(m_engine);
+    m_results = m_engine->newArray(m_settings.size());
+
+    if (m_remaining == 0) {
+        m_deferred.resolve(m_results);
+        QMetaObject::invokeMethod(this, "finished", Qt::QueuedConnection);
+        QMetaObject::invokeMethod(this, "deleteLater", Qt::QueuedConnection);
+        return m_deferred.promise();
+    }
+
+    pump();
+    return m_deferred.promise();
+}
+
+qint64 ImageBatch::decodedPixels(ImageReadSettings settings) const
+{
+    // Only the header is read here, the size is needed to know how much
+    // memory the decoder will use before the image has been scaled down
+    QBuffer buffer;
+    QImageReader reader;
+    ImageReadTask::configure(&reader, &buffer, &settings);
+
+    QSize size = reader.size();
+    qint64 pixels = size.isValid() ? qint64(size.width()) * size.height() : 0;
+    QSize scaled = reader.scaledSize();
+    if (scaled.isValid())
+        pixels += qint64(scaled.width()) * scaled.height();
+    return pixels;
+}
+
+void ImageBatch::pump()
+{
+    while (m_next < m_settings.size() && m_running.size() < m_maxConcurrent) {
+        // Kept while the image waits for the budget, to read the header once
+        if (m_nextPixels < 0)
+            m_nextPixels = decodedPixels(m_settings.at(m_next));
+        qint64 pixels = m_nextPixels;
+
+        // An image larger than the whole budget still gets decoded, just
+        // not alongside anything else
+        if (!m_running.isEmpty() && m_pixelsInFlight + pixels > m_pixelBudget)
+            break;
+
+        int index = m_next++;
+        m_nextPixels = -1;
+        ImageReadTask *task = new ImageReadTask(m_settings.at(index));
+        m_settings[index] = ImageReadSettings(); // drop any data held in memory
+        connect(task, SIGNAL(finished(QByteArray,QString,QString)),
+                this, SLOT(handleFinished(QByteArray,QString,QString)));
+        m_running.insert(task, qMakePair(index, pixels));
+        m_pixelsInFlight += pixels;
+        task->start();
+    }
+}
+
+void ImageBatch::handleFinished(const QByteArray &data, const QString &mimeType,
+                                const QString &error)
+{
+    QPair<int, qint64> running = m_running.take(sender());
+    m_pixelsInFlight -= running.second;
+    m_remaining--;
+
+    QJSValue err(QJSValue::NullValue);
+    QJSValue image(QJSValue::NullValue);
+    if (error.isEmpty()) {
+        image = (new Image(m_engine, data, mimeType))->self();
+    } else {
+        qWarning("Error reading image: %s", qUtf8Printable(error));
+        err = m_engine->globalObject().property("Error").callAsConstructor(
+                    QJSValueList() << error);
+    }
+    m_results.setProperty(quint32(running.first), image);
+
+    // Start the next reads before calling out, so the pool stays busy while
+    // the callback runs
+    pump();
+
+    if (m_onResult.isCallable()) {
+        QJSValue ret = m_onResult.call(QJSValueList() << err << image << running.first);
+        if (ret.isError()) {
+            qWarning("%s: %s (%s)",
+                qUtf8Printable(ret.toString()),
+                qUtf8Printable(ret.property("fileName").toString()),
+                qUtf8Printable(ret.property("lineNumber").toString()));
+        }
+    }
+
+    if (m_remaining == 0) {
+        m_deferred.resolve(m_results);
+        emit finished();
+        deleteLater();
+    }
+}
+
 ImageUtils::ImageUtils(QQmlEngine *engine) :
     QObject(0),
     m_engine(engine)
@@ -22,24 +234,113 @@ QJSValue ImageUtils::createReader(const QString &filename)
     return (new Image(m_engine, filename))->self();
 }
 
+QJSValue ImageUtils::process(const QJSValue &files, const QJSValue &options)
+{
+    ImageReadSettings common;
+    QJSValue onResult;
+    qint64 pixelBudget = DEFAULT_PIXEL_BUDGET;
+    int concurrency = 0;
+
+    if (options.isObject()) {
+        QJSValue scaledSize = options.property("scaledSize");
+        if (scaledSize.isObject()) {
+            common.scaledSize = QSize(scaledSize.property("width").toInt(),
+                                      scaledSize.property("height").toInt());
+            QJSValue mode = scaledSize.property("mode");
+            if (mode.isNumber()) {
+                int m = mode.toInt();
+                if (m < 0 || m > 2)
+                    qWarning("Invalid scale mode");
+                else
+                    common.aspectRatioMode = m;
+            }
+        }
+
+        QJSValue clip = options.property("clip");
+        if (clip.isObject()) {
+            QRect rect(clip.property("x").toInt(), clip.property("y").toInt(),
+                       clip.property("width").toInt(), clip.property("height").toInt());
+            if (common.scaledSize.isValid())
+                common.scaledClipRect = rect;
+            else
+                common.clipRect = rect;
+        }
+
+        QJSValue transcode = options.property("transcode");
+        if (transcode.isObject()) {
+            QJSValue f = transcode.property("format");
+            if (!f.isUndefined())
+                common.format = f.toString().toUtf8();
+
+            QJSValue q = transcode.property("quality");
+            if (!q.isUndefined())
+                common.quality = q.toInt();
+        }
+
+        common.autoTransform = options.property("autoTransform").toBool();
+
+        QJSValue budget = options.property("pixelBudget");
+        if (budget.isNumber())
+            pixelBudget = qint64(budget.toNumber());
+
+        concurrency = options.property("concurrency").toInt();
+        onResult = options.property("onResult");
+    }
+
+    QList<ImageReadSettings> settings;
+    int length = files.property("length").toInt();
+    for (int i = 0; i < length; i++) {
+        ImageReadSettings s = ImageReadSettings::forSource(
+                    m_engine, files.property(i).toString());
+        s.scaledSize = common.scaledSize;
+        s.aspectRatioMode = common.aspectRatioMode;
+        s.clipRect = common.clipRect;
+        s.scaledClipRect = common.scaledClipRect;
+        s.autoTransform = common.autoTransform;
+        s.format = common.format;
+        s.quality = common.quality;
+        settings.append(s);
+    }
+
+    ImageBatch *batch = new ImageBatch(m_engine, settings, this);
+    batch->setPixelBudget(pixelBudget);
+    if (concurrency > 0)
+        batch->setMaxConcurrent(concurrency);
+    batch->setResultCallback(onResult);
+    return batch->start();
+}
+
 Image::Image(QQmlEngine *engine, const QString &filename) :
     AbstractMultipartSource(),
     m_engine(engine)
 {
     m_self = engine->newQObject(this);
     engine->setObjectOwnership(this, QQmlEngine::JavaScriptOwnership);
-    if (filename.startsWith(QStringLiteral("data:"))) {
-        int comma = filename.indexOf(QChar(','));
-        QStringRef data = filename.midRef(comma+1);
+
+    ImageReadSettings settings = ImageReadSettings::forSource(engine, filename);
+    if (settings.fileName.isEmpty()) {
         QBuffer *buffer = new QBuffer(this);
-        buffer->setData(QByteArray::fromBase64(data.toLatin1()));
+        buffer->setData(settings.data);
         m_reader = new QImageReader(buffer);
     } else {
-        QUrl url(filename);
-        m_reader = new QImageReader(url.isLocalFile() ? url.toLocalFile() : filename);
+        m_reader = new QImageReader(settings.fileName);
     }
 }
 
+Image::Image(QQmlEngine *engine, const QByteArray &data, const QString &mimeType) :
+    AbstractMultipartSource(),
+    m_engine(engine),
+    m_data(data),
+    m_mimeType(mimeType)
+{
+    m_self = engine->newQObject(this);
+    engine->setObjectOwnership(this, QQmlEngine::JavaScriptOwnership);
+
+    QBuffer *buffer = new QBuffer(this);
+    buffer->setData(data);
+    m_reader = new QImageReader(buffer);
+}
+
 Image::~Image()
 {
     delete m_reader;
@@ -110,8 +411,9 @@ QString Image::toJSON()
 
 QJSValue Image::read(const QJSValue& options)
 {
-    QByteArray format = m_reader->format();
+    QByteArray format;
     int quality = -1;
+    bool async = false;
 
     if (options.isObject()) {
         QJSValue transcodeOptions = options.property("transcode");
@@ -124,23 +426,69 @@ QJSValue Image::read(const QJSValue& options)
             if (!q.isUndefined())
                 quality = q.toInt();
         }
+
+        async = options.property("async").toBool();
     }
 
-    QImage img = m_reader->read();
-    if (img.isNull()) {
-        qWarning("Error reading image: %s", qUtf8Printable(m_reader->errorString()));
-        return self();
+    if (async) {
+        // A read that is already running is shared rather than started again
+        if (!m_pendingRead.isValid()) {
+            ImageReadSettings settings = readSettings();
+            settings.format = format;
+            settings.quality = quality;
+
+            ImageReadTask *task = new ImageReadTask(settings);
+            connect(task, SIGNAL(finished(QByteArray,QString,QString)),
+                    this, SLOT(handleReadFinished(QByteArray,QString,QString)));
+            m_pendingRead = Deferred(m_engine);
+            task->start();
+        }
+        return m_pendingRead.promise();
     }
 
-    QBuffer buffer(&m_data);
-    buffer.open(QIODevice::WriteOnly);
-    img.save(&buffer, format.constData(), quality);
-    m_mimeType = QStringLiteral("image/%1")
-        .arg(QString::fromLatin1(format.constData()));
+    QString error;
+    if (!ImageReadTask::read(m_reader, format, quality, &m_data, &m_mimeType, &error))
+        qWarning("Error reading image: %s", qUtf8Printable(error));
 
     return self();
 }
 
+void Image::handleReadFinished(const QByteArray &data, const QString &mimeType,
+                               const QString &error)
+{
+    Deferred pending = m_pendingRead;
+    m_pendingRead = Deferred();
+
+    if (!error.isEmpty()) {
+        qWarning("Error reading image: %s", qUtf8Printable(error));
+        pending.reject(m_engine->globalObject().property("Error").callAsConstructor(
+                           QJSValueList() << error));
+        return;
+    }
+
+    m_data = data;
+    m_mimeType = mimeType;
+    pending.resolve(self());
+}
+
+ImageReadSettings Image::readSettings() const
+{
+    ImageReadSettings settings;
+    settings.fileName = m_reader->fileName();
+    if (settings.fileName.isEmpty()) {
+        QBuffer *buffer = qobject_cast<QBuffer*>(m_reader->device());
+        if (buffer)
+            settings.data = buffer->data();
+    }
+    settings.scaledSize = m_reader->scaledSize();
+    settings.clipRect = m_reader->clipRect();
+    settings.scaledClipRect = m_reader->scaledClipRect();
+#if QT_VERSION >= QT_VERSION_CHECK(5, 5, 0)
+    settings.autoTransform = m_reader->autoTransform();
+#endif
+    return settings;
+}
+
 QByteArray Image::data() const
 {
     return m_data;
@@ -5,20 +5,79 @@
 #define IMAGEUTILS_H
 
 #include <QObject>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QRect>
+#include <QtCore/QRunnable>
+#include <QtCore/QSize>
 #include <QtQml/QJSValue>
 #include "multipartsource.h"
+#include "deferred.h"
 
+class QBuffer;
 class QQmlEngine;
 class QImageReader;
 
 namespace com { namespace cutehacks { namespace duperagent {
 
+// Everything needed to decode an image away from the QImageReader it was
+// configured on, which can't be shared between threads
+struct ImageReadSettings
+{
+    ImageReadSettings() : aspectRatioMode(-1), autoTransform(false), quality(-1) {}
+
+    // Reads a file path, a data URI or an image:// URL returned by a request
+    static ImageReadSettings forSource(QQmlEngine *, const QString &);
+
+    QString fileName;
+    QByteArray data;
+    QSize scaledSize;
+    int aspectRatioMode; // fits the scaled size to the image's own when set
+    QRect clipRect;
+    QRect scaledClipRect;
+    bool autoTransform;
+    QByteArray format; // of the result; the source format when empty
+    int quality;
+};
+
+// Decodes, scales, clips and encodes an image on a QThreadPool thread. The
+// result is delivered through the finished signal, after which the task
+// deletes itself in the thread it was created in.
+class ImageReadTask : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    explicit ImageReadTask(const ImageReadSettings &);
+
+    // Queues the task on the global thread pool. Receivers have to be
+    // connected before, as the task is deleted after finished is delivered.
+    void start();
+
+    void run();
+
+    // Points the reader at the source of the settings, using the buffer for
+    // data held in memory, and applies the settings
+    static void configure(QImageReader *, QBuffer *, ImageReadSettings *);
+
+    // Does the work of a task on the calling thread
+    static bool read(QImageReader *, const QByteArray &format, int quality,
+                     QByteArray *data, QString *mimeType, QString *error);
+
+signals:
+    void finished(const QByteArray &data, const QString &mimeType, const QString &error);
+
+private:
+    ImageReadSettings m_settings;
+};
+
 class Image : public AbstractMultipartSource
 {
     Q_OBJECT
 
 public:
     Image(QQmlEngine *, const QString &);
+    Image(QQmlEngine *, const QByteArray &data, const QString &mimeType);
     ~Image();
 
     QJSValue self() const { return m_self; }
@@ -37,12 +96,59 @@ public:
     QByteArray data() const;
     QString mimeType() const;
 
+private slots:
+    void handleReadFinished(const QByteArray &, const QString &, const QString &);
+
 private:
+    ImageReadSettings readSettings() const;
+
     QQmlEngine *m_engine;
     QImageReader *m_reader;
     QByteArray m_data;
     QString m_mimeType;
     QJSValue m_self;
+    Deferred m_pendingRead;
+};
+
+// Runs the reads of ImageUtils.process() on the thread pool, as many at a
+// time as there are threads, as long as the decoded images fit in the pixel
+// budget. Each result is reported as soon as it comes in.
+class ImageBatch : public QObject
+{
+    Q_OBJECT
+
+public:
+    ImageBatch(QQmlEngine *, const QList<ImageReadSettings> &, QObject *parent = 0);
+
+    void setPixelBudget(qint64 pixels) { m_pixelBudget = pixels; }
+    void setMaxConcurrent(int maxConcurrent) { m_maxConcurrent = qMax(1, maxConcurrent); }
+    void setResultCallback(const QJSValue &callback) { m_onResult = callback; }
+
+    // Starts the batch and returns a promise for the array of results
+    QJSValue start();
+
+signals:
+    void finished();
+
+private slots:
+    void handleFinished(const QByteArray &, const QString &, const QString &);
+
+private:
+    void pump();
+    qint64 decodedPixels(ImageReadSettings) const;
+
+    QQmlEngine *m_engine;
+    QList<ImageReadSettings> m_settings;
+    QJSValue m_onResult;
+    Deferred m_deferred;
+    QJSValue m_results;
+    QHash<QObject*, QPair<int, qint64> > m_running;
+    qint64 m_pixelBudget;
+    qint64 m_pixelsInFlight;
+    int m_maxConcurrent;
+    int m_next;
+    qint64 m_nextPixels;
+    int m_remaining;
 };
 
 class ImageUtils : public QObject
@@ -52,6 +158,7 @@ class ImageUtils : public QObject
 public:
     explicit ImageUtils(QQmlEngine *);
     Q_INVOKABLE QJSValue createReader(const QString&);
+    Q_INVOKABLE QJSValue process(const QJSValue&, const QJSValue& = QJSValue());
 
 private:
     QQmlEngine *m_engine;
@@ -0,0 +1,132 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include "mediatype.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// RFC 7230 tchar
+static inline bool isTokenChar(char c)
+{
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+        return true;
+    switch (c) {
+    case '!': case '#': case '$': case '%': case '&': case '\'': case '*':
+    case '+': case '-': case '.': case '^': case '_': case '`': case '|': case '~':
+        return true;
+    default:
+        return false;
+    }
+}
+
+static inline const char *skipSpace(const char *p, const char *end)
+{
+    while (p < end && isSpace(*p))
+        ++p;
+    return p;
+}
+
+static inline const char *token(const char *p, const char *end, QByteArray *out)
+{
+    const char *start = p;
+    while (p < end && isTokenChar(*p))
+        ++p;
+    *out = QByteArray(start, int(p - start)).toLower();
+    return p;
+}
+
+MediaType::MediaType()
+{ }
+
+MediaType::MediaType(const QByteArray &value)
+{
+    parse(value.constData(), value.constData() + value.size());
+}
+
+void MediaType::parse(const char *p, const char *end)
+{
+    p = skipSpace(p, end);
+    p = token(p, end, &m_type);
+    if (p == end || *p != '/') {
+        m_type.clear();
+        return;
+    }
+    p = token(p + 1, end, &m_subtype);
+
+    while (p < end) {
+        // Skip anything up to the next parameter separator, which also makes
+        // the parser tolerant of garbage after a value.
+        while (p < end && *p != ';')
+            ++p;
+        if (p == end)
+            break;
+        p = skipSpace(p + 1, end);
+
+        QByteArray name;
+        p = token(p, end, &name);
+        p = skipSpace(p, end);
+        if (name.isEmpty() || p == end || *p != '=')
+            continue;
+        p = skipSpace(p + 1, end);
+
+        QByteArray value;
+        if (p < end && *p == '"') {
+            ++p;
+            const char *start = p;
+            while (p < end && *p != '"' && *p != '\\')
+                ++p;
+            value = QByteArray(start, int(p - start));
+            while (p < end && *p != '"') {
+                // quoted-pair
+                if (*p == '\\' && p + 1 < end)
+                    ++p;
+                value += *p++;
+                while (p < end && *p != '"' && *p != '\\')
+                    value += *p++;
+            }
+            if (p < end)
+                ++p; // closing quote
+        } else {
+            const char *start = p;
+            while (p < end && *p != ';' && !isSpace(*p))
+                ++p;
+            value = QByteArray(start, int(p - start));
+        }
+
+        m_parameters.append(qMakePair(name, value));
+    }
+}
+
+QByteArray MediaType::mimeType() const
+{
+    if (!isValid())
+        return QByteArray();
+    return m_type + '/' + m_subtype;
+}
+
+QByteArray MediaType::suffix() const
+{
+    int plus = m_subtype.lastIndexOf('+');
+    return plus < 0 ? QByteArray() : m_subtype.mid(plus + 1);
+}
+
+QByteArray MediaType::parameter(const QByteArray &name) const
+{
+    for (int i = 0; i < m_parameters.size(); ++i) {
+        if (m_parameters.at(i).first == name)
+            return m_parameters.at(i).second;
+    }
+    return QByteArray();
+}
+
+QByteArray MediaType::charset() const
+{
+    return parameter(QByteArrayLiteral("charset")).toLower();
+}
+
+} } }
@@ -0,0 +1,47 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef MEDIATYPE_H
+#define MEDIATYPE_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+
+#include "qpm.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Parses the value of a Content-Type header in a single pass:
+//
+//     type "/" subtype *( OWS ";" OWS name "=" ( token / quoted-string ) )
+//
+// Type, subtype and parameter names are lower-cased, parameter values are
+// returned unquoted.
+class MediaType
+{
+public:
+    MediaType();
+    explicit MediaType(const QByteArray &);
+
+    bool isValid() const { return !m_type.isEmpty() && !m_subtype.isEmpty(); }
+
+    QByteArray type() const { return m_type; }
+    QByteArray subtype() const { return m_subtype; }
+    QByteArray mimeType() const;
+    QByteArray suffix() const;
+
+    QByteArray parameter(const QByteArray &) const;
+    QByteArray charset() const;
+
+private:
+    void parse(const char *, const char *);
+
+    QByteArray m_type;
+    QByteArray m_subtype;
+    QList<QPair<QByteArray, QByteArray> > m_parameters;
+};
+
+} } }
+
+#endif // MEDIATYPE_H
@@ -0,0 +1,247 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QBuffer>
+
+#include "memorycache.h"
+
+#include <limits.h>
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Entries larger than this fraction of the memory budget are left in the
+// backing cache, so that a single large download can't flush the tier.
+static const int MAX_ENTRY_FRACTION = 4;
+
+// Device handed out by prepare(). Writes go straight through to the backing
+// cache's device and are also collected for the memory tier until they
+// exceed the size limit for a single entry.
+class CacheWriter : public QIODevice
+{
+public:
+    CacheWriter(const QNetworkCacheMetaData &metaData, QIODevice *backingDevice, qint64 limit) :
+        m_metaData(metaData),
+        m_backingDevice(backingDevice),
+        m_limit(limit),
+        m_buffering(limit > 0)
+    {
+        open(QIODevice::WriteOnly);
+    }
+
+    QNetworkCacheMetaData metaData() const { return m_metaData; }
+    QIODevice *backingDevice() const { return m_backingDevice; }
+    void releaseBackingDevice() { m_backingDevice = 0; }
+
+    bool isBuffered() const { return m_buffering; }
+    QByteArray data() const { return m_data; }
+
+protected:
+    qint64 readData(char *, qint64) { return -1; }
+
+    qint64 writeData(const char *data, qint64 length)
+    {
+        if (m_backingDevice && m_backingDevice->write(data, length) != length)
+            return -1;
+
+        if (m_buffering) {
+            if (m_data.size() + length > m_limit) {
+                m_buffering = false;
+                m_data.clear();
+            } else {
+                m_data.append(data, int(length));
+            }
+        }
+
+        return length;
+    }
+
+private:
+    QNetworkCacheMetaData m_metaData;
+    QIODevice *m_backingDevice;
+    QByteArray m_data;
+    qint64 m_limit;
+    bool m_buffering;
+};
+
+MemoryCache::MemoryCache(qint64 maxSize, QAbstractNetworkCache *backing, QObject *parent) :
+    QAbstractNetworkCache(parent),
+    m_backing(backing),
+    m_entries(int(qBound(Q_INT64_C(0), maxSize, qint64(INT_MAX)))),
+    m_memoryHits(0),
+    m_backingHits(0),
+    m_misses(0)
+{
+    if (m_backing)
+        m_backing->setParent(this);
+}
+
+MemoryCache::~MemoryCache()
+{
+    qDeleteAll(m_pending);
+}
+
+QNetworkCacheMetaData MemoryCache::metaData(const QUrl &url)
+{
+    if (Entry *entry = m_entries.object(url))
+        return entry->metaData;
+
+    QNetworkCacheMetaData metaData;
+    if (m_backing)
+        metaData = m_backing->metaData(url);
+    if (!metaData.isValid())
+        ++m_misses;
+    return metaData;
+}
+
+void MemoryCache::updateMetaData(const QNetworkCacheMetaData &metaData)
+{
+    if (Entry *entry = m_entries.object(metaData.url()))
+        entry->metaData = metaData;
+    if (m_backing)
+        m_backing->updateMetaData(metaData);
+}
+
+QIODevice *MemoryCache::data(const QUrl &url)
+{
+    QByteArray data;
+
+    if (Entry *entry = m_entries.object(url)) {
+        ++m_memoryHits;
+        data = entry->data;
+    } else {
+        QIODevice *device = m_backing ? m_backing->data(url) : 0;
+        if (!device)
+            return 0;
+
+        ++m_backingHits;
+        if (device->size() > m_entries.maxCost() / MAX_ENTRY_FRACTION)
+            return device;
+
+        data = device->readAll();
+        delete device;
+        store(m_backing->metaData(url), data);
+    }
+
+    QBuffer *buffer = new QBuffer();
+    buffer->setData(data);
+    buffer->open(QIODevice::ReadOnly);
+    return buffer;
+}
+
+bool MemoryCache::remove(const QUrl &url)
+{
+    discardPending(url);
+
+    bool removed = m_entries.remove(url);
+    if (m_backing)
+        removed = m_backing->remove(url) || removed;
+    return removed;
+}
+
+qint64 MemoryCache::cacheSize() const
+{
+    // The memory tier mirrors entries in the backing cache
+    return m_backing ? m_backing->cacheSize() : m_entries.totalCost();
+}
+
+QIODevice *MemoryCache::prepare(const QNetworkCacheMetaData &metaData)
+{
+    if (!metaData.isValid())
+        return 0;
+
+    QIODevice *backingDevice = m_backing ? m_backing->prepare(metaData) : 0;
+    qint64 limit = m_entries.maxCost() / MAX_ENTRY_FRACTION;
+    if (!backingDevice && limit <= 0)
+        return 0;
+
+    CacheWriter *writer = new CacheWriter(metaData, backingDevice, limit);
+    m_pending.insert(writer, writer);
+    return writer;
+}
+
+void MemoryCache::insert(QIODevice *device)
+{
+    CacheWriter *writer = m_pending.take(device);
+    if (!writer)
+        return;
+
+    if (writer->backingDevice())
+        m_backing->insert(writer->backingDevice());
+    if (writer->isBuffered())
+        store(writer->metaData(), writer->data());
+
+    delete writer;
+}
+
+QList<CacheEntryInfo> MemoryCache::entries()
+{
+    InspectableCache *backing = qobject_cast<InspectableCache*>(m_backing);
+    return backing ? backing->entries() : QList<CacheEntryInfo>();
+}
+
+QNetworkCacheMetaData MemoryCache::peek(const QUrl &url, qint64 *size)
+{
+    // Answer from memory when possible, since asking the backing cache may
+    // mean reading its entry from disk. QCache has no lookup that leaves the
+    // LRU order alone, so this promotes the entry.
+    if (m_entries.contains(url)) {
+        Entry *entry = m_entries.object(url);
+        if (size)
+            *size = entry->data.size();
+        return entry->metaData;
+    }
+
+    if (InspectableCache *backing = qobject_cast<InspectableCache*>(m_backing))
+        return backing->peek(url, size);
+    return QNetworkCacheMetaData();
+}
+
+bool MemoryCache::isPinned(const QUrl &url) const
+{
+    InspectableCache *backing = qobject_cast<InspectableCache*>(m_backing);
+    return backing && backing->isPinned(url);
+}
+
+void MemoryCache::setPinned(const QUrl &url, bool pinned)
+{
+    if (InspectableCache *backing = qobject_cast<InspectableCache*>(m_backing))
+        backing->setPinned(url, pinned);
+}
+
+void MemoryCache::clear()
+{
+    qDeleteAll(m_pending);
+    m_pending.clear();
+    m_entries.clear();
+    if (m_backing)
+        m_backing->clear();
+}
+
+void MemoryCache::store(const QNetworkCacheMetaData &metaData, const QByteArray &data)
+{
+    if (!metaData.isValid() || m_entries.maxCost() <= 0)
+        return;
+
+    Entry *entry = new Entry;
+    entry->metaData = metaData;
+    entry->data = data;
+    m_entries.insert(metaData.url(), entry, qMax(1, data.size()));
+}
+
+void MemoryCache::discardPending(const QUrl &url)
+{
+    QHash<QIODevice*, CacheWriter*>::iterator it = m_pending.begin();
+    while (it != m_pending.end()) {
+        CacheWriter *writer = it.value();
+        if (writer->metaData().url() == url) {
+            // The backing cache drops its own device when the url is removed
+            writer->releaseBackingDevice();
+            delete writer;
+            it = m_pending.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+} } }
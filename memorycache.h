@@ -0,0 +1,79 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef MEMORYCACHE_H
+#define MEMORYCACHE_H
+
+#include <QtCore/QCache>
+#include <QtCore/QHash>
+#include <QtCore/QUrl>
+#include <QtNetwork/QAbstractNetworkCache>
+
+#include "qpm.h"
+#include "cacheinspector.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+class CacheWriter;
+
+// A bounded in-memory LRU tier in front of another QAbstractNetworkCache.
+// Entries are promoted to memory when they are written or first read from
+// the backing cache, after which they are served from RAM. Entries that may
+// not be saved to disk are kept in memory only. Inspection and pinning are
+// forwarded to the backing cache.
+class MemoryCache : public QAbstractNetworkCache, public InspectableCache
+{
+    Q_OBJECT
+    Q_INTERFACES(com::cutehacks::duperagent::InspectableCache)
+
+public:
+    // Takes ownership of the backing cache, which may be 0
+    MemoryCache(qint64 maxSize, QAbstractNetworkCache *backing, QObject *parent = 0);
+    ~MemoryCache();
+
+    QNetworkCacheMetaData metaData(const QUrl &);
+    void updateMetaData(const QNetworkCacheMetaData &);
+    QIODevice *data(const QUrl &);
+    bool remove(const QUrl &);
+    qint64 cacheSize() const;
+
+    QIODevice *prepare(const QNetworkCacheMetaData &);
+    void insert(QIODevice *);
+
+    qint64 maximumSize() const { return m_entries.maxCost(); }
+    QAbstractNetworkCache *backingCache() const { return m_backing; }
+
+    quint64 memoryHits() const { return m_memoryHits; }
+    quint64 backingHits() const { return m_backingHits; }
+    quint64 misses() const { return m_misses; }
+
+    QList<CacheEntryInfo> entries();
+    QNetworkCacheMetaData peek(const QUrl &, qint64 *size);
+    bool isPinned(const QUrl &) const;
+    void setPinned(const QUrl &, bool);
+
+public slots:
+    void clear();
+
+private:
+    struct Entry
+    {
+        QNetworkCacheMetaData metaData;
+        QByteArray data;
+    };
+
+    void store(const QNetworkCacheMetaData &, const QByteArray &);
+    void discardPending(const QUrl &);
+
+    QAbstractNetworkCache *m_backing;
+    QCache<QUrl, Entry> m_entries;
+    QHash<QIODevice*, CacheWriter*> m_pending;
+
+    quint64 m_memoryHits;
+    quint64 m_backingHits;
+    quint64 m_misses;
+};
+
+} } }
+
+#endif // MEMORYCACHE_H
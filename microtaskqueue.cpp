@@ -0,0 +1,57 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QThreadStorage>
+
+#include "microtaskqueue.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+static QThreadStorage<MicrotaskQueue*> queues;
+
+MicrotaskQueue::MicrotaskQueue() :
+    QObject(0),
+    m_posted(false),
+    m_draining(false)
+{
+}
+
+MicrotaskQueue *MicrotaskQueue::instance()
+{
+    if (!queues.hasLocalData())
+        queues.setLocalData(new MicrotaskQueue());
+    return queues.localData();
+}
+
+void MicrotaskQueue::enqueue(const Microtask &task)
+{
+    m_tasks.enqueue(task);
+
+    // A drain in progress picks the task up before it returns
+    if (!m_posted && !m_draining) {
+        m_posted = true;
+        QMetaObject::invokeMethod(this, "handleDrain", Qt::QueuedConnection);
+    }
+}
+
+void MicrotaskQueue::drain()
+{
+    if (m_draining)
+        return;
+
+    m_draining = true;
+    while (!m_tasks.isEmpty()) {
+        Microtask task = m_tasks.dequeue();
+        if (task.promise)
+            task.promise->react(task.state, task.handler, task.argument);
+    }
+    m_draining = false;
+}
+
+void MicrotaskQueue::handleDrain()
+{
+    m_posted = false;
+    drain();
+}
+
+} } }
@@ -0,0 +1,60 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef MICROTASKQUEUE_H
+#define MICROTASKQUEUE_H
+
+#include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QQueue>
+#include <QtQml/QJSValue>
+
+#include "qpm.h"
+#include "promise.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// A reaction to a settled promise: the handler to call with the settled
+// value, and the promise to resolve with its result. The queue is shared by
+// all engines of a thread, so the promise may be destroyed along with its
+// engine before the task runs.
+struct Microtask
+{
+    QPointer<Promise> promise;
+    QJSValue keepAlive; // the promise's wrapper, so it isn't collected while queued
+    Promise::State state;
+    QJSValue handler;
+    QJSValue argument;
+};
+
+// Runs promise reactions after the code that settled the promise has
+// returned, like the microtask queue of a browser. Everything queued during
+// one turn of the event loop runs in a single batch, including tasks queued
+// by the reactions themselves, so a chain of any length is run iteratively
+// instead of nesting on the stack. There is one queue per thread.
+class MicrotaskQueue : public QObject
+{
+    Q_OBJECT
+
+public:
+    static MicrotaskQueue *instance();
+
+    void enqueue(const Microtask &);
+
+    // Runs all queued tasks now, instead of when the posted event arrives
+    void drain();
+
+private slots:
+    void handleDrain();
+
+private:
+    MicrotaskQueue();
+
+    QQueue<Microtask> m_tasks;
+    bool m_posted;
+    bool m_draining;
+};
+
+} } }
+
+#endif // MICROTASKQUEUE_H
@@ -0,0 +1,164 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <string.h>
+
+#include "multipartparser.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Consumed data is only dropped from the front of the buffer once it grows
+// beyond this, to avoid moving memory around for every small chunk.
+static const int COMPACT_THRESHOLD = 64 * 1024;
+
+MultipartParser::MultipartParser(const QByteArray &boundary) :
+    m_state(Preamble),
+    m_delimiter("\n--" + boundary),
+    m_buffer("\n"), // so a delimiter at the very start is found like any other
+    m_pos(0),
+    m_scanFrom(0)
+{
+}
+
+void MultipartParser::feed(const QByteArray &data)
+{
+    if (m_state == Epilogue)
+        return;
+
+    m_buffer.append(data);
+
+    bool more = true;
+    while (more) {
+        switch (m_state) {
+        case Preamble:
+            more = parsePreamble();
+            break;
+        case DelimiterLine:
+            more = parseDelimiterLine();
+            break;
+        case Headers:
+            more = parseHeaders();
+            break;
+        case Body:
+            more = parseBody();
+            break;
+        case Epilogue:
+            more = false;
+            break;
+        }
+    }
+
+    compact();
+}
+
+bool MultipartParser::parsePreamble()
+{
+    int index = m_buffer.indexOf(m_delimiter, qMax(m_pos, m_scanFrom));
+    if (index < 0) {
+        m_scanFrom = qMax(m_pos, m_buffer.size() - m_delimiter.size() + 1);
+        return false;
+    }
+
+    m_pos = index + m_delimiter.size();
+    m_state = DelimiterLine;
+    return true;
+}
+
+bool MultipartParser::parseDelimiterLine()
+{
+    if (m_buffer.size() - m_pos >= 2
+            && m_buffer.at(m_pos) == '-' && m_buffer.at(m_pos + 1) == '-') {
+        m_state = Epilogue;
+        m_pos = m_buffer.size();
+        return false;
+    }
+
+    // Skip transport padding up to the end of the line
+    int newline = m_buffer.indexOf('\n', m_pos);
+    if (newline < 0)
+        return false;
+
+    m_pos = newline + 1;
+    m_state = Headers;
+    return true;
+}
+
+bool MultipartParser::parseHeaders()
+{
+    for (;;) {
+        int newline = m_buffer.indexOf('\n', m_pos);
+        if (newline < 0)
+            return false;
+
+        int end = newline;
+        if (end > m_pos && m_buffer.at(end - 1) == '\r')
+            --end;
+
+        const char *line = m_buffer.constData() + m_pos;
+        int length = end - m_pos;
+        m_pos = newline + 1;
+
+        if (length == 0) {
+            m_state = Body;
+            m_scanFrom = m_pos;
+            return true;
+        }
+
+        if ((line[0] == ' ' || line[0] == '\t') && !m_current.headers.isEmpty()) {
+            // Obsolete line folding
+            QByteArray &value = m_current.headers.last().second;
+            value += ' ';
+            value += QByteArray(line, length).trimmed();
+            continue;
+        }
+
+        const char *colon = static_cast<const char*>(memchr(line, ':', length));
+        if (!colon || colon == line)
+            continue;
+
+        m_current.headers.append(qMakePair(
+            QByteArray(line, int(colon - line)).trimmed(),
+            QByteArray(colon + 1, int(line + length - colon - 1)).trimmed()));
+    }
+}
+
+bool MultipartParser::parseBody()
+{
+    int index = m_buffer.indexOf(m_delimiter, qMax(m_pos, m_scanFrom));
+    if (index < 0) {
+        m_scanFrom = qMax(m_pos, m_buffer.size() - m_delimiter.size() + 1);
+        return false;
+    }
+
+    // The CR of the CRLF preceding the delimiter belongs to the delimiter
+    int end = index;
+    if (end > m_pos && m_buffer.at(end - 1) == '\r')
+        --end;
+
+    m_current.body = m_buffer.mid(m_pos, end - m_pos);
+    m_parts.append(m_current);
+    m_current = MultipartPart();
+
+    m_pos = index + m_delimiter.size();
+    m_state = DelimiterLine;
+    return true;
+}
+
+void MultipartParser::compact()
+{
+    if (m_state == Epilogue) {
+        m_buffer.clear();
+        m_pos = 0;
+        m_scanFrom = 0;
+        return;
+    }
+
+    if (m_pos < COMPACT_THRESHOLD && m_pos <= m_buffer.size() / 2)
+        return;
+
+    m_buffer.remove(0, m_pos);
+    m_scanFrom = qMax(0, m_scanFrom - m_pos);
+    m_pos = 0;
+}
+
+} } }
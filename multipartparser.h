@@ -0,0 +1,66 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef MULTIPARTPARSER_H
+#define MULTIPARTPARSER_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QPair>
+
+#include "qpm.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+typedef QList<QPair<QByteArray, QByteArray> > RawHeaders;
+
+struct MultipartPart
+{
+    RawHeaders headers;
+    QByteArray body;
+};
+
+// Incremental parser for multipart/* bodies (RFC 2046). Data can be fed in
+// arbitrary chunks as it arrives from the network and every part becomes
+// available as soon as its closing delimiter has been seen. Only the part
+// currently being received is buffered.
+class MultipartParser
+{
+public:
+    explicit MultipartParser(const QByteArray &boundary);
+
+    void feed(const QByteArray &);
+
+    bool hasPart() const { return !m_parts.isEmpty(); }
+    MultipartPart takePart() { return m_parts.takeFirst(); }
+
+    // True once the closing delimiter has been parsed
+    bool isFinished() const { return m_state == Epilogue; }
+
+private:
+    enum State {
+        Preamble,
+        DelimiterLine,
+        Headers,
+        Body,
+        Epilogue
+    };
+
+    bool parsePreamble();
+    bool parseDelimiterLine();
+    bool parseHeaders();
+    bool parseBody();
+    void compact();
+
+    State m_state;
+    QByteArray m_delimiter;
+    QByteArray m_buffer;
+    int m_pos;
+    int m_scanFrom;
+    MultipartPart m_current;
+    QList<MultipartPart> m_parts;
+};
+
+} } }
+
+#endif // MULTIPARTPARSER_H
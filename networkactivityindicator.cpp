@@ -41,10 +41,11 @@ NetworkActivityIndicator::~NetworkActivityIndicator()
 
 void NetworkActivityIndicator::incrementActivityCount()
 {
-    QMutexLocker lock(m_mutex);
-    m_activityCounter++;
+    uint count;
+    {
+        QMutexLocker lock(m_mutex);
+        count = ++m_activityCounter;
 
-    if (m_activityCounter > 0) {
         if (m_completionTimer > 0) {
             killTimer(m_completionTimer);
             m_completionTimer = -1;
@@ -53,22 +54,38 @@ void NetworkActivityIndicator::incrementActivityCount()
         if (m_activationTimer < 0 && m_activationDelay >= 0)
             m_activationTimer = startTimer(m_activationDelay, Qt::PreciseTimer);
     }
+
+    // Emitted without holding the lock so that receivers can start requests
+    emit activityCountChanged(count);
 }
 
 void NetworkActivityIndicator::decrementActivityCount()
 {
-    QMutexLocker lock(m_mutex);
-    m_activityCounter--;
-
-    if (m_activityCounter <= 0) {
-        if (m_activationTimer > 0) {
-            killTimer(m_activationTimer);
-            m_activationTimer = -1;
+    uint count;
+    {
+        QMutexLocker lock(m_mutex);
+        if (m_activityCounter > 0)
+            m_activityCounter--;
+        count = m_activityCounter;
+
+        if (count == 0) {
+            if (m_activationTimer > 0) {
+                killTimer(m_activationTimer);
+                m_activationTimer = -1;
+            }
+
+            if (m_completionTimer < 0 && m_completionDelay >= 0)
+                m_completionTimer = startTimer(m_completionDelay, Qt::PreciseTimer);
         }
-
-        if (m_completionTimer < 0 && m_completionDelay >= 0)
-            m_completionTimer = startTimer(m_completionDelay, Qt::PreciseTimer);
     }
+
+    emit activityCountChanged(count);
+}
+
+uint NetworkActivityIndicator::activityCount() const
+{
+    QMutexLocker lock(m_mutex);
+    return m_activityCounter;
 }
 
 void NetworkActivityIndicator::setActivationDelay(int activationDelay)
@@ -36,7 +36,12 @@ public:
     void incrementActivityCount();
     void decrementActivityCount();
 
+    // Number of requests currently in flight. Unlike enabled, this isn't
+    // delayed, which makes it suitable for scheduling background work.
+    uint activityCount() const;
+
 signals:
+    void activityCountChanged(uint activityCount);
     void activationDelayChanged(int activationDelay);
     void completionDelayChanged(int completionDelay);
     void enableNativeIndicatorChanged(bool enableNativeIndicator);
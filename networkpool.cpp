@@ -0,0 +1,122 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QUrl>
+#include <QtNetwork/QAbstractNetworkCache>
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkCookieJar>
+#include <QtNetwork/QNetworkReply>
+#include <QtQml/QQmlEngine>
+#include <QtQml/QQmlNetworkAccessManagerFactory>
+
+#include "networkpool.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Qt keeps a separate set of connections per scheme, host and port
+static QString hostKey(const QUrl &url)
+{
+    return url.scheme() + QLatin1Char(':') + url.host() + QLatin1Char(':')
+            + QString::number(url.port());
+}
+
+NetworkPool::NetworkPool(QQmlEngine *engine, int size) :
+    QObject(engine->networkAccessManager())
+{
+    QNetworkAccessManager *primary = engine->networkAccessManager();
+    QQmlNetworkAccessManagerFactory *factory = engine->networkAccessManagerFactory();
+    m_managers.append(primary);
+
+    QAbstractNetworkCache *cache = primary->cache();
+    QNetworkCookieJar *jar = primary->cookieJar();
+    QObject *cacheParent = cache ? cache->parent() : 0;
+    QObject *jarParent = jar->parent();
+
+    for (int i = 1; i < size; ++i) {
+        QNetworkAccessManager *network;
+        if (factory) {
+            // Keeps whatever the app set up in the factory, including its
+            // proxy settings
+            network = factory->create(this);
+            network->setParent(this);
+        } else {
+            network = new QNetworkAccessManager(this);
+            network->setProxy(primary->proxy());
+        }
+        if (cache)
+            network->setCache(cache);
+        network->setCookieJar(jar);
+        m_managers.append(network);
+    }
+
+    // Both setters take ownership. Hand the objects back, which also puts
+    // them after the pool so that they outlive the managers sharing them.
+    if (cache)
+        cache->setParent(cacheParent);
+    jar->setParent(jarParent);
+
+    for (int i = 0; i < m_managers.size(); ++i)
+        m_load.append(Load());
+}
+
+NetworkPool *NetworkPool::find(QNetworkAccessManager *primary)
+{
+    return primary->findChild<NetworkPool*>(QString(), Qt::FindDirectChildrenOnly);
+}
+
+QNetworkAccessManager *NetworkPool::managerFor(const QUrl &url)
+{
+    QString key = hostKey(url);
+
+    int best = 0;
+    for (int i = 1; i < m_managers.size(); ++i) {
+        int hostLoad = m_load.at(i).hosts.value(key);
+        int bestHostLoad = m_load.at(best).hosts.value(key);
+        if (hostLoad < bestHostLoad
+                || (hostLoad == bestHostLoad && m_load.at(i).total < m_load.at(best).total)) {
+            best = i;
+        }
+    }
+    return m_managers.at(best);
+}
+
+void NetworkPool::track(QNetworkReply *reply)
+{
+    int index = m_managers.indexOf(reply->manager());
+    if (index < 0 || m_replies.contains(reply))
+        return;
+
+    QString key = hostKey(reply->request().url());
+    m_replies.insert(reply, qMakePair(index, key));
+    Load &load = m_load[index];
+    ++load.total;
+    ++load.hosts[key];
+
+    connect(reply, SIGNAL(finished()), this, SLOT(handleFinished()));
+    connect(reply, SIGNAL(destroyed(QObject*)), this, SLOT(handleDestroyed(QObject*)));
+}
+
+void NetworkPool::handleFinished()
+{
+    release(sender());
+}
+
+void NetworkPool::handleDestroyed(QObject *reply)
+{
+    release(reply);
+}
+
+void NetworkPool::release(QObject *reply)
+{
+    QHash<QObject*, QPair<int, QString> >::iterator it = m_replies.find(reply);
+    if (it == m_replies.end())
+        return;
+
+    Load &load = m_load[it->first];
+    --load.total;
+    if (--load.hosts[it->second] <= 0)
+        load.hosts.remove(it->second);
+    m_replies.erase(it);
+}
+
+} } }
@@ -0,0 +1,65 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef NETWORKPOOL_H
+#define NETWORKPOOL_H
+
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QObject>
+#include <QtCore/QPair>
+
+#include "qpm.h"
+
+class QNetworkAccessManager;
+class QNetworkReply;
+class QQmlEngine;
+class QUrl;
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Spreads requests over several QNetworkAccessManagers, since each of them
+// opens at most six connections to a host. The extra managers share the
+// cache and cookie jar of the engine's manager, which owns the pool, and are
+// created through the engine's network access manager factory if it has one.
+// A request goes to the manager with the fewest requests in flight to its
+// host, and among those to the one with the fewest in total.
+class NetworkPool : public QObject
+{
+    Q_OBJECT
+
+public:
+    NetworkPool(QQmlEngine *engine, int size);
+
+    // The pool installed on the given manager, if any
+    static NetworkPool *find(QNetworkAccessManager *primary);
+
+    int size() const { return m_managers.size(); }
+
+    QNetworkAccessManager *managerFor(const QUrl &);
+
+    // Counts the reply against its manager until it has finished
+    void track(QNetworkReply *);
+
+private slots:
+    void handleFinished();
+    void handleDestroyed(QObject *);
+
+private:
+    struct Load
+    {
+        Load() : total(0) {}
+        int total;
+        QHash<QString, int> hosts;
+    };
+
+    void release(QObject *reply);
+
+    QList<QNetworkAccessManager*> m_managers;
+    QList<Load> m_load;
+    QHash<QObject*, QPair<int, QString> > m_replies;
+};
+
+} } }
+
+#endif // NETWORKPOOL_H
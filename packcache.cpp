@@ -0,0 +1,989 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QBuffer>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDataStream>
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
+#include <QtCore/QVector>
+
+#include "packcache.h"
+
+#include <string.h>
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+static const quint32 INDEX_MAGIC = 0x4b504144;  // "DAPK"
+static const quint32 INDEX_VERSION = 2;
+static const quint32 RECORD_MAGIC = 0x52504144; // "DAPR"
+static const quint32 META_MAGIC = 0x4d504144;   // "DAPM", without a body
+static const quint32 RECORD_HEADER_SIZE = 16;
+
+static const quint32 INITIAL_CAPACITY = 4096;
+
+static const quint64 EMPTY_SLOT = 0;
+static const quint64 DELETED_SLOT = 1;
+
+// Packs with less than half of their bytes alive are compacted, unless they
+// are too small to be worth the copying
+static const qint64 MIN_COMPACT_SIZE = 256 * 1024;
+
+static const QString INDEX_FILE = QStringLiteral("index");
+static const QString PACK_FILTER = QStringLiteral("*.pack");
+
+struct PackCache::IndexHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint32 capacity;
+    quint32 count;
+    quint32 used;     // live and deleted slots
+    quint32 reserved;
+};
+
+struct PackCache::Slot
+{
+    quint64 hash;
+    quint64 offset;
+    quint32 pack;
+    quint32 length;
+
+    // Metadata written after the body record, used instead of the record's
+    // own when metaLength isn't 0
+    quint64 metaOffset;
+    quint32 metaPack;
+    quint32 metaLength;
+};
+
+static QString packPath(const QString &directory, quint32 pack)
+{
+    return directory + QStringLiteral("/%1.pack").arg(pack, 8, 10, QLatin1Char('0'));
+}
+
+// 64 bit FNV-1a of the encoded url. The values reserved for empty and
+// deleted slots are never returned.
+static quint64 urlHash(const QUrl &url)
+{
+    QByteArray encoded = url.toEncoded();
+    quint64 hash = Q_UINT64_C(0xcbf29ce484222325);
+    for (int i = 0; i < encoded.size(); ++i) {
+        hash ^= uchar(encoded.at(i));
+        hash *= Q_UINT64_C(0x100000001b3);
+    }
+    return hash > DELETED_SLOT ? hash : hash + 2;
+}
+
+static void parseMetaData(const char *p, quint32 length, QNetworkCacheMetaData *metaData)
+{
+    QByteArray bytes = QByteArray::fromRawData(p, int(length));
+    QDataStream stream(bytes);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream >> *metaData;
+}
+
+PackWriter::PackWriter(const QString &directory, quint32 firstPack, qint64 packSize) :
+    QObject(0),
+    m_directory(directory),
+    m_pack(firstPack),
+    m_packSize(packSize),
+    m_offset(0)
+{
+}
+
+bool PackWriter::ensurePack(qint64 size)
+{
+    if (m_file.isOpen() && m_offset > 0 && m_offset + size > m_packSize) {
+        flush();
+        m_file.close();
+        ++m_pack;
+    }
+
+    if (!m_file.isOpen()) {
+        m_file.setFileName(packPath(m_directory, m_pack));
+        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            qWarning("Could not open file for writing: %s", qUtf8Printable(m_file.fileName()));
+            return false;
+        }
+        m_offset = m_file.size();
+    }
+
+    return true;
+}
+
+bool PackWriter::writeRecord(const QByteArray &header, const QByteArray &body)
+{
+    return m_file.write(header) == header.size() && m_file.write(body) == body.size();
+}
+
+void PackWriter::append(quint64 serial, const QByteArray &header, const QByteArray &body)
+{
+    qint64 length = header.size() + body.size();
+    if (!ensurePack(length) || !writeRecord(header, body)) {
+        // A zero length tells the cache that the entry was lost
+        emit appended(serial, m_pack, 0, 0);
+        return;
+    }
+
+    Appended record = { serial, m_pack, quint64(m_offset), quint32(length) };
+    m_offset += length;
+
+    // Records are flushed and reported once per batch of queued writes
+    m_unflushed.append(record);
+    if (m_unflushed.size() == 1)
+        QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+}
+
+void PackWriter::flush()
+{
+    if (m_file.isOpen())
+        m_file.flush();
+
+    QList<Appended> records;
+    records.swap(m_unflushed);
+    foreach (const Appended &record, records)
+        emit appended(record.serial, record.pack, record.offset, record.length);
+}
+
+void PackWriter::compact(quint32 pack, const PackRecordList &records)
+{
+    PackRelocationList relocations;
+
+    QFile source(packPath(m_directory, pack));
+    if (source.open(QIODevice::ReadOnly)) {
+        foreach (const PackRecord &record, records) {
+            if (!source.seek(qint64(record.offset)))
+                continue;
+            QByteArray bytes = source.read(record.length);
+            if (bytes.size() != int(record.length) || !ensurePack(record.length))
+                continue;
+            if (m_file.write(bytes) != bytes.size())
+                continue;
+
+            PackRelocation relocation = {
+                record.hash, record.offset, m_pack, quint64(m_offset), record.length
+            };
+            relocations.append(relocation);
+            m_offset += record.length;
+        }
+    }
+
+    // The copies have to be readable before the cache switches over to them
+    flush();
+    emit compacted(pack, relocations);
+}
+
+void PackWriter::removePack(quint32 pack)
+{
+    if (pack != m_pack || !m_file.isOpen())
+        QFile::remove(packPath(m_directory, pack));
+}
+
+void PackWriter::clear(quint32 firstPack)
+{
+    flush();
+    m_file.close();
+
+    QDir dir(m_directory);
+    foreach (const QString &name, dir.entryList(QStringList() << PACK_FILTER, QDir::Files))
+        dir.remove(name);
+
+    m_pack = firstPack;
+    m_offset = 0;
+}
+
+PackCache::PackCache(const QString &directory, qint64 maxSize, QObject *parent) :
+    QAbstractNetworkCache(parent),
+    m_directory(directory),
+    m_maxSize(maxSize),
+    m_index(0),
+    m_firstPack(0),
+    m_writePack(0),
+    m_compacting(false),
+    m_serial(0),
+    m_writer(0)
+{
+    qRegisterMetaType<PackRecordList>("PackRecordList");
+    qRegisterMetaType<PackRelocationList>("PackRelocationList");
+
+    QDir dir(m_directory);
+    if (!dir.mkpath(QStringLiteral(".")))
+        qWarning("Could not create path for writing: %s", qUtf8Printable(m_directory));
+
+    m_pinned = readPinnedUrls(m_directory);
+
+    QStringList packFiles = dir.entryList(QStringList() << PACK_FILTER, QDir::Files);
+    if (!openIndex()) {
+        // Without a usable index the packs can't be read, so start over
+        foreach (const QString &name, packFiles)
+            dir.remove(name);
+        packFiles.clear();
+        createIndex(INITIAL_CAPACITY);
+    }
+
+    foreach (const QString &name, packFiles) {
+        bool ok;
+        quint32 pack = QFileInfo(name).baseName().toUInt(&ok);
+        if (ok) {
+            m_packs[pack].total = QFileInfo(dir, name).size();
+            m_writePack = qMax(m_writePack, pack + 1);
+        }
+    }
+
+    // Account for the live bytes in every pack, dropping entries whose pack
+    // has disappeared
+    if (m_index) {
+        IndexHeader *h = header();
+        Slot *slot = slotArray();
+        for (quint32 i = 0; i < h->capacity; ++i, ++slot) {
+            if (slot->hash <= DELETED_SLOT)
+                continue;
+            if (slot->metaLength && !m_packs.contains(slot->metaPack))
+                slot->metaLength = 0;
+            if (!m_packs.contains(slot->pack)) {
+                slot->metaLength = 0;
+                removeSlot(slot);
+                continue;
+            }
+            m_packs[slot->pack].live += slot->length;
+            if (slot->metaLength)
+                m_packs[slot->metaPack].live += slot->metaLength;
+        }
+    }
+
+    // A new pack is started for every session, so that a record that was
+    // only partially written before a crash is never appended to
+    m_firstPack = m_writePack;
+    qint64 packSize = qBound(Q_INT64_C(1024 * 1024), m_maxSize / 8, Q_INT64_C(64 * 1024 * 1024));
+    m_writer = new PackWriter(m_directory, m_writePack, packSize);
+    m_writer->moveToThread(&m_thread);
+    connect(m_writer, SIGNAL(appended(quint64,quint32,quint64,quint32)),
+            this, SLOT(handleAppended(quint64,quint32,quint64,quint32)));
+    connect(m_writer, SIGNAL(compacted(quint32,PackRelocationList)),
+            this, SLOT(handleCompacted(quint32,PackRelocationList)));
+    m_thread.start(QThread::LowPriority);
+
+    maintain();
+}
+
+PackCache::~PackCache()
+{
+    // Let the writer finish everything that was queued and record the
+    // results in the index before shutting down
+    QMetaObject::invokeMethod(m_writer, "flush", Qt::BlockingQueuedConnection);
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+
+    m_thread.quit();
+    m_thread.wait();
+    delete m_writer;
+
+    qDeleteAll(m_preparing.keys());
+    foreach (quint32 pack, m_mapped.keys())
+        unmapPack(pack);
+    if (m_index)
+        m_indexFile.unmap(m_index);
+}
+
+PackCache::IndexHeader *PackCache::header() const
+{
+    return reinterpret_cast<IndexHeader*>(m_index);
+}
+
+PackCache::Slot *PackCache::slotArray() const
+{
+    return reinterpret_cast<Slot*>(m_index + sizeof(IndexHeader));
+}
+
+bool PackCache::openIndex()
+{
+    m_indexFile.setFileName(m_directory + QLatin1Char('/') + INDEX_FILE);
+    if (!m_indexFile.open(QIODevice::ReadWrite))
+        return false;
+
+    qint64 size = m_indexFile.size();
+    if (size < qint64(sizeof(IndexHeader))) {
+        m_indexFile.close();
+        return false;
+    }
+
+    m_index = m_indexFile.map(0, size);
+    if (!m_index) {
+        m_indexFile.close();
+        return false;
+    }
+
+    IndexHeader *h = header();
+    quint32 capacity = h->capacity;
+    if (h->magic != INDEX_MAGIC || h->version != INDEX_VERSION
+            || capacity == 0 || (capacity & (capacity - 1)) != 0
+            || size != qint64(sizeof(IndexHeader) + capacity * sizeof(Slot))) {
+        m_indexFile.unmap(m_index);
+        m_index = 0;
+        m_indexFile.close();
+        return false;
+    }
+
+    return true;
+}
+
+bool PackCache::createIndex(quint32 capacity)
+{
+    if (m_index) {
+        m_indexFile.unmap(m_index);
+        m_index = 0;
+    }
+    m_indexFile.close();
+
+    // The new table is built in a separate file, which an interrupted resize
+    // leaves behind instead of a half written index
+    QFile file(m_directory + QLatin1Char('/') + INDEX_FILE + QStringLiteral(".new"));
+    qint64 size = qint64(sizeof(IndexHeader) + capacity * sizeof(Slot));
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate) || !file.resize(size)) {
+        qWarning("Could not open file for writing: %s", qUtf8Printable(file.fileName()));
+        return false;
+    }
+
+    IndexHeader h = { INDEX_MAGIC, INDEX_VERSION, capacity, 0, 0, 0 };
+    file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    file.close();
+
+    QFile::remove(m_indexFile.fileName());
+    if (!file.rename(m_indexFile.fileName()))
+        return false;
+
+    return openIndex();
+}
+
+void PackCache::growIndex()
+{
+    IndexHeader *h = header();
+    quint32 capacity = h->capacity;
+    if (h->count * 2 >= capacity)
+        capacity *= 2; // otherwise only the deleted slots are cleared out
+
+    QVector<Slot> live;
+    live.reserve(int(h->count));
+    Slot *slot = slotArray();
+    for (quint32 i = 0; i < h->capacity; ++i, ++slot) {
+        if (slot->hash > DELETED_SLOT)
+            live.append(*slot);
+    }
+
+    if (!createIndex(capacity)) {
+        qWarning("Could not resize the cache index");
+        return;
+    }
+
+    h = header();
+    for (int i = 0; i < live.size(); ++i) {
+        Slot *s = findSlot(live.at(i).hash, true);
+        *s = live.at(i);
+        ++h->count;
+        ++h->used;
+    }
+}
+
+PackCache::Slot *PackCache::findSlot(quint64 hash, bool insert)
+{
+    if (!m_index)
+        return 0;
+
+    quint32 mask = header()->capacity - 1;
+    Slot *table = slotArray();
+    Slot *deleted = 0;
+
+    quint32 i = quint32(hash) & mask;
+    for (quint32 probes = 0; probes <= mask; ++probes, i = (i + 1) & mask) {
+        Slot *slot = table + i;
+        if (slot->hash == hash)
+            return slot;
+        if (slot->hash == EMPTY_SLOT)
+            return insert ? (deleted ? deleted : slot) : 0;
+        if (slot->hash == DELETED_SLOT && !deleted)
+            deleted = slot;
+    }
+
+    return insert ? deleted : 0;
+}
+
+void PackCache::removeSlot(Slot *slot)
+{
+    clearMeta(slot);
+
+    QMap<quint32, PackStats>::iterator it = m_packs.find(slot->pack);
+    if (it != m_packs.end())
+        it->live -= slot->length;
+
+    slot->hash = DELETED_SLOT;
+    --header()->count;
+}
+
+const uchar *PackCache::mapRecord(quint32 pack, quint64 offset, quint32 length)
+{
+    MappedPack &mapped = m_mapped[pack];
+    if (!mapped.file) {
+        mapped.file = new QFile(packPath(m_directory, pack));
+        if (!mapped.file->open(QIODevice::ReadOnly)) {
+            delete mapped.file;
+            m_mapped.remove(pack);
+            return 0;
+        }
+    }
+
+    if (offset + length > quint64(mapped.size)) {
+        // The pack has grown since it was mapped
+        if (mapped.data)
+            mapped.file->unmap(mapped.data);
+        mapped.size = mapped.file->size();
+        mapped.data = mapped.size > 0 ? mapped.file->map(0, mapped.size) : 0;
+        if (!mapped.data)
+            mapped.size = 0;
+        if (offset + length > quint64(mapped.size))
+            return 0;
+    }
+
+    return mapped.data + offset;
+}
+
+void PackCache::unmapPack(quint32 pack)
+{
+    MappedPack mapped = m_mapped.take(pack);
+    if (mapped.data)
+        mapped.file->unmap(mapped.data);
+    delete mapped.file;
+}
+
+// Validates the record a slot points to and returns its url, followed by the
+// metadata and body. Slots with broken records are removed.
+const char *PackCache::recordFields(Slot *slot, quint32 *urlLength, quint32 *metaLength,
+                                    quint32 *bodyLength)
+{
+    const uchar *record = mapRecord(slot->pack, slot->offset, slot->length);
+    quint32 fields[4] = { 0, 0, 0, 0 };
+    if (record && slot->length >= RECORD_HEADER_SIZE)
+        memcpy(fields, record, sizeof(fields));
+
+    *urlLength = fields[1];
+    *metaLength = fields[2];
+    *bodyLength = fields[3];
+    if (fields[0] != RECORD_MAGIC || quint64(RECORD_HEADER_SIZE) + fields[1] + fields[2]
+            + fields[3] != slot->length) {
+        removeSlot(slot);
+        return 0;
+    }
+
+    return reinterpret_cast<const char*>(record) + RECORD_HEADER_SIZE;
+}
+
+// Validates the metadata record a slot points to and returns its url,
+// followed by the metadata. A broken record is forgotten, which leaves the
+// entry with the metadata it was first written with.
+const char *PackCache::metaFields(Slot *slot, quint32 *urlLength, quint32 *metaLength)
+{
+    const uchar *record = mapRecord(slot->metaPack, slot->metaOffset, slot->metaLength);
+    quint32 fields[4] = { 0, 0, 0, 0 };
+    if (record && slot->metaLength >= RECORD_HEADER_SIZE)
+        memcpy(fields, record, sizeof(fields));
+
+    if (fields[0] != META_MAGIC || fields[3] != 0
+            || quint64(RECORD_HEADER_SIZE) + fields[1] + fields[2] != slot->metaLength) {
+        clearMeta(slot);
+        return 0;
+    }
+
+    *urlLength = fields[1];
+    *metaLength = fields[2];
+    return reinterpret_cast<const char*>(record) + RECORD_HEADER_SIZE;
+}
+
+void PackCache::clearMeta(Slot *slot)
+{
+    if (!slot->metaLength)
+        return;
+
+    QMap<quint32, PackStats>::iterator it = m_packs.find(slot->metaPack);
+    if (it != m_packs.end())
+        it->live -= slot->metaLength;
+
+    slot->metaOffset = 0;
+    slot->metaPack = 0;
+    slot->metaLength = 0;
+}
+
+bool PackCache::readRecord(const QUrl &url, QNetworkCacheMetaData *metaData, QByteArray *data)
+{
+    Slot *slot = findSlot(urlHash(url), false);
+    if (!slot)
+        return false;
+
+    quint32 urlLength, metaLength, bodyLength;
+    const char *p = recordFields(slot, &urlLength, &metaLength, &bodyLength);
+    if (!p)
+        return false;
+
+    QByteArray encodedUrl = url.toEncoded();
+    if (encodedUrl.size() != int(urlLength) || memcmp(encodedUrl.constData(), p, urlLength) != 0)
+        return false; // a different url with the same hash
+    p += urlLength;
+
+    if (metaData && !slot->metaLength)
+        parseMetaData(p, metaLength, metaData);
+    p += metaLength;
+
+    if (data)
+        *data = QByteArray(p, int(bodyLength));
+
+    // Mapping the metadata record may remap the pack, so the body record
+    // isn't touched after this
+    if (metaData && slot->metaLength) {
+        const char *q = metaFields(slot, &urlLength, &metaLength);
+        if (!q)
+            return readRecord(url, metaData, 0);
+        parseMetaData(q + urlLength, metaLength, metaData);
+    }
+
+    return true;
+}
+
+QNetworkCacheMetaData PackCache::metaData(const QUrl &url)
+{
+    QHash<QUrl, PendingEntry>::const_iterator it = m_inFlight.constFind(url);
+    if (it != m_inFlight.constEnd())
+        return it->metaData;
+
+    QNetworkCacheMetaData metaData;
+    if (!readRecord(url, &metaData, 0))
+        return QNetworkCacheMetaData();
+    return metaData;
+}
+
+void PackCache::updateMetaData(const QNetworkCacheMetaData &metaData)
+{
+    QUrl url = metaData.url();
+
+    QHash<QUrl, PendingEntry>::const_iterator it = m_inFlight.constFind(url);
+    if (it != m_inFlight.constEnd() && !it->metaOnly) {
+        // The body hasn't been written yet and is still in memory
+        write(metaData, it->data);
+        return;
+    }
+
+    if (it == m_inFlight.constEnd() && !readRecord(url, 0, 0))
+        return;
+
+    // Records are never modified in place. The body stays where it is and
+    // only the new metadata is appended, which is all a revalidation changes.
+    write(metaData, QByteArray(), true);
+}
+
+QIODevice *PackCache::data(const QUrl &url)
+{
+    QByteArray data;
+
+    QHash<QUrl, PendingEntry>::const_iterator it = m_inFlight.constFind(url);
+    if (it != m_inFlight.constEnd() && !it->metaOnly)
+        data = it->data;
+    else if (!readRecord(url, 0, &data))
+        return 0;
+
+    QBuffer *buffer = new QBuffer();
+    buffer->setData(data);
+    buffer->open(QIODevice::ReadOnly);
+    return buffer;
+}
+
+bool PackCache::remove(const QUrl &url)
+{
+    bool removed = m_inFlight.remove(url) > 0;
+
+    QHash<QIODevice*, QNetworkCacheMetaData>::iterator it = m_preparing.begin();
+    while (it != m_preparing.end()) {
+        if (it.value().url() == url) {
+            delete it.key();
+            it = m_preparing.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    Slot *slot = findSlot(urlHash(url), false);
+    if (slot) {
+        removeSlot(slot);
+        removed = true;
+    }
+
+    return removed;
+}
+
+QList<CacheEntryInfo> PackCache::entries()
+{
+    QList<CacheEntryInfo> entries;
+
+    foreach (const PendingEntry &pending, m_inFlight) {
+        if (pending.metaOnly)
+            continue; // listed with its body below
+
+        CacheEntryInfo entry;
+        entry.url = pending.metaData.url();
+        entry.size = pending.data.size();
+        entry.lastModified = pending.metaData.lastModified();
+        entry.expirationDate = pending.metaData.expirationDate();
+        entries.append(entry);
+    }
+
+    if (!m_index)
+        return entries;
+
+    IndexHeader *h = header();
+    Slot *slot = slotArray();
+    for (quint32 i = 0; i < h->capacity; ++i, ++slot) {
+        if (slot->hash <= DELETED_SLOT)
+            continue;
+
+        quint32 urlLength, metaLength, bodyLength;
+        const char *p = recordFields(slot, &urlLength, &metaLength, &bodyLength);
+        if (!p)
+            continue;
+
+        QUrl url = QUrl::fromEncoded(QByteArray::fromRawData(p, int(urlLength)));
+        QHash<QUrl, PendingEntry>::const_iterator pending = m_inFlight.constFind(url);
+        if (pending != m_inFlight.constEnd() && !pending->metaOnly)
+            continue; // about to be replaced
+
+        QNetworkCacheMetaData metaData;
+        if (pending != m_inFlight.constEnd()) {
+            metaData = pending->metaData;
+        } else if (!slot->metaLength) {
+            parseMetaData(p + urlLength, metaLength, &metaData);
+        } else {
+            const char *q = metaFields(slot, &urlLength, &metaLength);
+            if (!q)
+                q = recordFields(slot, &urlLength, &metaLength, &bodyLength);
+            if (!q)
+                continue;
+            parseMetaData(q + urlLength, metaLength, &metaData);
+        }
+
+        CacheEntryInfo entry;
+        entry.url = url;
+        entry.size = slot->length + slot->metaLength;
+        entry.lastModified = metaData.lastModified();
+        entry.expirationDate = metaData.expirationDate();
+        entries.append(entry);
+    }
+
+    return entries;
+}
+
+QNetworkCacheMetaData PackCache::peek(const QUrl &url, qint64 *size)
+{
+    QHash<QUrl, PendingEntry>::const_iterator it = m_inFlight.constFind(url);
+    if (it != m_inFlight.constEnd() && !it->metaOnly) {
+        if (size)
+            *size = it->data.size();
+        return it->metaData;
+    }
+
+    QNetworkCacheMetaData metaData;
+    if (!readRecord(url, &metaData, 0))
+        return QNetworkCacheMetaData();
+    if (it != m_inFlight.constEnd())
+        metaData = it->metaData;
+
+    if (size) {
+        Slot *slot = findSlot(urlHash(url), false);
+        *size = slot->length + slot->metaLength;
+    }
+    return metaData;
+}
+
+bool PackCache::isPinned(const QUrl &url) const
+{
+    return m_pinned.contains(url);
+}
+
+void PackCache::setPinned(const QUrl &url, bool pinned)
+{
+    if (pinned == m_pinned.contains(url))
+        return;
+
+    if (pinned)
+        m_pinned.insert(url);
+    else
+        m_pinned.remove(url);
+    writePinnedUrls(m_directory, m_pinned);
+}
+
+qint64 PackCache::cacheSize() const
+{
+    qint64 size = 0;
+    foreach (const PackStats &stats, m_packs)
+        size += stats.total;
+    foreach (const PendingEntry &entry, m_inFlight)
+        size += entry.data.size();
+    return size;
+}
+
+QIODevice *PackCache::prepare(const QNetworkCacheMetaData &metaData)
+{
+    if (!metaData.isValid() || !metaData.url().isValid() || !metaData.saveToDisk())
+        return 0;
+
+    QBuffer *buffer = new QBuffer();
+    buffer->open(QIODevice::ReadWrite);
+    m_preparing.insert(buffer, metaData);
+    return buffer;
+}
+
+void PackCache::insert(QIODevice *device)
+{
+    QHash<QIODevice*, QNetworkCacheMetaData>::iterator it = m_preparing.find(device);
+    if (it == m_preparing.end())
+        return;
+
+    QNetworkCacheMetaData metaData = it.value();
+    m_preparing.erase(it);
+
+    write(metaData, static_cast<QBuffer*>(device)->data());
+    delete device;
+}
+
+void PackCache::write(const QNetworkCacheMetaData &metaData, const QByteArray &data,
+                      bool metaOnly)
+{
+    QByteArray url = metaData.url().toEncoded();
+
+    QByteArray meta;
+    QDataStream stream(&meta, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << metaData;
+
+    quint32 fields[4] = { metaOnly ? META_MAGIC : RECORD_MAGIC, quint32(url.size()),
+                          quint32(meta.size()), quint32(data.size()) };
+    QByteArray header;
+    header.reserve(RECORD_HEADER_SIZE + url.size() + meta.size());
+    header.append(reinterpret_cast<const char*>(fields), sizeof(fields));
+    header.append(url);
+    header.append(meta);
+
+    PendingEntry entry;
+    entry.serial = ++m_serial;
+    entry.metaOnly = metaOnly;
+    entry.metaData = metaData;
+    entry.data = data;
+    m_inFlight.insert(metaData.url(), entry);
+    m_writes.insert(entry.serial, metaData.url());
+
+    QMetaObject::invokeMethod(m_writer, "append", Qt::QueuedConnection,
+                              Q_ARG(quint64, entry.serial),
+                              Q_ARG(QByteArray, header),
+                              Q_ARG(QByteArray, data));
+}
+
+void PackCache::handleAppended(quint64 serial, quint32 pack, quint64 offset, quint32 length)
+{
+    QUrl url = m_writes.take(serial);
+    if (pack < m_firstPack)
+        return; // written before the cache was cleared
+
+    m_packs[pack].total += length;
+    m_writePack = qMax(m_writePack, pack);
+
+    // Skip entries that were removed or written again in the meantime
+    QHash<QUrl, PendingEntry>::iterator it = m_inFlight.find(url);
+    if (it == m_inFlight.end() || it->serial != serial) {
+        maintain();
+        return;
+    }
+    bool metaOnly = it->metaOnly;
+    m_inFlight.erase(it);
+
+    if (length == 0 || !m_index)
+        return;
+
+    quint64 hash = urlHash(url);
+    if (metaOnly) {
+        // Attached to the record with the body, unless that has gone since
+        Slot *slot = findSlot(hash, false);
+        if (slot) {
+            clearMeta(slot);
+            slot->metaPack = pack;
+            slot->metaOffset = offset;
+            slot->metaLength = length;
+            m_packs[pack].live += length;
+        }
+        maintain();
+        return;
+    }
+
+    if (header()->used + 1 > header()->capacity / 10 * 7)
+        growIndex();
+
+    Slot *slot = findSlot(hash, true);
+    if (!slot)
+        return;
+
+    if (slot->hash == hash) {
+        clearMeta(slot);
+        m_packs[slot->pack].live -= slot->length;
+    } else {
+        slot->metaLength = 0;
+        if (slot->hash == EMPTY_SLOT)
+            ++header()->used;
+        ++header()->count;
+    }
+
+    slot->hash = hash;
+    slot->pack = pack;
+    slot->offset = offset;
+    slot->length = length;
+    m_packs[pack].live += length;
+
+    maintain();
+}
+
+void PackCache::handleCompacted(quint32 pack, const PackRelocationList &relocations)
+{
+    m_compacting = false;
+
+    foreach (const PackRelocation &relocation, relocations) {
+        if (relocation.pack < m_firstPack)
+            continue;
+
+        m_packs[relocation.pack].total += relocation.length;
+        m_writePack = qMax(m_writePack, relocation.pack);
+
+        // Only move entries that haven't changed since the copy was made
+        Slot *slot = findSlot(relocation.hash, false);
+        if (!slot)
+            continue;
+
+        if (slot->pack == pack && slot->offset == relocation.oldOffset) {
+            m_packs[pack].live -= slot->length;
+            slot->pack = relocation.pack;
+            slot->offset = relocation.offset;
+            m_packs[relocation.pack].live += slot->length;
+        } else if (slot->metaLength && slot->metaPack == pack
+                   && slot->metaOffset == relocation.oldOffset) {
+            m_packs[pack].live -= slot->metaLength;
+            slot->metaPack = relocation.pack;
+            slot->metaOffset = relocation.offset;
+            m_packs[relocation.pack].live += slot->metaLength;
+        }
+    }
+
+    // Anything still in the old pack couldn't be copied and is dropped
+    if (m_packs.contains(pack))
+        dropPack(pack);
+
+    maintain();
+}
+
+void PackCache::dropPack(quint32 pack)
+{
+    if (m_index) {
+        IndexHeader *h = header();
+        Slot *slot = slotArray();
+        for (quint32 i = 0; i < h->capacity; ++i, ++slot) {
+            if (slot->hash > DELETED_SLOT && (slot->pack == pack
+                    || (slot->metaLength && slot->metaPack == pack)))
+                removeSlot(slot);
+        }
+    }
+
+    unmapPack(pack);
+    m_packs.remove(pack);
+    QMetaObject::invokeMethod(m_writer, "removePack", Qt::QueuedConnection,
+                              Q_ARG(quint32, pack));
+}
+
+// Writes the pinned entries of a pack that is about to be evicted again, so
+// that they end up in the newest pack
+void PackCache::keepPinned(quint32 pack)
+{
+    if (m_pinned.isEmpty() || !m_index)
+        return;
+
+    QList<QUrl> urls;
+    foreach (const QUrl &url, m_pinned) {
+        Slot *slot = findSlot(urlHash(url), false);
+        if (slot && (slot->pack == pack || (slot->metaLength && slot->metaPack == pack))
+                && !m_inFlight.contains(url))
+            urls.append(url);
+    }
+
+    foreach (const QUrl &url, urls) {
+        QNetworkCacheMetaData metaData;
+        QByteArray data;
+        if (readRecord(url, &metaData, &data))
+            write(metaData, data);
+    }
+}
+
+void PackCache::maintain()
+{
+    // Evict whole packs, oldest first, while the cache is over its limit.
+    // The pack that is currently being written to is never touched.
+    while (m_maxSize > 0 && cacheSize() > m_maxSize
+           && !m_packs.isEmpty() && m_packs.firstKey() < m_writePack) {
+        keepPinned(m_packs.firstKey());
+        dropPack(m_packs.firstKey());
+    }
+
+    if (m_compacting || !m_index)
+        return;
+
+    QMap<quint32, PackStats>::const_iterator it = m_packs.constBegin();
+    for (; it != m_packs.constEnd() && it.key() < m_writePack; ++it) {
+        quint32 pack = it.key();
+        if (it->live <= 0) {
+            dropPack(pack);
+            return;
+        }
+        if (it->total < MIN_COMPACT_SIZE || it->live * 2 >= it->total)
+            continue;
+
+        PackRecordList records;
+        IndexHeader *h = header();
+        Slot *slot = slotArray();
+        for (quint32 i = 0; i < h->capacity; ++i, ++slot) {
+            if (slot->hash <= DELETED_SLOT)
+                continue;
+            if (slot->pack == pack) {
+                PackRecord record = { slot->hash, slot->offset, slot->length };
+                records.append(record);
+            }
+            if (slot->metaLength && slot->metaPack == pack) {
+                PackRecord record = { slot->hash, slot->metaOffset, slot->metaLength };
+                records.append(record);
+            }
+        }
+
+        m_compacting = true;
+        QMetaObject::invokeMethod(m_writer, "compact", Qt::QueuedConnection,
+                                  Q_ARG(quint32, pack),
+                                  Q_ARG(PackRecordList, records));
+        return;
+    }
+}
+
+void PackCache::clear()
+{
+    qDeleteAll(m_preparing.keys());
+    m_preparing.clear();
+    m_inFlight.clear();
+    m_writes.clear();
+
+    foreach (quint32 pack, m_mapped.keys())
+        unmapPack(pack);
+    m_packs.clear();
+    createIndex(INITIAL_CAPACITY);
+
+    // Anything the writer reports for packs before this one is ignored
+    m_firstPack = ++m_writePack;
+    m_compacting = false;
+    QMetaObject::invokeMethod(m_writer, "clear", Qt::QueuedConnection,
+                              Q_ARG(quint32, m_firstPack));
+}
+
+} } }
@@ -0,0 +1,202 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef PACKCACHE_H
+#define PACKCACHE_H
+
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMap>
+#include <QtCore/QMetaType>
+#include <QtCore/QSet>
+#include <QtCore/QThread>
+#include <QtCore/QUrl>
+#include <QtNetwork/QAbstractNetworkCache>
+
+#include "qpm.h"
+#include "cacheinspector.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Location of a record that the writer thread has to copy during compaction
+struct PackRecord
+{
+    quint64 hash;
+    quint64 offset;
+    quint32 length;
+};
+
+// New location of a record after compaction
+struct PackRelocation
+{
+    quint64 hash;
+    quint64 oldOffset;
+    quint32 pack;
+    quint64 offset;
+    quint32 length;
+};
+
+typedef QList<PackRecord> PackRecordList;
+typedef QList<PackRelocation> PackRelocationList;
+
+// Appends records to pack files. Lives in the cache's writer thread; all of
+// its slots are invoked through queued connections.
+class PackWriter : public QObject
+{
+    Q_OBJECT
+
+public:
+    PackWriter(const QString &directory, quint32 firstPack, qint64 packSize);
+
+public slots:
+    void append(quint64 serial, const QByteArray &header, const QByteArray &body);
+    void compact(quint32 pack, const PackRecordList &records);
+    void removePack(quint32 pack);
+    void clear(quint32 firstPack);
+
+signals:
+    void appended(quint64 serial, quint32 pack, quint64 offset, quint32 length);
+    void compacted(quint32 pack, const PackRelocationList &relocations);
+
+private slots:
+    void flush();
+
+private:
+    struct Appended
+    {
+        quint64 serial;
+        quint32 pack;
+        quint64 offset;
+        quint32 length;
+    };
+
+    bool ensurePack(qint64 size);
+    bool writeRecord(const QByteArray &, const QByteArray &);
+
+    QString m_directory;
+    quint32 m_pack;
+    qint64 m_packSize;
+    QFile m_file;
+    qint64 m_offset;
+    QList<Appended> m_unflushed;
+};
+
+// A QAbstractNetworkCache that stores entries in a handful of append-only
+// pack files instead of one file per entry. A memory-mapped open addressing
+// hash table maps URLs to record offsets, so lookups and startup don't need
+// to touch the directory. Writes and compaction happen on a background
+// thread; entries are readable from memory until they have been written.
+// When the cache is full the oldest pack is dropped as a whole, after any
+// pinned entries in it have been written again. Revalidated entries only get
+// a small record with their new metadata, which points at the existing body.
+class PackCache : public QAbstractNetworkCache, public InspectableCache
+{
+    Q_OBJECT
+    Q_INTERFACES(com::cutehacks::duperagent::InspectableCache)
+
+public:
+    PackCache(const QString &directory, qint64 maxSize, QObject *parent = 0);
+    ~PackCache();
+
+    QNetworkCacheMetaData metaData(const QUrl &);
+    void updateMetaData(const QNetworkCacheMetaData &);
+    QIODevice *data(const QUrl &);
+    bool remove(const QUrl &);
+    qint64 cacheSize() const;
+
+    QIODevice *prepare(const QNetworkCacheMetaData &);
+    void insert(QIODevice *);
+
+    QString cacheDirectory() const { return m_directory; }
+    qint64 maximumCacheSize() const { return m_maxSize; }
+
+    QList<CacheEntryInfo> entries();
+    QNetworkCacheMetaData peek(const QUrl &, qint64 *size);
+    bool isPinned(const QUrl &) const;
+    void setPinned(const QUrl &, bool);
+
+public slots:
+    void clear();
+
+private slots:
+    void handleAppended(quint64 serial, quint32 pack, quint64 offset, quint32 length);
+    void handleCompacted(quint32 pack, const PackRelocationList &relocations);
+
+private:
+    struct Slot;
+    struct IndexHeader;
+
+    struct PendingEntry
+    {
+        quint64 serial;
+        bool metaOnly;
+        QNetworkCacheMetaData metaData;
+        QByteArray data;
+    };
+
+    struct PackStats
+    {
+        PackStats() : live(0), total(0) {}
+        qint64 live;
+        qint64 total;
+    };
+
+    struct MappedPack
+    {
+        MappedPack() : file(0), data(0), size(0) {}
+        QFile *file;
+        uchar *data;
+        qint64 size;
+    };
+
+    bool openIndex();
+    bool createIndex(quint32 capacity);
+    void growIndex();
+    Slot *findSlot(quint64 hash, bool insert);
+    IndexHeader *header() const;
+    Slot *slotArray() const;
+
+    const char *recordFields(Slot *, quint32 *urlLength, quint32 *metaLength,
+                             quint32 *bodyLength);
+    const char *metaFields(Slot *, quint32 *urlLength, quint32 *metaLength);
+    void clearMeta(Slot *);
+    bool readRecord(const QUrl &, QNetworkCacheMetaData *, QByteArray *);
+    const uchar *mapRecord(quint32 pack, quint64 offset, quint32 length);
+    void unmapPack(quint32 pack);
+    void removeSlot(Slot *);
+
+    void write(const QNetworkCacheMetaData &, const QByteArray &, bool metaOnly = false);
+    void dropPack(quint32 pack);
+    void keepPinned(quint32 pack);
+    void maintain();
+
+    QString m_directory;
+    qint64 m_maxSize;
+
+    QFile m_indexFile;
+    uchar *m_index;
+
+    QMap<quint32, PackStats> m_packs;
+    QHash<quint32, MappedPack> m_mapped;
+    quint32 m_firstPack;
+    quint32 m_writePack;
+    bool m_compacting;
+
+    QHash<QIODevice*, QNetworkCacheMetaData> m_preparing;
+    QHash<QUrl, PendingEntry> m_inFlight;
+    QHash<quint64, QUrl> m_writes;
+    quint64 m_serial;
+
+    QSet<QUrl> m_pinned;
+
+    QThread m_thread;
+    PackWriter *m_writer;
+};
+
+} } }
+
+Q_DECLARE_METATYPE(com::cutehacks::duperagent::PackRecordList)
+Q_DECLARE_METATYPE(com::cutehacks::duperagent::PackRelocationList)
+
+#endif // PACKCACHE_H
@@ -0,0 +1,112 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkReply>
+
+#include "prefetcher.h"
+#include "networkactivityindicator.h"
+#include "networkpool.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+static const int DEFAULT_MAX_CONCURRENT = 2;
+
+Prefetcher::Prefetcher(QNetworkAccessManager *network, QObject *parent) :
+    QObject(parent),
+    m_network(network),
+    m_maxConcurrent(DEFAULT_MAX_CONCURRENT)
+{
+    connect(NetworkActivityIndicator::instance(), SIGNAL(activityCountChanged(uint)),
+            this, SLOT(pump()));
+}
+
+Prefetcher::~Prefetcher()
+{
+    cancel();
+}
+
+void Prefetcher::add(const QNetworkRequest &request)
+{
+    QUrl url = request.url();
+    if (!url.isValid() || m_urls.contains(url))
+        return;
+
+    QNetworkRequest prefetch(request);
+    prefetch.setPriority(QNetworkRequest::LowPriority);
+    prefetch.setAttribute(QNetworkRequest::CacheSaveControlAttribute, true);
+
+    m_urls.insert(url);
+    m_queue.append(prefetch);
+
+    // Give requests started in the same turn of the event loop a chance to
+    // register with the activity indicator before anything is sent
+    QMetaObject::invokeMethod(this, "pump", Qt::QueuedConnection);
+}
+
+void Prefetcher::cancel()
+{
+    m_queue.clear();
+    m_urls.clear();
+
+    QSet<QNetworkReply*> replies = m_replies;
+    m_replies.clear();
+    foreach (QNetworkReply *reply, replies) {
+        reply->disconnect(this);
+        reply->abort();
+        reply->deleteLater();
+    }
+}
+
+void Prefetcher::setMaxConcurrent(int maxConcurrent)
+{
+    m_maxConcurrent = qMax(1, maxConcurrent);
+    pump();
+}
+
+void Prefetcher::pump()
+{
+    // Requests that are already running are left alone, but nothing new is
+    // started while the application is waiting for the network
+    if (NetworkActivityIndicator::instance()->activityCount() > 0)
+        return;
+
+    NetworkPool *pool = NetworkPool::find(m_network);
+    while (!m_queue.isEmpty() && m_replies.size() < m_maxConcurrent) {
+        QNetworkRequest request = m_queue.takeFirst();
+        QNetworkAccessManager *network = pool ? pool->managerFor(request.url()) : m_network;
+        QNetworkReply *reply = network->get(request);
+        if (pool)
+            pool->track(reply);
+        m_replies.insert(reply);
+        connect(reply, SIGNAL(readyRead()), this, SLOT(handleReadyRead()));
+        connect(reply, SIGNAL(finished()), this, SLOT(handleFinished()));
+    }
+}
+
+void Prefetcher::handleReadyRead()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (reply)
+        reply->readAll();
+}
+
+void Prefetcher::handleFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (!reply || !m_replies.remove(reply))
+        return;
+
+    if (reply->error() != QNetworkReply::NoError
+            && reply->error() != QNetworkReply::OperationCanceledError) {
+        qWarning("Prefetch of %s failed: %s",
+                 qUtf8Printable(reply->url().toString()),
+                 qUtf8Printable(reply->errorString()));
+    }
+
+    m_urls.remove(reply->request().url());
+    reply->deleteLater();
+    pump();
+}
+
+} } }
@@ -0,0 +1,55 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <QtCore/QList>
+#include <QtCore/QObject>
+#include <QtCore/QSet>
+#include <QtCore/QUrl>
+#include <QtNetwork/QNetworkRequest>
+
+#include "qpm.h"
+
+class QNetworkAccessManager;
+class QNetworkReply;
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Warms the network cache with GET requests that nobody is waiting for.
+// Requests are sent at low priority, only a few at a time, and only while
+// no other Duperagent requests are in flight. Response bodies are read and
+// dropped; QNetworkAccessManager stores them in the cache on the way.
+class Prefetcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit Prefetcher(QNetworkAccessManager *network, QObject *parent = 0);
+    ~Prefetcher();
+
+    void add(const QNetworkRequest &);
+    void cancel();
+
+    int maxConcurrent() const { return m_maxConcurrent; }
+    void setMaxConcurrent(int);
+
+    int pending() const { return m_queue.size() + m_replies.size(); }
+
+private slots:
+    void pump();
+    void handleReadyRead();
+    void handleFinished();
+
+private:
+    QNetworkAccessManager *m_network;
+    QList<QNetworkRequest> m_queue;
+    QSet<QNetworkReply*> m_replies;
+    QSet<QUrl> m_urls;
+    int m_maxConcurrent;
+};
+
+} } }
+
+#endif // PREFETCHER_H
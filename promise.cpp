@@ -4,6 +4,7 @@
 #include <QtQml/QQmlEngine>
 
 #include "promise.h"
+#include "microtaskqueue.h"
 
 namespace com { namespace cutehacks { namespace duperagent {
 
@@ -29,9 +30,9 @@ QJSValue Promise::then(QJSValue onFulfilled, QJSValue onRejected)
     Promise *next = new Promise(m_engine);
 
     if (m_state == FULFILLED) {
-        call(onFulfilled, m_value, next);
+        schedule(onFulfilled, next);
     } else if (m_state == REJECTED) {
-        call(onRejected, m_value, next);
+        schedule(onRejected, next);
     } else {
         Handler h = {
             onFulfilled,
@@ -60,9 +61,10 @@ void Promise::fulfill(const QJSValue &value)
 
     while (!m_handlers.empty()) {
         Handler h = m_handlers.takeFirst();
-        call(h.onFulfilled, m_value, h.next);
+        schedule(h.onFulfilled, h.next);
     }
 
+    notifyListeners();
     emit settled(m_state, m_value);
 }
 
@@ -76,35 +78,74 @@ void Promise::reject(const QJSValue &reason)
 
     while (!m_handlers.empty()) {
         Handler h = m_handlers.takeFirst();
-        call(h.onRejected, m_value, h.next);
+        schedule(h.onRejected, h.next);
     }
 
+    notifyListeners();
     emit settled(m_state, m_value);
 }
 
-void Promise::call(QJSValue fn, const QJSValue& arg, Promise *promise)
+void Promise::addListener(PromiseListener *listener, int index)
+{
+    m_listeners.append(qMakePair(listener, index));
+}
+
+void Promise::removeListener(PromiseListener *listener)
+{
+    for (int i = m_listeners.size() - 1; i >= 0; --i) {
+        if (m_listeners.at(i).first == listener)
+            m_listeners.remove(i);
+    }
+}
+
+void Promise::notifyListeners()
+{
+    // Listeners may remove themselves from this promise while being told
+    QVector<QPair<PromiseListener*, int> > listeners;
+    listeners.swap(m_listeners);
+    for (int i = 0; i < listeners.size(); ++i)
+        listeners.at(i).first->promiseSettled(listeners.at(i).second, m_state, m_value);
+}
+
+// 2.2.4 onFulfilled or onRejected must not be called until the execution
+// context stack contains only platform code
+void Promise::schedule(QJSValue fn, Promise *promise)
 {
     Q_ASSERT(m_state != PENDING);
 
+    Microtask task = {
+        promise,
+        promise->self(),
+        m_state,
+        fn,
+        m_value
+    };
+    MicrotaskQueue::instance()->enqueue(task);
+}
+
+// Runs a handler of a promise that settled with the given state and value,
+// and resolves this promise with its result
+void Promise::react(State state, QJSValue fn, const QJSValue &arg)
+{
     if (!fn.isCallable()) {
-        if (m_state == FULFILLED)
-            promise->fulfill(!fn.isUndefined() ? fn : arg);
+        if (state == FULFILLED)
+            fulfill(!fn.isUndefined() ? fn : arg);
         else
-            promise->reject(!fn.isUndefined() ? fn : arg);
+            reject(!fn.isUndefined() ? fn : arg);
     } else {
         QJSValue result = fn.call(QJSValueList() << arg);
         if (result.isError()) {
-            promise->reject(result);
+            reject(result);
         } else {
             Promise *p = qobject_cast<Promise*>(result.toQObject());
             if (p) {
-                if (p == promise) {
+                if (p == this) {
                     // 2.3.1 If promise and x refer to the same object, reject
                     // promise with a TypeError as the reason.
-                    promise->reject(m_engine->evaluate("new TypeError();"));
+                    reject(m_engine->evaluate("new TypeError();"));
                 } else {
                     // 2.3.2 If x is a promise, adopt its state
-                    promise->merge(p);
+                    merge(p);
                 }
             } else if (result.isCallable() || result.isObject()) {
                 // 2.3.3 Otherwise, if x is an object or function,
@@ -115,27 +156,27 @@ void Promise::call(QJSValue fn, const QJSValue& arg, Promise *promise)
                 if (then.isError()) {
                     // 2.3.3.2 If retrieving the property x.then results in a
                     // thrown exception e, reject promise with e as the reason.
-                    promise->reject(then);
+                    reject(then);
                 } else if (then.isCallable()) {
                     // 2.3.3.3 If then is a function, call it with x as this,
                     // first argument resolvePromise, and second argument
                     // rejectPromise
-                    QJSValue resolvePromise = promise->self().property("fulfill");
-                    QJSValue rejectPromise = promise->self().property("reject");
+                    QJSValue resolvePromise = self().property("fulfill");
+                    QJSValue rejectPromise = self().property("reject");
 
                     QJSValue thenResult = then.callWithInstance(result,
                         QJSValueList() << resolvePromise << rejectPromise);
 
                     if (thenResult.isError()) {
-                        promise->reject(thenResult);
+                        reject(thenResult);
                     }
                 } else {
                     // 2.3.3.4 If then is not a function, fulfill promise with x.
-                    promise->fulfill(result);
+                    fulfill(result);
                 }
             } else {
                 // 2.3.4 If x is not an object or function, fulfill promise with x.
-                promise->fulfill(result);
+                fulfill(result);
             }
         }
     }
@@ -5,6 +5,8 @@
 #define PROMISE_H
 
 #include <QtCore/QObject>
+#include <QtCore/QPair>
+#include <QtCore/QVector>
 #include <QtQml/QJSValue>
 
 class QQmlEngine;
@@ -18,6 +20,9 @@ struct Handler {
     Promise *next;
 };
 
+class MicrotaskQueue;
+class PromiseListener;
+
 class Promise : public QObject
 {
     Q_OBJECT
@@ -51,9 +56,15 @@ public:
     inline QJSValue value() const {     return m_value; }
     inline State state() const {     return m_state; }
 
+    // The listener is told once, with the given index, when this settles
+    void addListener(PromiseListener *, int index);
+    void removeListener(PromiseListener *);
+
 protected:
-    void call(QJSValue, const QJSValue&, Promise *);
+    void schedule(QJSValue, Promise *);
+    void react(State, QJSValue, const QJSValue&);
     void merge(Promise *);
+    void notifyListeners();
 
 signals:
     void settled(Promise::State, QJSValue);
@@ -67,6 +78,18 @@ private:
     State m_state;
     QJSValue m_value;
     QList<Handler> m_handlers;
+    QVector<QPair<PromiseListener*, int> > m_listeners;
+
+    friend class MicrotaskQueue;
+};
+
+// Implemented by whatever needs to know when a promise settles without
+// going through then(), like the combinators of the Promise module
+class PromiseListener
+{
+public:
+    virtual ~PromiseListener() {}
+    virtual void promiseSettled(int index, Promise::State, const QJSValue &) = 0;
 };
 
 } } }
@@ -1,60 +1,98 @@
 // Copyright 2016 Cutehacks AS. All rights reserved.
 // License can be found in the LICENSE file.
 
+#include <QtCore/QVariant>
 #include <QtQml/QQmlEngine>
-#if QT_VERSION < QT_VERSION_CHECK(5, 6, 0)
-#include "jsvalueiterator.h"
-#else
-#include <QtQml/QJSValueIterator>
-typedef QJSValueIterator JSValueIterator;
-#endif
 
 #include "promisemodule.h"
 #include "promise.h"
+#include "deferred.h"
 
 namespace com { namespace cutehacks { namespace duperagent {
 
-static const char* INDEX_PROPERTY = "value_index";
+// Subscribes an executor to a thenable that isn't one of our promises. The
+// function is compiled once and kept on the engine.
+static const char *LISTEN_PROPERTY = "_duperagent_listen";
+
+static const char *LISTEN_SOURCE =
+    "(function(executor, thenable, index) {"
+    "    thenable.then(function(value) { executor.fulfilled(index, value); },"
+    "                  function(reason) { executor.rejected(index, reason); });"
+    "})";
+
+static QJSValue listenFunction(QQmlEngine *engine)
+{
+    QVariant cached = engine->property(LISTEN_PROPERTY);
+    if (cached.isValid())
+        return cached.value<QJSValue>();
+
+    QJSValue listen = engine->evaluate(QString::fromLatin1(LISTEN_SOURCE));
+    engine->setProperty(LISTEN_PROPERTY, QVariant::fromValue(listen));
+    return listen;
+}
 
 PromiseModule::PromiseModule(QQmlEngine *engine, QObject *parent) :
     QObject(parent),
-    m_engine(engine)
+    m_engine(engine),
+    m_native(Deferred::nativeConstructor(engine))
 { }
 
+// Calls a static function of the engine's Promise constructor
+QJSValue PromiseModule::callNative(const char *name, const QJSValue &arg)
+{
+    return m_native.property(QString::fromLatin1(name)).callWithInstance(
+                m_native, QJSValueList() << arg);
+}
+
+QJSValue PromiseModule::combine(MultiPromiseExecutor::Behavior behavior, const char *name,
+                                const QJSValue &iterable)
+{
+    if (m_native.property(QString::fromLatin1(name)).isCallable())
+        return callNative(name, iterable);
+
+    if (!iterable.isArray()) {
+        return reject(QStringLiteral("Argument passed to Promise.%1 was not iterable")
+                      .arg(QString::fromLatin1(name)));
+    }
+
+    MultiPromiseExecutor *executor = new MultiPromiseExecutor(m_engine, behavior);
+    return executor->addIterable(iterable);
+}
+
 QJSValue PromiseModule::create(QJSValue executor)
 {
+    if (m_native.isCallable())
+        return m_native.callAsConstructor(QJSValueList() << executor);
+
     Promise *p = new Promise(m_engine, executor);
     return p->self();
 }
 
 QJSValue PromiseModule::all(QJSValue iterable)
 {
-    if (iterable.isArray()) {
-        MultiPromiseExecutor *executor = new MultiPromiseExecutor(
-            m_engine,
-            MultiPromiseExecutor::All);
-
-        return executor->addIterable(iterable)->self();
-    } else {
-        return reject("Argument passed to Promise.all was not iterable");
-    }
+    return combine(MultiPromiseExecutor::All, "all", iterable);
 }
 
 QJSValue PromiseModule::race(QJSValue iterable)
 {
-    if (iterable.isArray()) {
-        MultiPromiseExecutor *executor = new MultiPromiseExecutor(
-            m_engine,
-            MultiPromiseExecutor::Race);
+    return combine(MultiPromiseExecutor::Race, "race", iterable);
+}
 
-        return executor->addIterable(iterable)->self();
-    } else {
-        return reject("Argument passed to Promise.all was not iterable");
-    }
+QJSValue PromiseModule::allSettled(QJSValue iterable)
+{
+    return combine(MultiPromiseExecutor::AllSettled, "allSettled", iterable);
+}
+
+QJSValue PromiseModule::any(QJSValue iterable)
+{
+    return combine(MultiPromiseExecutor::Any, "any", iterable);
 }
 
 QJSValue PromiseModule::resolve(QJSValue value)
 {
+    if (m_native.isCallable())
+        return callNative("resolve", value);
+
     Promise *p = new Promise(m_engine);
     p->fulfill(value);
     return p->self();
@@ -62,6 +100,9 @@ QJSValue PromiseModule::resolve(QJSValue value)
 
 QJSValue PromiseModule::reject(QJSValue reason)
 {
+    if (m_native.isCallable())
+        return callNative("reject", reason);
+
     Promise *p = new Promise(m_engine);
     p->reject(reason);
     return p->self();
@@ -70,79 +111,167 @@ QJSValue PromiseModule::reject(QJSValue reason)
 MultiPromiseExecutor::MultiPromiseExecutor(QQmlEngine *engine, Behavior b, QObject *parent) :
     QObject(parent),
     m_engine(engine),
-    m_index(0),
-    m_argsLength(0),
     m_behavior(b),
-    m_promise(0)
+    m_remaining(0),
+    m_done(false)
 {
-    m_self = engine->newQObject(this);
 }
 
-Promise *MultiPromiseExecutor::addIterable(QJSValue iterable)
+MultiPromiseExecutor::~MultiPromiseExecutor()
 {
-    m_promise = new Promise(m_engine);
-    m_argsLength = iterable.property("length").toInt();
-    m_args = m_engine->newArray(m_argsLength);
+    stopListening();
+}
+
+QJSValue MultiPromiseExecutor::addIterable(QJSValue iterable)
+{
+    m_deferred = Deferred(m_engine);
+    QJSValue promise = m_deferred.promise();
 
-    JSValueIterator it(iterable);
-    while (it.next()) {
-        if (!it.hasNext()) //last item is length
-            break;
+    // Both are released when the outcome is known. Until then the inputs
+    // must not be collected, and neither must this while they refer to it.
+    m_self = m_engine->newQObject(this);
+    m_iterable = iterable;
 
-        Promise *p = qobject_cast<Promise*>(it.value().toQObject());
-        if (!p) {
-            p = new Promise(m_engine);
-            p->fulfill(it.value());
-        }
+    int length = iterable.property("length").toInt();
+    m_remaining = length;
+    if (m_behavior != Race)
+        m_values.resize(length);
 
-        p->setProperty(INDEX_PROPERTY, m_index++);
+    QJSValue listen;
+    for (int i = 0; i < length && !m_done; ++i) {
+        QJSValue item = iterable.property(quint32(i));
 
-        if (p->isPending()) {
-            connect(p, SIGNAL(settled(Promise::State, QJSValue)),
-                    this, SLOT(handlePromise(Promise::State, QJSValue)));
+        Promise *p = qobject_cast<Promise*>(item.toQObject());
+        if (p) {
+            if (p->isPending()) {
+                p->addListener(this, i);
+                m_listening.append(p);
+            } else {
+                settleAt(i, p->state(), p->value());
+            }
+        } else if (item.isObject() && item.property("then").isCallable()) {
+            if (!listen.isCallable())
+                listen = listenFunction(m_engine);
+            listen.call(QJSValueList() << m_self << item << i);
         } else {
-            promiseDone(p);
+            settleAt(i, Promise::FULFILLED, item);
         }
     }
 
-    return m_promise;
+    if (length == 0) {
+        if (m_behavior == Race)
+            m_self = QJSValue(); // stays pending forever
+        else
+            complete();
+    }
+
+    return promise;
 }
 
-void MultiPromiseExecutor::handlePromise(Promise::State, QJSValue)
+void MultiPromiseExecutor::promiseSettled(int index, Promise::State state, const QJSValue &value)
 {
-    Promise *p = qobject_cast<Promise*>(sender());
-    if (!p)
-        return;
-
-    promiseDone(p);
+    settleAt(index, state, value);
 }
 
-void MultiPromiseExecutor::promiseDone(Promise *p)
+void MultiPromiseExecutor::fulfilled(int index, const QJSValue &value)
 {
-    if (m_behavior == MultiPromiseExecutor::All) {
-        if (p->isRejected()) {
-            m_promise->reject(p->value());
-            blockSignals(true); // stop listening
-        } else {
-            bool ok;
-            int index = p->property(INDEX_PROPERTY).toInt(&ok);
+    settleAt(index, Promise::FULFILLED, value);
+}
 
-            if (!ok)
-                return; // todo: log error?
+void MultiPromiseExecutor::rejected(int index, const QJSValue &reason)
+{
+    settleAt(index, Promise::REJECTED, reason);
+}
 
-            m_args.setProperty(index, p->value());
+void MultiPromiseExecutor::settleAt(int index, Promise::State state, const QJSValue &value)
+{
+    if (m_done || index < 0)
+        return;
 
-            if (--m_argsLength == 0)
-                m_promise->fulfill(m_args);
+    switch (m_behavior) {
+    case All:
+        if (state == Promise::REJECTED) {
+            finish(state, value);
+            return;
         }
-    } else /* MultiPromiseExecutor::Race */ {
-        if (p->isRejected()) {
-            m_promise->reject(p->value());
+        m_values[index] = value;
+        break;
+    case Race:
+        finish(state, value);
+        return;
+    case AllSettled: {
+        QJSValue result = m_engine->newObject();
+        if (state == Promise::FULFILLED) {
+            result.setProperty("status", QStringLiteral("fulfilled"));
+            result.setProperty("value", value);
         } else {
-            m_promise->fulfill(p->value());
+            result.setProperty("status", QStringLiteral("rejected"));
+            result.setProperty("reason", value);
+        }
+        m_values[index] = result;
+        break;
+    }
+    case Any:
+        if (state == Promise::FULFILLED) {
+            finish(state, value);
+            return;
         }
-        blockSignals(true); // stop listening
+        m_values[index] = value;
+        break;
+    }
+
+    if (--m_remaining == 0)
+        complete();
+}
+
+// Every input has settled without deciding the outcome early
+void MultiPromiseExecutor::complete()
+{
+    if (m_behavior == Any) {
+        QJSValue error = m_engine->globalObject().property("Error").callAsConstructor(
+                    QJSValueList() << QStringLiteral("All promises were rejected"));
+        error.setProperty("name", QStringLiteral("AggregateError"));
+        error.setProperty("errors", valueArray());
+        finish(Promise::REJECTED, error);
+    } else {
+        finish(Promise::FULFILLED, valueArray());
+    }
+}
+
+void MultiPromiseExecutor::finish(Promise::State state, const QJSValue &value)
+{
+    m_done = true;
+    stopListening();
+
+    if (state == Promise::FULFILLED)
+        m_deferred.resolve(value);
+    else
+        m_deferred.reject(value);
+
+    m_values.clear();
+    m_iterable = QJSValue();
+    m_deferred = Deferred();
+
+    // Nothing keeps this alive from here on, apart from the callbacks given
+    // to other thenables, which are ignored now
+    m_self = QJSValue();
+}
+
+void MultiPromiseExecutor::stopListening()
+{
+    for (int i = 0; i < m_listening.size(); ++i) {
+        if (m_listening.at(i))
+            m_listening.at(i)->removeListener(this);
     }
+    m_listening.clear();
+}
+
+QJSValue MultiPromiseExecutor::valueArray() const
+{
+    QJSValue array = m_engine->newArray(m_values.size());
+    for (int i = 0; i < m_values.size(); ++i)
+        array.setProperty(quint32(i), m_values.at(i));
+    return array;
 }
 
 } } }
@@ -5,45 +5,64 @@
 #define PROMISEMODULE_H
 
 #include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QVector>
 #include <QtQml/QJSValue>
 
 #include "promise.h"
+#include "deferred.h"
 
 class QQmlEngine;
 
 namespace com { namespace cutehacks { namespace duperagent {
 
-class MultiPromiseExecutor : public QObject {
+// Settles a promise once a set of promises has settled, in the way given by
+// the behavior. The outcome of each input is kept by its index in a plain
+// vector. Our own promises report to the executor directly; other thenables,
+// such as native promises, through a pair of small callbacks. The executor
+// stops listening as soon as the outcome is known and can then be collected.
+class MultiPromiseExecutor : public QObject, public PromiseListener {
     Q_OBJECT
 
 public:
     enum Behavior {
         All,
-        Race
+        Race,
+        AllSettled,
+        Any
     };
 
     explicit MultiPromiseExecutor(QQmlEngine *, Behavior, QObject *parent = 0);
-    QJSValue self() { return m_self; }
+    ~MultiPromiseExecutor();
 
-    Promise *addIterable(QJSValue);
+    // Starts listening to the items of the array and returns the promise
+    QJSValue addIterable(QJSValue);
 
-public slots:
-    void handlePromise(Promise::State, QJSValue);
+    void promiseSettled(int, Promise::State, const QJSValue &);
 
-protected:
-    void promiseDone(Promise *);
+    Q_INVOKABLE void fulfilled(int index, const QJSValue &value);
+    Q_INVOKABLE void rejected(int index, const QJSValue &reason);
 
 private:
+    void settleAt(int, Promise::State, const QJSValue &);
+    void complete();
+    void finish(Promise::State, const QJSValue &);
+    void stopListening();
+    QJSValue valueArray() const;
+
     QQmlEngine *m_engine;
-    int m_index;
-    int m_argsLength;
     Behavior m_behavior;
+    Deferred m_deferred;
     QJSValue m_self;
-    QJSValue m_args;
-    Promise *m_promise;
+    QJSValue m_iterable;
+    QVector<QJSValue> m_values;
+    QVector<QPointer<Promise> > m_listening;
+    int m_remaining;
+    bool m_done;
 };
 
-
+// The Promise singleton. When the JavaScript engine has native promises it
+// returns those, and our own implementation is only used as a fallback.
 class PromiseModule : public QObject
 {
     Q_OBJECT
@@ -54,11 +73,17 @@ public:
     Q_INVOKABLE QJSValue create(QJSValue);
     Q_INVOKABLE QJSValue all(QJSValue);
     Q_INVOKABLE QJSValue race(QJSValue);
+    Q_INVOKABLE QJSValue allSettled(QJSValue);
+    Q_INVOKABLE QJSValue any(QJSValue);
     Q_INVOKABLE QJSValue resolve(QJSValue);
     Q_INVOKABLE QJSValue reject(QJSValue);
 
 private:
+    QJSValue callNative(const char *, const QJSValue &);
+    QJSValue combine(MultiPromiseExecutor::Behavior, const char *, const QJSValue &);
+
     QQmlEngine *m_engine;
+    QJSValue m_native;
 };
 
 } } }
@@ -4,7 +4,9 @@
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
 #include <QtCore/QBuffer>
+#include <QtCore/QDateTime>
 #include <QtCore/QMimeDatabase>
+#include <QtNetwork/QAbstractNetworkCache>
 #include <QtNetwork/QNetworkAccessManager>
 #include <QtNetwork/QNetworkRequest>
 #include <QtNetwork/QHttpMultiPart>
@@ -19,10 +21,16 @@
 #include "response.h"
 #include "config.h"
 #include "serialization.h"
-#include "promise.h"
+#include "codecregistry.h"
 #include "networkactivityindicator.h"
 #include "multipartsource.h"
 #include "duperagent.h"
+#include "mediatype.h"
+#include "cacheinspector.h"
+#include "requestqueue.h"
+#include "networkpool.h"
+#include "revalidator.h"
+#include "abortcontroller.h"
 
 #if QT_VERSION < QT_VERSION_CHECK(5, 6, 0)
 #include "jsvalueiterator.h"
@@ -40,6 +48,7 @@ static const QString EVENT_PROGRESS =   QStringLiteral("progress");
 static const QString EVENT_END =        QStringLiteral("end");
 static const QString EVENT_RESPONSE =   QStringLiteral("response");
 static const QString EVENT_SECURE =     QStringLiteral("secureconnect");
+static const QString EVENT_PART =       QStringLiteral("part");
 
 static const QString METHOD_HEAD =      QStringLiteral("HEAD");
 static const QString METHOD_POST =      QStringLiteral("POST");
@@ -48,6 +57,62 @@ static const QString METHOD_PUT =       QStringLiteral("PUT");
 static const QString METHOD_PATCH =     QStringLiteral("PATCH");
 static const QString METHOD_DELETE =    QStringLiteral("DELETE");
 
+static const QString CACHE_STALE =          QStringLiteral("stale");
+static const QString CACHE_STALE_IF_ERROR = QStringLiteral("stale-if-error");
+static const QString CACHE_REVALIDATED =    QStringLiteral("revalidated");
+static const QString CACHE_IMMUTABLE =      QStringLiteral("immutable");
+
+struct CacheDirectives
+{
+    CacheDirectives() : immutable(false), staleWhileRevalidate(0), staleIfError(0) {}
+    bool immutable;
+    int staleWhileRevalidate;
+    int staleIfError;
+};
+
+// Picks the RFC 5861 and RFC 8246 extensions out of a cached response's
+// Cache-Control header. Everything else is handled by QNetworkAccessManager.
+static CacheDirectives cacheDirectives(const QNetworkCacheMetaData &metaData)
+{
+    CacheDirectives directives;
+    foreach (const QNetworkCacheMetaData::RawHeader &header, metaData.rawHeaders()) {
+        if (qstricmp(header.first.constData(), "cache-control") != 0)
+            continue;
+
+        foreach (const QByteArray &directive, header.second.split(',')) {
+            QByteArray name = directive.trimmed().toLower();
+            QByteArray value;
+            int eq = name.indexOf('=');
+            if (eq >= 0) {
+                value = name.mid(eq + 1).trimmed();
+                name = name.left(eq).trimmed();
+                if (value.startsWith('"') && value.endsWith('"') && value.size() > 1)
+                    value = value.mid(1, value.size() - 2);
+            }
+
+            if (name == "immutable")
+                directives.immutable = true;
+            else if (name == "stale-while-revalidate")
+                directives.staleWhileRevalidate = qMax(0, value.toInt());
+            else if (name == "stale-if-error")
+                directives.staleIfError = qMax(0, value.toInt());
+        }
+    }
+    return directives;
+}
+
+// Failures for which RFC 5861 allows a stale response to be used instead:
+// the server couldn't be reached or answered with a server error.
+static bool isStaleIfErrorCase(QNetworkReply *reply, int status)
+{
+    QNetworkReply::NetworkError error = reply->error();
+    if (error == QNetworkReply::OperationCanceledError)
+        return false; // aborted by the application
+    if (error > QNetworkReply::NoError && error < QNetworkReply::ProxyConnectionRefusedError)
+        return true;
+    return status == 500 || status == 502 || status == 503 || status == 504;
+}
+
 static inline uint percent(qint64 loaded, qint64 total) {
     if (total > 0)
         return int(loaded / (double)total * 100);
@@ -66,8 +131,13 @@ RequestPrototype::RequestPrototype(QQmlEngine *engine, Method method, const QUrl
     m_timer(0),
     m_redirects(5),
     m_redirectCount(0),
-    m_promise(0),
-    m_responseType(duperagent::ResponseType::Auto)
+    m_responseType(duperagent::ResponseType::Auto),
+    m_partsChecked(false),
+    m_staleEntry(false),
+    m_staleIfError(false),
+    m_queued(false),
+    m_queueId(0),
+    m_aborted(false)
 {
     Config::instance()->init(m_engine);
     m_request = new QNetworkRequest(QUrl(url.toString()));
@@ -112,6 +182,22 @@ QJSValue RequestPrototype::abort()
     return self();
 }
 
+QJSValue RequestPrototype::signal(const QJSValue &controller)
+{
+    AbortController *abortController = qobject_cast<AbortController*>(controller.toQObject());
+    if (!abortController) {
+        qWarning("'signal' expects an AbortController");
+        return self();
+    }
+
+    if (m_abortController)
+        disconnect(m_abortController, 0, this, 0);
+    m_abortController = abortController;
+    connect(abortController, SIGNAL(abortedChanged()), this, SLOT(handleAbortSignal()));
+
+    return self();
+}
+
 QJSValue RequestPrototype::set(const QJSValue &field, const QJSValue &val)
 {
     if (field.isObject()) {
@@ -192,6 +278,12 @@ QJSValue RequestPrototype::cacheLoad(int value)
     return self();
 }
 
+QJSValue RequestPrototype::queue()
+{
+    m_queued = true;
+    return self();
+}
+
 QJSValue RequestPrototype::query(const QJSValue &query)
 {
     if (query.isObject()) {
@@ -379,27 +471,22 @@ QJSValue RequestPrototype::end(QJSValue callback)
 void RequestPrototype::endCallback(QJSValue err, QJSValue res)
 {
     if (err.isError()) {
-        m_executor.second.call(QJSValueList() << err);
+        m_deferred.reject(err);
     } else {
-        m_executor.first.call(QJSValueList() << res);
+        m_deferred.resolve(res);
     }
 }
 
-void RequestPrototype::executor(QJSValue resolve, QJSValue reject)
-{
-    m_executor.first = resolve;
-    m_executor.second = reject;
-    end(self().property("endCallback"));
-}
-
 QJSValue RequestPrototype::then(QJSValue onFulfilled, QJSValue onRejected)
 {
-    if (!m_promise) {
-        m_promise.reset(new Promise(m_engine, self().property("executor")));
-        m_engine->setObjectOwnership(m_promise.data(), QQmlEngine::CppOwnership);
+    if (!m_deferred.isValid()) {
+        m_deferred = Deferred(m_engine);
+        end(self().property("endCallback"));
     }
 
-    return m_promise->then(onFulfilled, onRejected);
+    QJSValue promise = m_deferred.promise();
+    return promise.property("then").callWithInstance(promise,
+        QJSValueList() << onFulfilled << onRejected);
 }
 
 QString RequestPrototype::method() const
@@ -478,21 +565,27 @@ void RequestPrototype::setHeaders(const QJSValue &headers)
 
 QByteArray RequestPrototype::serializeData()
 {
-    QByteArray type = m_request->header(
-                QNetworkRequest::ContentTypeHeader).toByteArray();
+    // Strings are sent as they are, like SuperAgent does
+    if (m_data.isString())
+        return m_data.toString().toUtf8();
+
+    MediaType type(m_request->header(QNetworkRequest::ContentTypeHeader).toByteArray());
+    QScopedPointer<BodyCodec> codec(BodyCodecRegistry::create(m_engine, type));
+    if (codec)
+        return codec->stringify(m_data);
 
-    if (type.contains(contentTypes["json"])) {
-        JsonCodec json(m_engine);
-        return json.stringify(m_data);
-    } else if (type.contains(contentTypes["form"])) {
-        FormUrlEncodedCodec urlencoded(m_engine);
-        return urlencoded.stringify(m_data);
-    }
     return m_data.toString().toUtf8();
 }
 
 void RequestPrototype::dispatchRequest()
 {
+    if (m_abortController && m_abortController->isAborted()) {
+        // Still report it asynchronously, like any other outcome
+        m_aborted = true;
+        QMetaObject::invokeMethod(this, "finishAborted", Qt::QueuedConnection);
+        return;
+    }
+
     QUrl url = m_request->url();
     url.setQuery(m_query);
     m_request->setUrl(url);
@@ -504,10 +597,27 @@ void RequestPrototype::dispatchRequest()
                     it.value().toString().toUtf8());
     }
 
+    if (m_queued) {
+        if (!m_multipart) {
+            enqueue();
+            return;
+        }
+        qWarning("Requests with attachments can't be queued, sending it now");
+        m_queued = false;
+    }
+
+    NetworkPool *pool = NetworkPool::find(m_engine->networkAccessManager());
+    if (pool)
+        m_network = pool->managerFor(m_request->url());
+
+    if (m_method == Get)
+        checkCache();
 
     switch (m_method) {
     case Get:
         m_reply = m_network->get(*m_request);
+        if (m_cacheStatus == CACHE_STALE)
+            revalidate();
         break;
     case Post:
         if (m_multipart) {
@@ -539,12 +649,16 @@ void RequestPrototype::dispatchRequest()
         qWarning("Unsupported method");
     }
 
+    if (pool && m_reply)
+        pool->track(m_reply);
+
     NetworkActivityIndicator::instance()->incrementActivityCount();
 
     emit started();
     emitEvent(EVENT_REQUEST, self());
 
     connect(m_reply, SIGNAL(finished()), this, SLOT(handleFinished()));
+    connect(m_reply, SIGNAL(readyRead()), this, SLOT(handleReadyRead()));
     connect(m_reply, SIGNAL(downloadProgress(qint64,qint64)),
             this, SLOT(handleDownloadProgress(qint64, qint64)));
     connect(m_reply, SIGNAL(uploadProgress(qint64,qint64)),
@@ -565,6 +679,14 @@ void RequestPrototype::handleFinished()
     killTimer(m_timer);
     NetworkActivityIndicator::instance()->decrementActivityCount();
 
+    if (m_aborted) {
+        // Whatever arrived is incomplete, so it isn't parsed
+        m_reply->deleteLater();
+        m_reply = 0;
+        finishAborted();
+        return;
+    }
+
     int status = m_reply->attribute(
                 QNetworkRequest::HttpStatusCodeAttribute).toInt();
     QVariant redir = m_reply->attribute(
@@ -586,6 +708,10 @@ void RequestPrototype::handleFinished()
             m_reply->deleteLater();
             m_reply = 0;
 
+            m_partsChecked = false;
+            m_partParser.reset();
+            m_parts = QJSValue();
+
             if (status >= 301 && status <= 303) {
                 if (m_method == Post) {
                     // TODO: Strip Content-* headers
@@ -610,6 +736,24 @@ void RequestPrototype::handleFinished()
         }
     }
 
+    if (m_staleIfError && m_reply->error() != QNetworkReply::NoError
+            && isStaleIfErrorCase(m_reply, status)) {
+        // Serve the stale entry the request started out with instead
+        m_staleIfError = false;
+        m_cacheStatus = CACHE_STALE_IF_ERROR;
+        m_request->setAttribute(QNetworkRequest::CacheLoadControlAttribute,
+                                QNetworkRequest::AlwaysCache);
+        m_reply->deleteLater();
+        m_reply = 0;
+
+        m_partsChecked = false;
+        m_partParser.reset();
+        m_parts = QJSValue();
+
+        dispatchRequest();
+        return;
+    }
+
     if (!m_error.isError() && m_reply->error() != QNetworkReply::NoError) {
         m_error = createError(m_reply->errorString());
         m_error.setProperty("code", m_reply->error());
@@ -626,7 +770,18 @@ void RequestPrototype::handleFinished()
 
     QJSValueList args;
 
-    ResponsePrototype *rep = new ResponsePrototype(m_engine, m_reply, m_responseType);
+    // pick up whatever arrived after the last readyRead
+    if (m_partParser)
+        handleReadyRead();
+
+    ResponsePrototype *rep = new ResponsePrototype(m_engine, m_reply, m_responseType, m_parts);
+    if (!m_cacheStatus.isEmpty())
+        rep->setCacheStatus(m_cacheStatus);
+    else if (m_staleEntry && rep->fromCache())
+        rep->setCacheStatus(CACHE_REVALIDATED);
+
+    if (m_method == Get && m_network->cache())
+        CacheInspector::recordCacheStatus(rep->cacheStatus());
 
     if (m_error.isError()) {
         m_error.setProperty("response", m_engine->newQObject(rep));
@@ -686,6 +841,131 @@ QJSValue RequestPrototype::createProgressEvent(bool upload, qint64 loaded, qint6
 }
 
 
+void RequestPrototype::handleReadyRead()
+{
+    if (!m_partsChecked) {
+        m_partsChecked = true;
+
+        // Multipart bodies are split into parts as the data arrives so that
+        // listeners can process each one while the rest is still downloading.
+        // The raw body isn't kept then, so without a listener the reply keeps
+        // buffering it and the parts are made at the end like any other body.
+        MediaType type(m_reply->header(QNetworkRequest::ContentTypeHeader).toByteArray());
+        QByteArray boundary = type.parameter("boundary");
+        if (m_responseType == duperagent::ResponseType::Auto
+                && !m_listeners[EVENT_PART].isEmpty()
+                && type.type() == "multipart" && !boundary.isEmpty()) {
+            m_partParser.reset(new MultipartParser(boundary));
+            m_parts = m_engine->newArray();
+        }
+    }
+
+    if (!m_partParser)
+        return;
+
+    m_partParser->feed(m_reply->readAll());
+
+    while (m_partParser->hasPart()) {
+        QJSValue part = ResponsePart::create(m_engine, m_partParser->takePart(), m_reply->url());
+        m_parts.setProperty(m_parts.property("length").toUInt(), part);
+        emitEvent(EVENT_PART, part);
+    }
+}
+
+// Looks at the cached entry for a GET request before it is sent and decides
+// whether it can be served without waiting for the network.
+void RequestPrototype::checkCache()
+{
+    QAbstractNetworkCache *cache = m_network->cache();
+    if (!cache || !m_cacheStatus.isEmpty())
+        return;
+
+    QNetworkRequest::CacheLoadControl loadControl =
+            static_cast<QNetworkRequest::CacheLoadControl>(m_request->attribute(
+                QNetworkRequest::CacheLoadControlAttribute,
+                QNetworkRequest::PreferNetwork).toInt());
+    if (loadControl == QNetworkRequest::AlwaysCache)
+        return;
+
+    // QNetworkAccessManager looks the entry up again when the request is
+    // sent, so our caches are asked in a way that doesn't count a miss twice
+    InspectableCache *inspectable = qobject_cast<InspectableCache*>(cache);
+    QNetworkCacheMetaData metaData = inspectable ? inspectable->peek(m_request->url(), 0)
+                                                 : cache->metaData(m_request->url());
+    QDateTime expires = metaData.expirationDate();
+    if (!metaData.isValid() || !expires.isValid())
+        return;
+
+    CacheDirectives directives = cacheDirectives(metaData);
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    expires = expires.toUTC();
+
+    if (now < expires) {
+        // Immutable responses are never revalidated while they are fresh,
+        // not even when the application asks for the network
+        if (directives.immutable) {
+            m_cacheStatus = CACHE_IMMUTABLE;
+            m_request->setAttribute(QNetworkRequest::CacheLoadControlAttribute,
+                                    QNetworkRequest::AlwaysCache);
+        }
+        return;
+    }
+
+    m_staleEntry = true;
+    m_staleIfError = directives.staleIfError > 0
+            && now < expires.addSecs(directives.staleIfError);
+
+    if (loadControl != QNetworkRequest::AlwaysNetwork && directives.staleWhileRevalidate > 0
+            && now < expires.addSecs(directives.staleWhileRevalidate)) {
+        m_cacheStatus = CACHE_STALE;
+        m_request->setAttribute(QNetworkRequest::CacheLoadControlAttribute,
+                                QNetworkRequest::AlwaysCache);
+    }
+}
+
+// Refreshes the cached entry in the background after a stale response has
+// been served, unless another request is already doing so.
+void RequestPrototype::revalidate()
+{
+    Revalidator::instance(m_engine->networkAccessManager())->revalidate(m_network, *m_request);
+}
+
+// Hands the request over to the durable queue. The callback is still called
+// if the request completes while this object is alive.
+void RequestPrototype::enqueue()
+{
+    QueuedRequest entry;
+    entry.method = method().toLatin1();
+    entry.url = m_request->url().toEncoded();
+    foreach (const QByteArray &name, m_request->rawHeaderList())
+        entry.headers.append(qMakePair(name, m_request->rawHeader(name)));
+    if (m_method == Post || m_method == Put || m_method == Patch)
+        entry.body = serializeData();
+
+    RequestQueue *queue = RequestQueue::instance(m_engine);
+    connect(queue, SIGNAL(finished(double,QJSValue,QJSValue)),
+            this, SLOT(handleQueueFinished(double,QJSValue,QJSValue)));
+    m_queueId = double(queue->enqueue(entry));
+
+    emit started();
+    emitEvent(EVENT_REQUEST, self());
+}
+
+void RequestPrototype::handleQueueFinished(double id, const QJSValue &error,
+                                           const QJSValue &response)
+{
+    if (id != m_queueId)
+        return;
+
+    disconnect(sender(), 0, this, 0);
+
+    emitEvent(EVENT_END, QJSValue::UndefinedValue);
+    emitEvent(EVENT_RESPONSE, response);
+
+    if (m_callback.isCallable())
+        callAndCheckError(m_callback, QJSValueList() << error << response);
+}
+
 void RequestPrototype::handleUploadProgress(qint64 sent, qint64 total)
 {
     emitEvent(EVENT_PROGRESS, createProgressEvent(true, sent, total));
@@ -732,6 +1012,35 @@ void RequestPrototype::handleSslErrors(const QList<QSslError> &)
 }
 #endif
 
+void RequestPrototype::handleAbortSignal()
+{
+    if (m_aborted)
+        return;
+
+    // Requests that haven't been sent yet are stopped by dispatchRequest()
+    if (m_reply && m_reply->isRunning()) {
+        m_aborted = true;
+        m_reply->abort();
+    }
+}
+
+void RequestPrototype::finishAborted()
+{
+    m_error = createError("The operation was aborted");
+    m_error.setProperty("name", QStringLiteral("AbortError"));
+    if (m_abortController && !m_abortController->reason().isUndefined())
+        m_error.setProperty("reason", m_abortController->reason());
+
+    emitEvent(EVENT_END, QJSValue::UndefinedValue);
+    m_attachments.clear();
+
+    if (m_callback.isCallable()) {
+        callAndCheckError(m_callback, QJSValueList() << m_error << QJSValue::UndefinedValue);
+    } else {
+        qWarning("%s is not callable", qUtf8Printable(m_callback.toString()));
+    }
+}
+
 void RequestPrototype::timerEvent(QTimerEvent *)
 {
     m_error = createError(QString("Timeout of %1 ms exceeded").arg(m_timeout));
@@ -8,17 +8,22 @@
 #include <QtCore/QObject>
 #include <QtCore/QUrlQuery>
 #include <QtCore/QObjectCleanupHandler>
+#include <QtCore/QPointer>
 #include <QtNetwork/QNetworkAccessManager>
 #include <QtNetwork/QNetworkReply>
 #include <QtQml/QJSValue>
 
 #include "qpm.h"
+#include "multipartparser.h"
+#include "deferred.h"
 
 class QHttpMultiPart;
 class QQmlEngine;
 
 namespace com { namespace cutehacks { namespace duperagent {
 
+class AbortController;
+
 class CacheControl : public QObject {
     Q_OBJECT
     Q_ENUMS(CacheLoadControl)
@@ -32,7 +37,6 @@ public:
 };
 
 typedef QHash<QString, QByteArray> ContentTypeMap;
-class Promise;
 
 class RequestPrototype : public QObject {
     Q_OBJECT
@@ -69,6 +73,7 @@ public:
     Q_INVOKABLE QJSValue timeout(int ms);
     Q_INVOKABLE QJSValue clearTimeout();
     Q_INVOKABLE QJSValue abort();
+    Q_INVOKABLE QJSValue signal(const QJSValue&);
     Q_INVOKABLE QJSValue set(const QJSValue&, const QJSValue& = QJSValue());
     Q_INVOKABLE QJSValue unset(const QString&);
     Q_INVOKABLE QJSValue type(const QJSValue&);
@@ -77,6 +82,7 @@ public:
     Q_INVOKABLE QJSValue redirects(int);
     Q_INVOKABLE QJSValue cacheSave(bool);
     Q_INVOKABLE QJSValue cacheLoad(int);
+    Q_INVOKABLE QJSValue queue();
     Q_INVOKABLE QJSValue query(const QJSValue&);
     Q_INVOKABLE QJSValue field(const QJSValue&, const QJSValue& = QJSValue());
     Q_INVOKABLE QJSValue attach(const QJSValue&, const QJSValue& = QJSValue(),
@@ -87,7 +93,6 @@ public:
     Q_INVOKABLE QJSValue end(QJSValue callback);
     Q_INVOKABLE QJSValue then(QJSValue = QJSValue(), QJSValue = QJSValue());
     Q_INVOKABLE void endCallback(QJSValue, QJSValue);
-    Q_INVOKABLE void executor(QJSValue, QJSValue);
 
     inline QJSValue self() const { return m_self; }
 
@@ -113,8 +118,12 @@ signals:
 
 protected slots:
     void handleFinished();
+    void handleReadyRead();
     void handleUploadProgress(qint64, qint64);
     void handleDownloadProgress(qint64, qint64);
+    void handleQueueFinished(double, const QJSValue &, const QJSValue &);
+    void handleAbortSignal();
+    void finishAborted();
 #ifndef QT_NO_SSL
     void handleEncrypted();
     void handleSslErrors(const QList<QSslError> &);
@@ -128,6 +137,9 @@ protected:
     QJSValue createError(const QString&, ErrorType type = Error);
     QJSValue createProgressEvent(bool, qint64, qint64);
     void emitEvent(const QString&, const QJSValue&);
+    void checkCache();
+    void revalidate();
+    void enqueue();
 
 private:
     Method m_method;
@@ -148,10 +160,19 @@ private:
     QByteArray m_rawData;
     QJSValue m_error;
     QHash<QString, QJSValueList> m_listeners;
-    QScopedPointer<Promise> m_promise;
-    QPair<QJSValue, QJSValue> m_executor;
+    Deferred m_deferred;
     QObjectCleanupHandler m_attachments;
     int m_responseType;
+    bool m_partsChecked;
+    QScopedPointer<MultipartParser> m_partParser;
+    QJSValue m_parts;
+    QString m_cacheStatus;
+    bool m_staleEntry;
+    bool m_staleIfError;
+    bool m_queued;
+    double m_queueId;
+    QPointer<AbortController> m_abortController;
+    bool m_aborted;
 };
 
 } } }
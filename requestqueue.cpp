@@ -0,0 +1,488 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QBuffer>
+#include <QtCore/QDataStream>
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSaveFile>
+#include <QtCore/QSet>
+#include <QtCore/QTimerEvent>
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkReply>
+#include <QtNetwork/QNetworkRequest>
+#include <QtQml/QQmlEngine>
+
+#if defined(Q_OS_WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "requestqueue.h"
+#include "config.h"
+#include "duperagent.h"
+#include "networkactivityindicator.h"
+#include "response.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+static const quint8 RECORD_ENQUEUE = 'E';
+static const quint8 RECORD_ACKNOWLEDGE = 'A';
+
+// Size and checksum in front of every record
+static const int FRAME_HEADER_SIZE = 6;
+
+// Writes that arrive within this many ms share a single sync
+static const int SYNC_DELAY = 100;
+
+static const int INITIAL_RETRY_DELAY = 5 * 1000;
+static const int MAX_RETRY_DELAY = 10 * 60 * 1000;
+
+// The journal is rewritten once it holds this many finished requests and
+// they outnumber the pending ones
+static const int COMPACT_RECORDS = 1024;
+
+static void syncFile(QFile &file)
+{
+    file.flush();
+#if defined(Q_OS_WIN)
+    _commit(file.handle());
+#else
+    ::fsync(file.handle());
+#endif
+}
+
+static QByteArray frame(const QByteArray &payload)
+{
+    QByteArray record;
+    QDataStream stream(&record, QIODevice::WriteOnly);
+    stream << quint32(payload.size())
+           << quint16(qChecksum(payload.constData(), uint(payload.size())));
+    record.append(payload);
+    return record;
+}
+
+static QByteArray enqueueRecord(const QueuedRequest &entry)
+{
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << RECORD_ENQUEUE << entry.id << entry.method << entry.url
+           << entry.headers << entry.body;
+    return frame(payload);
+}
+
+// Failures that say nothing about the request itself, so it is sent again
+// later instead of being reported. Anything else, like an unsupported
+// protocol or a failed SSL handshake, won't get better by retrying and would
+// hold up every request behind it.
+static bool isTransientFailure(QNetworkReply *reply, int status)
+{
+    if (status != 0)
+        return status == 408 || status == 429 || status == 502 || status == 503 || status == 504;
+
+    switch (reply->error()) {
+    case QNetworkReply::ConnectionRefusedError:
+    case QNetworkReply::RemoteHostClosedError:
+    case QNetworkReply::HostNotFoundError:
+    case QNetworkReply::TimeoutError:
+    case QNetworkReply::TemporaryNetworkFailureError:
+    case QNetworkReply::NetworkSessionFailedError:
+    case QNetworkReply::ProxyConnectionRefusedError:
+    case QNetworkReply::ProxyConnectionClosedError:
+    case QNetworkReply::ProxyNotFoundError:
+    case QNetworkReply::ProxyTimeoutError:
+        return true;
+    default:
+        return false;
+    }
+}
+
+#if QT_VERSION < QT_VERSION_CHECK(5, 15, 0)
+// Without a bearer plugin, as in static and iOS builds, Qt doesn't know any
+// network configurations and reports the device as offline. That is taken
+// as online; requests that can't get through are retried with a backoff.
+static bool isKnownOnline(const QNetworkConfigurationManager &manager)
+{
+    return manager.allConfigurations().isEmpty() || manager.isOnline();
+}
+#endif
+
+RequestQueue::RequestQueue(QQmlEngine *engine, const QString &path, QObject *parent) :
+    QObject(parent),
+    m_engine(engine),
+    m_network(engine->networkAccessManager()),
+    m_path(path),
+    m_finishedRecords(0),
+    m_syncTimer(-1),
+    m_retryTimer(-1),
+    m_retryDelay(INITIAL_RETRY_DELAY),
+    m_next(0),
+    m_lastId(0),
+    m_concurrency(2),
+    m_online(true),
+    m_paused(false)
+{
+    QDir dir = QFileInfo(m_path).dir();
+    if (!dir.mkpath(dir.absolutePath()))
+        qWarning("Could not create path for writing: %s", qUtf8Printable(dir.path()));
+
+    if (!load())
+        qWarning("Could not open file for writing: %s", qUtf8Printable(m_path));
+
+    // Ids stay unique across sessions, so that results reported after a
+    // restart can't be mistaken for those of the previous session
+    m_lastId = qMax(m_lastId, quint64(QDateTime::currentMSecsSinceEpoch()) * 1000);
+
+    // The bearer API is deprecated from Qt 5.15 on, where the queue relies
+    // on the backoff alone
+#if QT_VERSION < QT_VERSION_CHECK(5, 15, 0)
+    m_online = isKnownOnline(m_configurations);
+    connect(&m_configurations, SIGNAL(onlineStateChanged(bool)),
+            this, SLOT(handleOnlineStateChanged(bool)));
+#endif
+
+    // Give the application a chance to connect to finished() first
+    if (!m_entries.isEmpty())
+        QMetaObject::invokeMethod(this, "replay", Qt::QueuedConnection);
+}
+
+RequestQueue::~RequestQueue()
+{
+    foreach (QNetworkReply *reply, m_sending.keys()) {
+        reply->disconnect(this);
+        reply->abort();
+        NetworkActivityIndicator::instance()->decrementActivityCount();
+    }
+    qDeleteAll(m_sending.keys());
+
+    sync();
+}
+
+RequestQueue *RequestQueue::instance(QQmlEngine *engine)
+{
+    RequestQueue *queue = engine->findChild<RequestQueue*>(
+                QString(), Qt::FindDirectChildrenOnly);
+    if (!queue) {
+        Config *config = Config::instance();
+        config->init(engine);
+        queue = new RequestQueue(engine, config->queuePath(), engine);
+        queue->setConcurrency(config->queueConcurrency());
+    }
+    return queue;
+}
+
+bool RequestQueue::load()
+{
+    m_journal.setFileName(m_path);
+    if (!m_journal.open(QIODevice::ReadWrite))
+        return false;
+
+    QByteArray bytes = m_journal.readAll();
+    QSet<quint64> acknowledged;
+    int offset = 0;
+    int records = 0;
+
+    while (bytes.size() - offset >= FRAME_HEADER_SIZE) {
+        quint32 size;
+        quint16 checksum;
+        QDataStream header(bytes.mid(offset, FRAME_HEADER_SIZE));
+        header >> size >> checksum;
+        if (quint64(offset) + FRAME_HEADER_SIZE + size > quint64(bytes.size()))
+            break;
+
+        QByteArray payload = QByteArray::fromRawData(
+                    bytes.constData() + offset + FRAME_HEADER_SIZE, int(size));
+        if (qChecksum(payload.constData(), size) != checksum)
+            break;
+
+        QDataStream stream(payload);
+        stream.setVersion(QDataStream::Qt_5_0);
+        quint8 kind;
+        stream >> kind;
+        if (kind == RECORD_ENQUEUE) {
+            QueuedRequest entry;
+            stream >> entry.id >> entry.method >> entry.url >> entry.headers >> entry.body;
+            if (stream.status() != QDataStream::Ok)
+                break;
+            m_entries.append(entry);
+            m_lastId = qMax(m_lastId, entry.id);
+        } else if (kind == RECORD_ACKNOWLEDGE) {
+            QList<quint64> ids;
+            stream >> ids;
+            if (stream.status() != QDataStream::Ok)
+                break;
+            foreach (quint64 id, ids)
+                acknowledged.insert(id);
+        }
+
+        offset += FRAME_HEADER_SIZE + int(size);
+        records++;
+    }
+
+    QList<QueuedRequest>::iterator it = m_entries.begin();
+    while (it != m_entries.end()) {
+        if (acknowledged.contains(it->id))
+            it = m_entries.erase(it);
+        else
+            ++it;
+    }
+
+    // A torn record at the end is what a crash during a write leaves behind.
+    // Start the session with a journal holding only the pending requests.
+    if (offset != bytes.size() || records != m_entries.size())
+        compact();
+    else
+        m_journal.seek(m_journal.size());
+
+    return m_journal.isOpen();
+}
+
+void RequestQueue::compact()
+{
+    m_unsynced.clear();
+    m_acknowledged.clear();
+    m_finishedRecords = 0;
+
+    if (m_entries.isEmpty()) {
+        m_journal.resize(0);
+        m_journal.seek(0);
+        return;
+    }
+
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning("Could not open file for writing: %s", qUtf8Printable(m_path));
+        return;
+    }
+    foreach (const QueuedRequest &entry, m_entries)
+        file.write(enqueueRecord(entry));
+    if (!file.commit())
+        return;
+
+    m_journal.close();
+    if (m_journal.open(QIODevice::ReadWrite))
+        m_journal.seek(m_journal.size());
+}
+
+quint64 RequestQueue::enqueue(QueuedRequest entry)
+{
+    entry.id = ++m_lastId;
+    m_entries.append(entry);
+    m_unsynced.append(enqueueRecord(entry));
+    scheduleSync();
+
+    emit pendingChanged();
+
+    if (!m_paused)
+        QMetaObject::invokeMethod(this, "replay", Qt::QueuedConnection);
+
+    return entry.id;
+}
+
+void RequestQueue::setConcurrency(int concurrency)
+{
+    m_concurrency = qMax(1, concurrency);
+}
+
+void RequestQueue::scheduleSync()
+{
+    if (m_syncTimer < 0)
+        m_syncTimer = startTimer(SYNC_DELAY);
+}
+
+void RequestQueue::sync()
+{
+    if (m_syncTimer > 0) {
+        killTimer(m_syncTimer);
+        m_syncTimer = -1;
+    }
+
+    if (!m_acknowledged.isEmpty()) {
+        // All requests that finished since the last sync are acknowledged
+        // with a single record
+        QByteArray payload;
+        QDataStream stream(&payload, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_0);
+        stream << RECORD_ACKNOWLEDGE << m_acknowledged;
+        m_unsynced.append(frame(payload));
+        m_finishedRecords += m_acknowledged.size();
+        m_acknowledged.clear();
+    }
+
+    if (!m_journal.isOpen() || m_unsynced.isEmpty())
+        return;
+
+    if (m_entries.isEmpty() || (m_finishedRecords > COMPACT_RECORDS
+                                && m_finishedRecords > m_entries.size())) {
+        compact();
+        return;
+    }
+
+    m_journal.write(m_unsynced);
+    syncFile(m_journal);
+    m_unsynced.clear();
+}
+
+void RequestQueue::timerEvent(QTimerEvent *event)
+{
+    int t = event->timerId();
+    killTimer(t);
+
+    if (t == m_syncTimer) {
+        m_syncTimer = -1;
+        sync();
+    } else if (t == m_retryTimer) {
+        m_retryTimer = -1;
+        m_paused = false;
+        m_next = 0;
+        replay();
+    }
+}
+
+void RequestQueue::scheduleRetry()
+{
+    m_paused = true;
+    if (m_retryTimer < 0) {
+        m_retryTimer = startTimer(m_retryDelay);
+        m_retryDelay = qMin(m_retryDelay * 2, MAX_RETRY_DELAY);
+    }
+}
+
+void RequestQueue::retry()
+{
+    if (m_retryTimer > 0) {
+        killTimer(m_retryTimer);
+        m_retryTimer = -1;
+    }
+    m_retryDelay = INITIAL_RETRY_DELAY;
+    m_paused = false;
+    m_next = 0;
+    replay();
+}
+
+void RequestQueue::clear()
+{
+    foreach (QNetworkReply *reply, m_sending.keys()) {
+        reply->disconnect(this);
+        reply->abort();
+        reply->deleteLater();
+        NetworkActivityIndicator::instance()->decrementActivityCount();
+    }
+    m_sending.clear();
+    m_entries.clear();
+    m_next = 0;
+    compact();
+
+    emit pendingChanged();
+}
+
+void RequestQueue::replay()
+{
+    if (m_paused || !m_online)
+        return;
+
+    while (m_sending.size() < m_concurrency && m_next < m_entries.size()) {
+        const QueuedRequest &entry = m_entries.at(m_next++);
+
+        // Requests still running from before a retry aren't sent twice
+        if (!m_sending.keys(entry.id).isEmpty())
+            continue;
+
+        QNetworkRequest request(QUrl::fromEncoded(entry.url));
+        for (int i = 0; i < entry.headers.size(); ++i)
+            request.setRawHeader(entry.headers.at(i).first, entry.headers.at(i).second);
+#if QT_VERSION >= QT_VERSION_CHECK(5, 6, 0)
+        request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
+#endif
+
+        QBuffer *body = new QBuffer();
+        body->setData(entry.body);
+        body->open(QIODevice::ReadOnly);
+
+        QNetworkReply *reply = m_network->sendCustomRequest(request, entry.method, body);
+        body->setParent(reply);
+        m_sending.insert(reply, entry.id);
+        connect(reply, SIGNAL(finished()), this, SLOT(handleFinished()));
+
+        NetworkActivityIndicator::instance()->incrementActivityCount();
+    }
+}
+
+void RequestQueue::handleFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (!reply || !m_sending.contains(reply))
+        return;
+
+    quint64 id = m_sending.take(reply);
+    NetworkActivityIndicator::instance()->decrementActivityCount();
+
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (isTransientFailure(reply, status)) {
+        // Keep the request and everything after it for later
+        reply->deleteLater();
+        scheduleRetry();
+        return;
+    }
+
+    m_retryDelay = INITIAL_RETRY_DELAY;
+
+    ResponsePrototype *rep = new ResponsePrototype(m_engine, reply, ResponseType::Auto);
+    QJSValue response = m_engine->newQObject(rep);
+
+    QJSValue error;
+    if (reply->error() != QNetworkReply::NoError) {
+        error = m_engine->globalObject().property("Error").callAsConstructor(
+                    QJSValueList() << reply->errorString());
+        error.setProperty("code", reply->error());
+        if (status >= 400)
+            error.setProperty("status", status);
+        error.setProperty("response", response);
+    }
+
+    acknowledge(id);
+
+    emit finished(double(id), error, response);
+    emit pendingChanged();
+    if (m_entries.isEmpty())
+        emit drained();
+
+    replay();
+}
+
+void RequestQueue::acknowledge(quint64 id)
+{
+    for (int i = 0; i < m_entries.size(); ++i) {
+        if (m_entries.at(i).id == id) {
+            m_entries.removeAt(i);
+            if (i < m_next)
+                --m_next;
+            break;
+        }
+    }
+
+    m_acknowledged.append(id);
+    scheduleSync();
+}
+
+void RequestQueue::handleOnlineStateChanged(bool)
+{
+#if QT_VERSION < QT_VERSION_CHECK(5, 15, 0)
+    bool online = isKnownOnline(m_configurations);
+#else
+    bool online = true;
+#endif
+    if (m_online == online)
+        return;
+
+    m_online = online;
+    emit onlineChanged();
+
+    if (m_online)
+        retry();
+}
+
+} } }
@@ -0,0 +1,118 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef REQUESTQUEUE_H
+#define REQUESTQUEUE_H
+
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QObject>
+#include <QtCore/QPair>
+#include <QtQml/QJSValue>
+
+#if QT_VERSION < QT_VERSION_CHECK(5, 15, 0)
+#include <QtNetwork/QNetworkConfigurationManager>
+#endif
+
+#include "qpm.h"
+
+class QNetworkAccessManager;
+class QNetworkReply;
+class QQmlEngine;
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+struct QueuedRequest
+{
+    QueuedRequest() : id(0) {}
+    quint64 id;
+    QByteArray method;
+    QByteArray url;
+    QList<QPair<QByteArray, QByteArray> > headers;
+    QByteArray body;
+};
+
+// Durable queue for requests marked with queue(). Requests are written to
+// an append-only journal and sent in order, a few at a time, unless the
+// device is known to be offline. Requests that fail because the server can't be reached
+// stay in the queue and are retried later, including after a restart.
+//
+// Journal writes and acknowledgements are collected and written with a
+// single sync per batch. The journal is truncated whenever the queue runs
+// empty and rewritten when it is mostly made up of finished requests.
+class RequestQueue : public QObject
+{
+    Q_OBJECT
+
+    Q_PROPERTY(int pending READ pending NOTIFY pendingChanged)
+    Q_PROPERTY(bool online READ isOnline NOTIFY onlineChanged)
+    Q_PROPERTY(int concurrency READ concurrency WRITE setConcurrency)
+
+public:
+    RequestQueue(QQmlEngine *, const QString &path, QObject *parent = 0);
+    ~RequestQueue();
+
+    // The queue of the given engine, created on first use. All queues use
+    // the journal set up through config(), so only one engine should use it.
+    static RequestQueue *instance(QQmlEngine *);
+
+    quint64 enqueue(QueuedRequest);
+
+    int pending() const { return m_entries.size(); }
+    bool isOnline() const { return m_online; }
+
+    int concurrency() const { return m_concurrency; }
+    void setConcurrency(int);
+
+    Q_INVOKABLE void retry();
+    Q_INVOKABLE void clear();
+
+signals:
+    void finished(double id, const QJSValue &error, const QJSValue &response);
+    void pendingChanged();
+    void onlineChanged();
+    void drained();
+
+protected:
+    void timerEvent(QTimerEvent *);
+
+private slots:
+    void replay();
+    void handleFinished();
+    void handleOnlineStateChanged(bool);
+
+private:
+    bool load();
+    void compact();
+    void scheduleSync();
+    void sync();
+    void scheduleRetry();
+    void acknowledge(quint64);
+
+    QQmlEngine *m_engine;
+    QNetworkAccessManager *m_network;
+#if QT_VERSION < QT_VERSION_CHECK(5, 15, 0)
+    QNetworkConfigurationManager m_configurations;
+#endif
+    QString m_path;
+    QFile m_journal;
+    QByteArray m_unsynced;
+    QList<quint64> m_acknowledged;
+    int m_finishedRecords;
+    int m_syncTimer;
+    int m_retryTimer;
+    int m_retryDelay;
+
+    QList<QueuedRequest> m_entries;
+    QHash<QNetworkReply*, quint64> m_sending;
+    int m_next;
+    quint64 m_lastId;
+    int m_concurrency;
+    bool m_online;
+    bool m_paused;
+};
+
+} } }
+
+#endif // REQUESTQUEUE_H
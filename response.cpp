@@ -1,40 +1,44 @@
 // Copyright 2016 Cutehacks AS. All rights reserved.
 // License can be found in the LICENSE file.
 
-#include <QtCore/QRegExp>
-#include <QtCore/QTextCodec>
+#include <QtCore/QScopedPointer>
 #include <QtNetwork/QNetworkReply>
 #include <QtQml/QQmlEngine>
 #include <QJsonObject>
 
 #include "response.h"
 #include "serialization.h"
+#include "codecregistry.h"
+#include "textdecoder.h"
 #include "duperagent.h"
 
+#if QT_VERSION >= QT_VERSION_CHECK(5, 6, 0)
+#include "imageprovider.h"
+#endif
+
 namespace com { namespace cutehacks { namespace duperagent {
 
-ResponsePrototype::ResponsePrototype(QQmlEngine *engine, QNetworkReply *reply, int responseType) : QObject(0),
+ResponsePrototype::ResponsePrototype(QQmlEngine *engine, QNetworkReply *reply, int responseType,
+                                     const QJSValue &parts) :
+    QObject(0),
     m_engine(engine),
-    m_reply(reply)
+    m_reply(reply),
+    m_textDecoded(false)
 {
     QString type = m_reply->header(QNetworkRequest::ContentTypeHeader).toString();
 
-    QRegExp charsetRegexp(".*charset=(.*)[\\s]*", Qt::CaseInsensitive, QRegExp::RegExp2);
-    if (charsetRegexp.exactMatch(type)) {
-        m_charset = charsetRegexp.capturedTexts().at(1);
-    }
+    m_mediaType = MediaType(type.toLatin1());
+    m_charset = QString::fromLatin1(m_mediaType.charset());
 
     if (m_reply->isReadable()) {
-        QByteArray data = m_reply->readAll();
-
-        QTextCodec *text = QTextCodec::codecForName(m_charset.toLatin1());
-        m_text = text ? text->makeDecoder()->toUnicode(data) : QString::fromUtf8(data);
+        // Empty when the body was streamed into parts
+        m_data = m_reply->readAll();
 
         switch (responseType)
         {
             case ResponseType::Text:
             {
-                m_body = QJSValue(m_text);
+                m_body = QJSValue(text());
                 break;
             }
             case ResponseType::Json:
@@ -46,35 +50,24 @@ ResponsePrototype::ResponsePrototype(QQmlEngine *engine, QNetworkReply *reply, i
                 }
                 // TODO: add error handling
                 JsonCodec json(m_engine);
-                m_body = json.parse(data);
+                m_body = json.parse(m_data);
                 break;
             }
             case ResponseType::Blob:
-            {
-                m_body = m_engine->toScriptValue<QByteArray>(data);
-                break;
-            }
             case ResponseType::ArrayBuffer:
             {
-                m_body = m_engine->toScriptValue<QByteArray>(data);
+                // The engine wraps the QByteArray's storage in the ArrayBuffer
+                // instead of copying it, and m_data keeps a reference to the
+                // same block so that res.text can still be decoded on demand.
+                m_body = m_engine->toScriptValue<QByteArray>(m_data);
                 break;
             }
             default:
             {
-                if (type.contains("application/json")) {
-                    // TODO: add error handling
-                    JsonCodec json(m_engine);
-                    m_body = json.parse(data);
-        //        } else if (type.contains("application/x-www-form-urlencoded")) {
-                    // TODO: Implement parsing of form-urlencoded
-        //        } else if (type.contains("multipart/form-data")) {
-                    // TODO: Implement parsing of form-data
-                } else if (type.contains("image/")) {
-                    m_body = QString("data:%1;base64,%2")
-                            .arg(type)
-                            .arg(QString::fromLatin1(data.toBase64()));
-                } else {
-                    m_body = QJSValue(m_text);
+                if (parts.isArray()) {
+                    m_body = parts;
+                } else if (!parseBody(m_engine, type, m_data, m_reply->url(), &m_body)) {
+                    m_body = QJSValue(text());
                 }
                 break;
             }
@@ -140,8 +133,26 @@ bool ResponsePrototype::fromCache() const
     return m_reply->attribute(QNetworkRequest::SourceIsFromCacheAttribute).toBool();
 }
 
+QString ResponsePrototype::cacheStatus() const
+{
+    if (!m_cacheStatus.isEmpty())
+        return m_cacheStatus;
+    return fromCache() ? QStringLiteral("cache") : QStringLiteral("network");
+}
+
+void ResponsePrototype::setCacheStatus(const QString &status)
+{
+    m_cacheStatus = status;
+}
+
 QString ResponsePrototype::text() const
 {
+    // Decoding is deferred until someone asks for it so that binary and
+    // structured bodies never pay for a text conversion they don't need.
+    if (!m_textDecoded) {
+        m_text = decodeText(m_data, m_mediaType.charset());
+        m_textDecoded = true;
+    }
     return m_text;
 }
 
@@ -161,4 +172,121 @@ QJSValue ResponsePrototype::header() const
     return m_header;
 }
 
+bool ResponsePrototype::parseBody(QQmlEngine *engine, const QString &type,
+                                  const QByteArray &data, const QUrl &source, QJSValue *body)
+{
+    MediaType mediaType(type.toLatin1());
+    QScopedPointer<BodyCodec> codec(BodyCodecRegistry::create(engine, mediaType));
+
+    if (codec) {
+        // TODO: add error handling
+        *body = codec->parse(data);
+    } else if (mediaType.type() == "multipart") {
+        QByteArray boundary = mediaType.parameter("boundary");
+        if (boundary.isEmpty())
+            return false;
+
+        MultipartParser parser(boundary);
+        parser.feed(data);
+
+        *body = engine->newArray();
+        quint32 i = 0;
+        while (parser.hasPart())
+            body->setProperty(i++, ResponsePart::create(engine, parser.takePart(), source));
+    } else if (mediaType.type() == "image") {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 6, 0)
+        *body = ImageProvider::insert(source, data).toString();
+#else
+        *body = QString("data:%1;base64,%2")
+                .arg(type)
+                .arg(QString::fromLatin1(data.toBase64()));
+#endif
+    } else {
+        return false;
+    }
+    return true;
+}
+
+ResponsePart::ResponsePart(QQmlEngine *engine, const MultipartPart &part, const QUrl &source) :
+    QObject(0),
+    m_engine(engine),
+    m_source(source),
+    m_data(part.body),
+    m_textDecoded(false),
+    m_bodyParsed(false)
+{
+    // RFC 2046: parts without a Content-Type are plain US-ASCII text
+    m_type = QStringLiteral("text/plain");
+
+    m_header = m_engine->newObject();
+    for (RawHeaders::const_iterator it = part.headers.cbegin(); it != part.headers.cend(); it++) {
+        QString name = QString::fromUtf8((*it).first).toLower();
+        QString value = QString::fromUtf8((*it).second);
+        if (name == QLatin1String("content-type"))
+            m_type = value;
+        m_header.setProperty(name, value);
+    }
+
+    m_mediaType = MediaType(m_type.toLatin1());
+    m_charset = QString::fromLatin1(m_mediaType.charset());
+
+    m_engine->setObjectOwnership(this, QQmlEngine::JavaScriptOwnership);
+}
+
+QJSValue ResponsePart::create(QQmlEngine *engine, const MultipartPart &part, const QUrl &source)
+{
+    return engine->newQObject(new ResponsePart(engine, part, source));
+}
+
+QString ResponsePart::text() const
+{
+    if (!m_textDecoded) {
+        m_text = decodeText(m_data, m_mediaType.charset());
+        m_textDecoded = true;
+    }
+    return m_text;
+}
+
+QString ResponsePart::charset() const
+{
+    return m_charset;
+}
+
+QJSValue ResponsePart::header() const
+{
+    return m_header;
+}
+
+QJSValue ResponsePart::body() const
+{
+    // Parts are only decoded once they are looked at
+    if (!m_bodyParsed) {
+        if (!ResponsePrototype::parseBody(m_engine, m_type, m_data, m_source, &m_body))
+            m_body = isTextual() ? QJSValue(text()) : data();
+        m_bodyParsed = true;
+    }
+    return m_body;
+}
+
+QJSValue ResponsePart::data() const
+{
+    // Shares the part's storage, like ResponseType.ArrayBuffer does
+    return m_engine->toScriptValue<QByteArray>(m_data);
+}
+
+// Whether a part no codec knows about can be turned into a string without
+// losing anything
+bool ResponsePart::isTextual() const
+{
+    if (m_mediaType.type() == "text" || !m_mediaType.charset().isEmpty())
+        return true;
+
+    QByteArray subtype = m_mediaType.subtype();
+    QByteArray suffix = m_mediaType.suffix();
+    return subtype == "javascript" || subtype == "ecmascript"
+            || subtype == "x-www-form-urlencoded"
+            || subtype == "xml" || subtype == "json"
+            || suffix == "xml" || suffix == "json";
+}
+
 } } }
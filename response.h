@@ -5,6 +5,7 @@
 
 #define RESPONSE_H
 #include <QtCore/QObject>
+#include <QtCore/QUrl>
 #include <QtQml/QJSValue>
 #include<QVariant>
 
@@ -12,6 +13,8 @@ class QQmlEngine;
 class QNetworkReply;
 
 #include "qpm.h"
+#include "mediatype.h"
+#include "multipartparser.h"
 
 namespace com { namespace cutehacks { namespace duperagent {
 
@@ -32,6 +35,7 @@ class ResponsePrototype : public QObject {
     Q_PROPERTY(bool forbidden READ forbidden)
 
     Q_PROPERTY(bool fromCache READ fromCache)
+    Q_PROPERTY(QString cacheStatus READ cacheStatus)
 
     Q_PROPERTY(int status READ statusCode)
     Q_PROPERTY(int statusType READ statusType)
@@ -41,7 +45,7 @@ class ResponsePrototype : public QObject {
     Q_PROPERTY(QJSValue header READ header)
 
 public:
-    ResponsePrototype(QQmlEngine *, QNetworkReply *, int);
+    ResponsePrototype(QQmlEngine *, QNetworkReply *, int, const QJSValue & = QJSValue());
     ~ResponsePrototype();
 
     bool info() const;
@@ -58,6 +62,8 @@ public:
     bool forbidden() const;
 
     bool fromCache() const;
+    QString cacheStatus() const;
+    void setCacheStatus(const QString &);
 
     int statusCode() const;
     int statusType() const;
@@ -66,6 +72,11 @@ public:
     QJSValue body() const;
     QJSValue header() const;
 
+    // Parses a body based on its content type. Returns false if the body
+    // should be exposed as plain text.
+    static bool parseBody(QQmlEngine *, const QString &, const QByteArray &,
+                          const QUrl &, QJSValue *);
+
 protected:
     bool typeEquals(int code) const;
     bool statusEquals(int code) const;
@@ -73,10 +84,52 @@ protected:
 private:
     QQmlEngine *m_engine;
     QNetworkReply *m_reply;
-    QString m_text;
+    MediaType m_mediaType;
+    QByteArray m_data;
+    mutable QString m_text;
+    mutable bool m_textDecoded;
     QString m_charset;
     QJSValue m_body;
     QJSValue m_header;
+    QString m_cacheStatus;
+};
+
+// A single part of a multipart/* response. The body is decoded lazily the
+// same way as a response body in ResponseType.Auto mode.
+class ResponsePart : public QObject {
+    Q_OBJECT
+
+    Q_PROPERTY(QString text READ text)
+    Q_PROPERTY(QString charset READ charset)
+    Q_PROPERTY(QJSValue body READ body)
+    Q_PROPERTY(QJSValue data READ data)
+    Q_PROPERTY(QJSValue header READ header)
+
+public:
+    ResponsePart(QQmlEngine *, const MultipartPart &, const QUrl &);
+
+    static QJSValue create(QQmlEngine *, const MultipartPart &, const QUrl &);
+
+    QString text() const;
+    QString charset() const;
+    QJSValue body() const;
+    QJSValue data() const;
+    QJSValue header() const;
+
+private:
+    bool isTextual() const;
+
+    QQmlEngine *m_engine;
+    QUrl m_source;
+    QString m_type;
+    MediaType m_mediaType;
+    QByteArray m_data;
+    QString m_charset;
+    QJSValue m_header;
+    mutable QString m_text;
+    mutable bool m_textDecoded;
+    mutable QJSValue m_body;
+    mutable bool m_bodyParsed;
 };
 
 } } }
@@ -0,0 +1,55 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkReply>
+#include <QtNetwork/QNetworkRequest>
+
+#include "revalidator.h"
+#include "networkpool.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+Revalidator::Revalidator(QNetworkAccessManager *primary) :
+    QObject(primary),
+    m_primary(primary)
+{
+}
+
+Revalidator *Revalidator::instance(QNetworkAccessManager *primary)
+{
+    Revalidator *revalidator = primary->findChild<Revalidator*>(
+                QString(), Qt::FindDirectChildrenOnly);
+    if (!revalidator)
+        revalidator = new Revalidator(primary);
+    return revalidator;
+}
+
+void Revalidator::revalidate(QNetworkAccessManager *network, const QNetworkRequest &request)
+{
+    QUrl url = request.url();
+    if (m_urls.contains(url))
+        return;
+
+    QNetworkRequest refresh(request);
+    refresh.setAttribute(QNetworkRequest::CacheLoadControlAttribute,
+                         QNetworkRequest::PreferNetwork);
+
+    m_urls.insert(url);
+    QNetworkReply *reply = network->get(refresh);
+    if (NetworkPool *pool = NetworkPool::find(m_primary))
+        pool->track(reply);
+    connect(reply, SIGNAL(finished()), this, SLOT(handleFinished()));
+}
+
+void Revalidator::handleFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (!reply)
+        return;
+
+    m_urls.remove(reply->request().url());
+    reply->deleteLater();
+}
+
+} } }
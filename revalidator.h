@@ -0,0 +1,45 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef REVALIDATOR_H
+#define REVALIDATOR_H
+
+#include <QtCore/QObject>
+#include <QtCore/QSet>
+#include <QtCore/QUrl>
+
+#include "qpm.h"
+
+class QNetworkAccessManager;
+class QNetworkRequest;
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Refreshes stale cache entries in the background, at most once at a time
+// per URL. The replies aren't exposed, QNetworkAccessManager updates the
+// cache when they finish. One instance is kept per engine manager.
+class Revalidator : public QObject
+{
+    Q_OBJECT
+
+public:
+    // The revalidator for the given (engine) manager, created on first use
+    static Revalidator *instance(QNetworkAccessManager *primary);
+
+    // Sends the request through the given manager unless its URL is
+    // already being revalidated
+    void revalidate(QNetworkAccessManager *network, const QNetworkRequest &);
+
+private slots:
+    void handleFinished();
+
+private:
+    explicit Revalidator(QNetworkAccessManager *primary);
+
+    QNetworkAccessManager *m_primary;
+    QSet<QUrl> m_urls;
+};
+
+} } }
+
+#endif // REVALIDATOR_H
@@ -4,12 +4,18 @@
 #include <QtCore/QJsonDocument>
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonObject>
-#include <QtCore/QStringBuilder>
-#include <QtCore/QUrlQuery>
+#include <QtCore/QStringList>
 #include <QtQml/QQmlEngine>
 
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+#include <QtCore/QCborStreamReader>
+#include <QtCore/QCborStreamWriter>
+#endif
+
 #include "serialization.h"
 
+#include <string.h>
+
 #if QT_VERSION < QT_VERSION_CHECK(5, 6, 0)
 #include "jsvalueiterator.h"
 #else
@@ -22,8 +28,25 @@ namespace com { namespace cutehacks { namespace duperagent {
 static const QChar OPEN_SQUARE('[');
 static const QChar CLOSE_SQUARE(']');
 
+// Nesting limit for the binary codecs. Cycles are caught separately by
+// BodyCodec::enter().
+static const int MAX_DEPTH = 512;
+static const QString PROTO = QStringLiteral("__proto__");
+
 BodyCodec::BodyCodec(QQmlEngine *engine) : m_engine(engine) {}
 
+bool BodyCodec::enter(const QJSValue &value)
+{
+    for (int i = 0; i < m_stack.size(); ++i) {
+        if (m_stack.at(i).strictlyEquals(value)) {
+            qWarning("Converting circular structure");
+            return false;
+        }
+    }
+    m_stack.append(value);
+    return true;
+}
+
 JsonCodec::JsonCodec(QQmlEngine *engine) : BodyCodec(engine) {}
 
 QJSValue JsonCodec::parse(const QByteArray &data) {
@@ -83,121 +106,963 @@ QJSValue JsonCodec::parseJsonValue(const QJsonValue &val)
     }
 }
 
-QByteArray JsonCodec::stringify(const QJSValue &json)
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// Applies toJSON() the same way JSON.stringify() does, which is how Date
+// objects end up as ISO strings.
+static inline QJSValue resolveJson(const QJSValue &value)
 {
-    QJsonDocument doc;
+    if (!value.isObject())
+        return value;
+    QJSValue toJSON = value.property(QStringLiteral("toJSON"));
+    return toJSON.isCallable() ? toJSON.callWithInstance(value) : value;
+}
 
-    if (json.isArray()) {
-       doc.setArray(stringifyArray(json));
-    } else if (json.isObject()) {
-        doc.setObject(stringifyObject(json));
+// Values that JSON.stringify() leaves out of objects and writes as null in arrays
+static inline bool isSkipped(const QJSValue &value)
+{
+    return value.isUndefined() || value.isCallable();
+}
+
+static void writeUnicodeEscape(QByteArray &out, ushort u)
+{
+    char escape[6] = { '\\', 'u',
+                       HEX_DIGITS[u >> 12], HEX_DIGITS[(u >> 8) & 0xf],
+                       HEX_DIGITS[(u >> 4) & 0xf], HEX_DIGITS[u & 0xf] };
+    out.append(escape, sizeof(escape));
+}
+
+// Writes a quoted and escaped string as UTF-8. Runs of characters that need
+// no escaping are copied in one go; lone surrogates are escaped rather than
+// replaced, like JSON.stringify() does.
+static void writeString(QByteArray &out, const QString &string)
+{
+    const ushort *p = string.utf16();
+    const ushort *end = p + string.size();
+
+    out += '"';
+    while (p < end) {
+        const ushort *run = p;
+        while (p < end && *p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\')
+            ++p;
+        if (p != run) {
+            int offset = out.size();
+            out.resize(offset + int(p - run));
+            char *dst = out.data() + offset;
+            while (run < p)
+                *dst++ = char(*run++);
+        }
+        if (p == end)
+            break;
+
+        ushort u = *p++;
+        if (u < 0x80) {
+            switch (u) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default: writeUnicodeEscape(out, u); break;
+            }
+        } else if (u < 0x800) {
+            out += char(0xc0 | (u >> 6));
+            out += char(0x80 | (u & 0x3f));
+        } else if (QChar::isHighSurrogate(u) && p < end && QChar::isLowSurrogate(*p)) {
+            uint ucs4 = QChar::surrogateToUcs4(u, *p++);
+            out += char(0xf0 | (ucs4 >> 18));
+            out += char(0x80 | ((ucs4 >> 12) & 0x3f));
+            out += char(0x80 | ((ucs4 >> 6) & 0x3f));
+            out += char(0x80 | (ucs4 & 0x3f));
+        } else if (QChar::isSurrogate(u)) {
+            writeUnicodeEscape(out, u);
+        } else {
+            out += char(0xe0 | (u >> 12));
+            out += char(0x80 | ((u >> 6) & 0x3f));
+            out += char(0x80 | (u & 0x3f));
+        }
     }
+    out += '"';
+}
 
-    return doc.toJson(QJsonDocument::Compact);
+// True if the number can be written as an integer without losing precision
+static inline bool isInteger(double d, qint64 *out)
+{
+    if (qAbs(d) >= 9007199254740992.0 || d != qint64(d))
+        return false;
+    *out = qint64(d);
+    return true;
 }
 
-QJsonObject JsonCodec::stringifyObject(const QJSValue &json) const
+static void writeNumber(QByteArray &out, const QJSValue &value)
 {
-    QJsonObject object;
-    JSValueIterator it(json);
-    while (it.next()) {
-        object.insert(it.name(), stringifyValue(it.value()));
+    double d = value.toNumber();
+    qint64 integer;
+    if (!qIsFinite(d)) {
+        out += "null";
+    } else if (isInteger(d, &integer)) {
+        // Exact integers, which also writes -0 as 0 like JSON.stringify()
+        out += QByteArray::number(integer);
+    } else {
+        // Let the engine format everything else so the output matches
+        // Number.prototype.toString(), as JSON.stringify() does.
+        out += value.toString().toLatin1();
     }
-    return object;
 }
 
-QJsonArray JsonCodec::stringifyArray(const QJSValue &json) const
+QByteArray JsonCodec::stringify(const QJSValue &json)
 {
-    QJsonArray array;
+    QByteArray out;
+    out.reserve(4096);
+    m_stack.clear();
+
+    QJSValue value = resolveJson(json);
+    if (!isSkipped(value))
+        writeValue(out, value);
+
+    return out;
+}
+
+void JsonCodec::writeObject(QByteArray &out, const QJSValue &json)
+{
+    if (!enter(json)) {
+        out += "null";
+        return;
+    }
+
+    out += '{';
+    bool first = true;
     JSValueIterator it(json);
     while (it.next()) {
-        if (it.hasNext()) // skip last item which is length
-            array.append(stringifyValue(it.value()));
+        QJSValue value = resolveJson(it.value());
+        if (isSkipped(value))
+            continue;
+        if (!first)
+            out += ',';
+        first = false;
+        writeString(out, it.name());
+        out += ':';
+        writeValue(out, value);
     }
-    return array;
+    out += '}';
+
+    leave();
 }
 
-QJsonValue JsonCodec::stringifyValue(const QJSValue &json) const
+void JsonCodec::writeArray(QByteArray &out, const QJSValue &json)
 {
-    if (json.isArray()) {
-        return QJsonValue(stringifyArray(json));
-    } else if (json.isObject()) {
-        QJSValue toJSON = json.property("toJSON");
-        if (toJSON.isCallable())
-            return stringifyValue(toJSON.callWithInstance(json));
+    if (!enter(json)) {
+        out += "null";
+        return;
+    }
+
+    out += '[';
+    quint32 length = json.property(QStringLiteral("length")).toUInt();
+    for (quint32 i = 0; i < length; ++i) {
+        if (i > 0)
+            out += ',';
+        QJSValue value = resolveJson(json.property(i));
+        if (isSkipped(value))
+            out += "null";
         else
-            return QJsonValue(stringifyObject(json));
-    } else if (json.isBool()) {
-        return QJsonValue(json.toBool());
+            writeValue(out, value);
+    }
+    out += ']';
+
+    leave();
+}
+
+void JsonCodec::writeValue(QByteArray &out, const QJSValue &json)
+{
+    if (json.isArray()) {
+        writeArray(out, json);
+    } else if (json.isString()) {
+        writeString(out, json.toString());
     } else if (json.isNumber()) {
-        return QJsonValue(json.toNumber());
+        writeNumber(out, json);
+    } else if (json.isBool()) {
+        out += json.toBool() ? "true" : "false";
+    } else if (json.isNull() || json.isUndefined() || json.isCallable()) {
+        out += "null";
+    } else if (json.isObject()) {
+        writeObject(out, json);
     } else {
-        return QJsonValue(json.toString());
+        writeString(out, json.toString());
     }
 }
 
 FormUrlEncodedCodec::FormUrlEncodedCodec(QQmlEngine *engine) : BodyCodec(engine)
 { }
 
-QByteArray FormUrlEncodedCodec::stringify(const QJSValue &json)
+// Characters left as-is by the application/x-www-form-urlencoded serializer
+static inline bool isFormSafe(ushort c)
 {
-    QueryItems items;
-    JSValueIterator it(json);
-    while (it.next()) {
-        QString key = it.name();
-        items << stringifyValue(key, it.value());
-    }
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+            || c == '*' || c == '-' || c == '.' || c == '_';
+}
 
-    QUrlQuery query;
-    query.setQueryItems(items);
-    return query.toString(QUrl::FullyEncoded).toUtf8();
+static inline void writePercentEncoded(QByteArray &out, uchar c)
+{
+    static const char HEX[] = "0123456789ABCDEF";
+    char escape[3] = { '%', HEX[c >> 4], HEX[c & 0xf] };
+    out.append(escape, sizeof(escape));
 }
 
-QueryItems FormUrlEncodedCodec::stringifyObject(const QString& prefix, const QJSValue &json) const
+// Percent-encodes a string as UTF-8 straight into the output, following the
+// WHATWG URL standard. Lone surrogates are encoded as U+FFFD.
+static void writeFormComponent(QByteArray &out, const QString &string)
 {
-    QueryItems items;
-    JSValueIterator it(json);
-    while (it.next()) {
-        items << stringifyValue(prefix % OPEN_SQUARE % it.name() % CLOSE_SQUARE, it.value());
+    const ushort *p = string.utf16();
+    const ushort *end = p + string.size();
+
+    while (p < end) {
+        const ushort *run = p;
+        while (p < end && isFormSafe(*p))
+            ++p;
+        if (p != run) {
+            int offset = out.size();
+            out.resize(offset + int(p - run));
+            char *dst = out.data() + offset;
+            while (run < p)
+                *dst++ = char(*run++);
+        }
+        if (p == end)
+            break;
+
+        uint u = *p++;
+        if (u == ' ') {
+            out += '+';
+            continue;
+        }
+
+        if (QChar::isHighSurrogate(u) && p < end && QChar::isLowSurrogate(*p))
+            u = QChar::surrogateToUcs4(ushort(u), *p++);
+        else if (QChar::isSurrogate(u))
+            u = QChar::ReplacementCharacter;
+
+        if (u < 0x80) {
+            writePercentEncoded(out, uchar(u));
+        } else if (u < 0x800) {
+            writePercentEncoded(out, uchar(0xc0 | (u >> 6)));
+            writePercentEncoded(out, uchar(0x80 | (u & 0x3f)));
+        } else if (u < 0x10000) {
+            writePercentEncoded(out, uchar(0xe0 | (u >> 12)));
+            writePercentEncoded(out, uchar(0x80 | ((u >> 6) & 0x3f)));
+            writePercentEncoded(out, uchar(0x80 | (u & 0x3f)));
+        } else {
+            writePercentEncoded(out, uchar(0xf0 | (u >> 18)));
+            writePercentEncoded(out, uchar(0x80 | ((u >> 12) & 0x3f)));
+            writePercentEncoded(out, uchar(0x80 | ((u >> 6) & 0x3f)));
+            writePercentEncoded(out, uchar(0x80 | (u & 0x3f)));
+        }
     }
-    return items;
 }
 
-QueryItems FormUrlEncodedCodec::stringifyArray(const QString& prefix, const QJSValue &json) const
+QByteArray FormUrlEncodedCodec::stringify(const QJSValue &json)
 {
-    QueryItems items;
+    QByteArray out;
+    QByteArray prefix;
+    out.reserve(1024);
+
     JSValueIterator it(json);
     while (it.next()) {
-        if (it.hasNext()) //skip last item which is length
-            items << stringifyValue(prefix % OPEN_SQUARE % it.name() % CLOSE_SQUARE, it.value());
+        prefix.clear();
+        writeFormComponent(prefix, it.name());
+        writeValue(out, prefix, it.value());
     }
-    return items;
+
+    return out;
 }
 
-QueryItems FormUrlEncodedCodec::stringifyValue(const QString& prefix, const QJSValue &json) const
+// The encoded key of nested values is built up in a single prefix buffer which
+// is extended with "[name]" on the way down and truncated again on the way up.
+void FormUrlEncodedCodec::writeValue(QByteArray &out, QByteArray &prefix, const QJSValue &json) const
 {
+    static const QString LENGTH = QStringLiteral("length");
+
     if (json.isArray()) {
-        return stringifyArray(prefix, json);
-    } else if (json.isObject()) {
+        int size = prefix.size();
+        quint32 length = json.property(LENGTH).toUInt();
+        for (quint32 i = 0; i < length; ++i) {
+            prefix += "%5B";
+            prefix += QByteArray::number(i);
+            prefix += "%5D";
+            writeValue(out, prefix, json.property(i));
+            prefix.truncate(size);
+        }
+        return;
+    }
+
+    if (json.isObject()) {
         QJSValue toJSON = json.property("toJSON");
-        if (toJSON.isCallable())
-            return stringifyValue(prefix, toJSON.callWithInstance(json));
-        else
-            return stringifyObject(prefix, json);
-    } else if (json.isNull()) {
-        return QueryItems() << QPair<QString, QString>(prefix, QString());
-    } else if (json.hasProperty("toJSON") && json.property("toJSON").isCallable()){
-        return QueryItems() << QPair<QString, QString>(
-                    prefix, json.property("toJSON").callWithInstance(json).toString());
+        if (toJSON.isCallable()) {
+            writeValue(out, prefix, toJSON.callWithInstance(json));
+            return;
+        }
+
+        int size = prefix.size();
+        JSValueIterator it(json);
+        while (it.next()) {
+            prefix += "%5B";
+            writeFormComponent(prefix, it.name());
+            prefix += "%5D";
+            writeValue(out, prefix, it.value());
+            prefix.truncate(size);
+        }
+        return;
+    }
+
+    if (!out.isEmpty())
+        out += '&';
+    out += prefix;
+    out += '=';
+    if (!json.isNull())
+        writeFormComponent(out, json.toString());
+}
+
+static inline int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes '+' and percent escapes of a single key or value. The common case
+// of a component without escapes is converted straight from the input.
+static QString decodeComponent(const char *begin, const char *end, QByteArray *scratch)
+{
+    const char *p = begin;
+    while (p < end && *p != '%' && *p != '+')
+        ++p;
+    if (p == end)
+        return QString::fromUtf8(begin, int(end - begin));
+
+    scratch->resize(int(end - begin));
+    char *out = scratch->data();
+    for (p = begin; p < end; ++p) {
+        if (*p == '+') {
+            *out++ = ' ';
+        } else if (*p == '%' && end - p > 2
+                   && hexValue(p[1]) >= 0 && hexValue(p[2]) >= 0) {
+            *out++ = char(hexValue(p[1]) << 4 | hexValue(p[2]));
+            p += 2;
+        } else {
+            *out++ = *p;
+        }
+    }
+    return QString::fromUtf8(scratch->constData(), int(out - scratch->constData()));
+}
+
+// Splits "a[b][c]" into "a", "b", "c". Keys that don't follow the bracket
+// syntax are returned as a single segment.
+static QStringList keySegments(const QString &key)
+{
+    QStringList segments;
+    int open = key.indexOf(OPEN_SQUARE);
+    if (open <= 0 || !key.endsWith(CLOSE_SQUARE))
+        return segments << key;
+
+    segments << key.left(open);
+    while (open < key.size()) {
+        int close = key.indexOf(CLOSE_SQUARE, open + 1);
+        if (key.at(open) != OPEN_SQUARE || close < 0)
+            return QStringList() << key;
+        segments << key.mid(open + 1, close - open - 1);
+        open = close + 1;
+    }
+    return segments;
+}
+
+static inline bool isArrayIndex(const QString &segment)
+{
+    if (segment.isEmpty())
+        return true;
+    if (segment.size() > 9)
+        return false;
+    for (int i = 0; i < segment.size(); ++i) {
+        if (!segment.at(i).isDigit())
+            return false;
+    }
+    return true;
+}
+
+void FormUrlEncodedCodec::assign(QJSValue root, const QString &key, const QJSValue &value) const
+{
+    QStringList segments = keySegments(key);
+    if (segments.contains(PROTO))
+        return;
+
+    QJSValue container = root;
+    for (int i = 0; i < segments.size() - 1; ++i) {
+        QString name = segments.at(i);
+        if (name.isEmpty() && container.isArray())
+            name = QString::number(container.property(QStringLiteral("length")).toUInt());
+
+        QJSValue child = container.property(name);
+        if (!child.isObject()) {
+            child = isArrayIndex(segments.at(i + 1)) ?
+                        m_engine->newArray() : m_engine->newObject();
+            container.setProperty(name, child);
+        }
+        container = child;
+    }
+
+    QString name = segments.last();
+    if (container.isArray() && name.isEmpty()) {
+        container.setProperty(container.property(QStringLiteral("length")).toUInt(), value);
+        return;
+    }
+
+    // Repeated plain keys (a=1&a=2) collect their values in an array
+    QJSValue existing = container.property(name);
+    if (existing.isArray() && segments.size() == 1) {
+        existing.setProperty(existing.property(QStringLiteral("length")).toUInt(), value);
+    } else if (!existing.isUndefined() && !existing.isObject()) {
+        QJSValue values = m_engine->newArray(2);
+        values.setProperty(0, existing);
+        values.setProperty(1, value);
+        container.setProperty(name, values);
     } else {
-        return QueryItems() << QPair<QString, QString>(prefix, json.toString());
+        container.setProperty(name, value);
     }
 }
 
-QJSValue FormUrlEncodedCodec::parse(const QByteArray &)
+QJSValue FormUrlEncodedCodec::parse(const QByteArray &data)
 {
     QJSValue json = m_engine->newObject();
+    QByteArray scratch;
+
+    const char *p = data.constData();
+    const char *end = p + data.size();
+    while (p < end) {
+        const char *pairEnd = static_cast<const char*>(memchr(p, '&', end - p));
+        if (!pairEnd)
+            pairEnd = end;
+
+        const char *eq = static_cast<const char*>(memchr(p, '=', pairEnd - p));
+        if (!eq)
+            eq = pairEnd;
+
+        if (eq != p) {
+            QString key = decodeComponent(p, eq, &scratch);
+            QString value = eq < pairEnd ?
+                        decodeComponent(eq + 1, pairEnd, &scratch) : QString();
+            assign(json, key, QJSValue(value));
+        }
+
+        p = pairEnd + 1;
+    }
+
     return json;
 }
-} } }
 
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+CborCodec::CborCodec(QQmlEngine *engine) : BodyCodec(engine) {}
+
+QByteArray CborCodec::stringify(const QJSValue &json)
+{
+    QByteArray out;
+    QCborStreamWriter writer(&out);
+    m_stack.clear();
+
+    QJSValue value = resolveJson(json);
+    if (!isSkipped(value))
+        writeValue(writer, value, 0);
+
+    return out;
+}
+
+void CborCodec::writeValue(QCborStreamWriter &writer, const QJSValue &json, int depth)
+{
+    if (depth > MAX_DEPTH) {
+        qWarning("Value is nested too deeply to be serialized");
+        writer.appendNull();
+        return;
+    }
+
+    if (json.isArray()) {
+        if (!enter(json)) {
+            writer.appendNull();
+            return;
+        }
+
+        quint32 length = json.property(QStringLiteral("length")).toUInt();
+        writer.startArray(length);
+        for (quint32 i = 0; i < length; ++i) {
+            QJSValue value = resolveJson(json.property(i));
+            if (isSkipped(value))
+                writer.appendNull();
+            else
+                writeValue(writer, value, depth + 1);
+        }
+        writer.endArray();
+        leave();
+    } else if (json.isString()) {
+        writer.append(json.toString());
+    } else if (json.isNumber()) {
+        double d = json.toNumber();
+        qint64 integer;
+        if (isInteger(d, &integer))
+            writer.append(integer);
+        else
+            writer.append(d);
+    } else if (json.isBool()) {
+        writer.append(json.toBool());
+    } else if (json.isUndefined()) {
+        writer.appendUndefined();
+    } else if (json.isNull() || json.isCallable()) {
+        writer.appendNull();
+    } else if (json.isObject()) {
+        if (!enter(json)) {
+            writer.appendNull();
+            return;
+        }
+
+        // The number of properties isn't known up front, so use an
+        // indefinite length map rather than iterating twice.
+        writer.startMap();
+        JSValueIterator it(json);
+        while (it.next()) {
+            QJSValue value = resolveJson(it.value());
+            if (isSkipped(value))
+                continue;
+            writer.append(it.name());
+            writeValue(writer, value, depth + 1);
+        }
+        writer.endMap();
+        leave();
+    } else {
+        writer.append(json.toString());
+    }
+}
+
+QJSValue CborCodec::parse(const QByteArray &data)
+{
+    QCborStreamReader reader(data);
+    QJSValue value = readValue(reader, 0);
+    if (reader.lastError() != QCborError::NoError)
+        return QJSValue();
+    return value;
+}
+
+QJSValue CborCodec::readValue(QCborStreamReader &reader, int depth) const
+{
+    if (depth > MAX_DEPTH)
+        return QJSValue();
+
+    switch (reader.type()) {
+    case QCborStreamReader::UnsignedInteger: {
+        double value = double(reader.toUnsignedInteger());
+        reader.next();
+        return QJSValue(value);
+    }
+    case QCborStreamReader::NegativeInteger: {
+        double value = -1.0 - double(quint64(reader.toNegativeInteger()));
+        reader.next();
+        return QJSValue(value);
+    }
+    case QCborStreamReader::ByteArray: {
+        QByteArray bytes;
+        QCborStreamReader::StringResult<QByteArray> r = reader.readByteArray();
+        while (r.status == QCborStreamReader::Ok) {
+            bytes += r.data;
+            r = reader.readByteArray();
+        }
+        return m_engine->toScriptValue<QByteArray>(bytes);
+    }
+    case QCborStreamReader::String: {
+        QString string;
+        QCborStreamReader::StringResult<QString> r = reader.readString();
+        while (r.status == QCborStreamReader::Ok) {
+            string += r.data;
+            r = reader.readString();
+        }
+        return QJSValue(string);
+    }
+    case QCborStreamReader::Array: {
+        QJSValue array = m_engine->newArray();
+        if (!reader.enterContainer())
+            return QJSValue();
+        quint32 i = 0;
+        while (reader.lastError() == QCborError::NoError && reader.hasNext())
+            array.setProperty(i++, readValue(reader, depth + 1));
+        reader.leaveContainer();
+        return array;
+    }
+    case QCborStreamReader::Map: {
+        QJSValue object = m_engine->newObject();
+        if (!reader.enterContainer())
+            return QJSValue();
+        while (reader.lastError() == QCborError::NoError && reader.hasNext()) {
+            QString key = readValue(reader, depth + 1).toString();
+            QJSValue value = readValue(reader, depth + 1);
+            if (key != PROTO)
+                object.setProperty(key, value);
+        }
+        reader.leaveContainer();
+        return object;
+    }
+    case QCborStreamReader::Tag:
+        // Tags only add semantics to the value that follows, which is
+        // returned as is.
+        reader.next();
+        return readValue(reader, depth + 1);
+    case QCborStreamReader::False:
+        reader.next();
+        return QJSValue(false);
+    case QCborStreamReader::True:
+        reader.next();
+        return QJSValue(true);
+    case QCborStreamReader::Null:
+        reader.next();
+        return QJSValue(QJSValue::NullValue);
+    case QCborStreamReader::Float16: {
+        double value = double(reader.toFloat16());
+        reader.next();
+        return QJSValue(value);
+    }
+    case QCborStreamReader::Float: {
+        double value = double(reader.toFloat());
+        reader.next();
+        return QJSValue(value);
+    }
+    case QCborStreamReader::Double: {
+        double value = reader.toDouble();
+        reader.next();
+        return QJSValue(value);
+    }
+    case QCborStreamReader::Undefined:
+    case QCborStreamReader::SimpleType:
+        reader.next();
+        return QJSValue();
+    case QCborStreamReader::Invalid:
+    default:
+        return QJSValue();
+    }
+}
+#endif
+
+static inline void writeBigEndian(QByteArray &out, quint64 value, int size)
+{
+    char bytes[8];
+    for (int i = size - 1; i >= 0; --i) {
+        bytes[i] = char(value & 0xff);
+        value >>= 8;
+    }
+    out.append(bytes, size);
+}
+
+static inline bool readBigEndian(const char *&p, const char *end, int size, quint64 *value)
+{
+    if (end - p < size)
+        return false;
+    *value = 0;
+    for (int i = 0; i < size; ++i)
+        *value = (*value << 8) | uchar(*p++);
+    return true;
+}
+
+// Writes the header of a str, array or map with the smallest encoding that
+// fits. fixLimit is the first length that no longer fits the fix variant.
+static void writeMessagePackHeader(QByteArray &out, quint32 length, uchar fix,
+                                   quint32 fixLimit, uchar code8, uchar code16, uchar code32)
+{
+    if (length < fixLimit) {
+        out += char(fix | length);
+    } else if (code8 && length <= 0xff) {
+        out += char(code8);
+        writeBigEndian(out, length, 1);
+    } else if (length <= 0xffff) {
+        out += char(code16);
+        writeBigEndian(out, length, 2);
+    } else {
+        out += char(code32);
+        writeBigEndian(out, length, 4);
+    }
+}
+
+static void writeMessagePackInteger(QByteArray &out, qint64 value)
+{
+    if (value >= 0) {
+        if (value < 0x80) {
+            out += char(value);
+        } else if (value <= 0xff) {
+            out += char(0xcc);
+            writeBigEndian(out, quint64(value), 1);
+        } else if (value <= 0xffff) {
+            out += char(0xcd);
+            writeBigEndian(out, quint64(value), 2);
+        } else if (value <= Q_INT64_C(0xffffffff)) {
+            out += char(0xce);
+            writeBigEndian(out, quint64(value), 4);
+        } else {
+            out += char(0xcf);
+            writeBigEndian(out, quint64(value), 8);
+        }
+    } else {
+        if (value >= -32) {
+            out += char(value);
+        } else if (value >= -0x80) {
+            out += char(0xd0);
+            writeBigEndian(out, quint64(value), 1);
+        } else if (value >= -0x8000) {
+            out += char(0xd1);
+            writeBigEndian(out, quint64(value), 2);
+        } else if (value >= -Q_INT64_C(0x80000000)) {
+            out += char(0xd2);
+            writeBigEndian(out, quint64(value), 4);
+        } else {
+            out += char(0xd3);
+            writeBigEndian(out, quint64(value), 8);
+        }
+    }
+}
+
+MessagePackCodec::MessagePackCodec(QQmlEngine *engine) : BodyCodec(engine) {}
+
+QByteArray MessagePackCodec::stringify(const QJSValue &json)
+{
+    QByteArray out;
+    out.reserve(4096);
+    m_stack.clear();
+
+    QJSValue value = resolveJson(json);
+    if (!isSkipped(value))
+        writeValue(out, value, 0);
+
+    return out;
+}
+
+void MessagePackCodec::writeValue(QByteArray &out, const QJSValue &json, int depth)
+{
+    if (depth > MAX_DEPTH) {
+        qWarning("Value is nested too deeply to be serialized");
+        out += char(0xc0);
+        return;
+    }
+
+    if (json.isArray()) {
+        if (!enter(json)) {
+            out += char(0xc0);
+            return;
+        }
+
+        quint32 length = json.property(QStringLiteral("length")).toUInt();
+        writeMessagePackHeader(out, length, 0x90, 16, 0, 0xdc, 0xdd);
+        for (quint32 i = 0; i < length; ++i) {
+            QJSValue value = resolveJson(json.property(i));
+            if (isSkipped(value))
+                out += char(0xc0);
+            else
+                writeValue(out, value, depth + 1);
+        }
+        leave();
+    } else if (json.isString()) {
+        QByteArray utf8 = json.toString().toUtf8();
+        writeMessagePackHeader(out, quint32(utf8.size()), 0xa0, 32, 0xd9, 0xda, 0xdb);
+        out += utf8;
+    } else if (json.isNumber()) {
+        double d = json.toNumber();
+        qint64 integer;
+        if (isInteger(d, &integer)) {
+            writeMessagePackInteger(out, integer);
+        } else {
+            quint64 bits;
+            memcpy(&bits, &d, sizeof(bits));
+            out += char(0xcb);
+            writeBigEndian(out, bits, 8);
+        }
+    } else if (json.isBool()) {
+        out += char(json.toBool() ? 0xc3 : 0xc2);
+    } else if (json.isNull() || json.isUndefined() || json.isCallable()) {
+        out += char(0xc0);
+    } else if (json.isObject()) {
+        if (!enter(json)) {
+            out += char(0xc0);
+            return;
+        }
+
+        // Maps are prefixed with their size, so collect the properties first
+        QList<QPair<QString, QJSValue> > properties;
+        JSValueIterator it(json);
+        while (it.next()) {
+            QJSValue value = resolveJson(it.value());
+            if (!isSkipped(value))
+                properties.append(qMakePair(it.name(), value));
+        }
+
+        writeMessagePackHeader(out, quint32(properties.size()), 0x80, 16, 0, 0xde, 0xdf);
+        for (int i = 0; i < properties.size(); ++i) {
+            writeValue(out, QJSValue(properties.at(i).first), depth + 1);
+            writeValue(out, properties.at(i).second, depth + 1);
+        }
+        leave();
+    } else {
+        writeValue(out, QJSValue(json.toString()), depth);
+    }
+}
+
+QJSValue MessagePackCodec::parse(const QByteArray &data)
+{
+    const char *p = data.constData();
+    bool ok = true;
+    QJSValue value = readValue(p, p + data.size(), 0, &ok);
+    return ok ? value : QJSValue();
+}
+
+QJSValue MessagePackCodec::readValue(const char *&p, const char *end, int depth, bool *ok) const
+{
+    enum Kind { String, Binary, Array, Map, Extension };
+
+    if (p >= end || depth > MAX_DEPTH) {
+        *ok = false;
+        return QJSValue();
+    }
+
+    uchar c = uchar(*p++);
+    if (c < 0x80)
+        return QJSValue(int(c));
+    if (c >= 0xe0)
+        return QJSValue(int(qint8(c)));
+
+    Kind kind = String;
+    quint64 length = 0;
+    quint64 value = 0;
+
+    if ((c & 0xf0) == 0x80) {
+        kind = Map;
+        length = c & 0x0f;
+    } else if ((c & 0xf0) == 0x90) {
+        kind = Array;
+        length = c & 0x0f;
+    } else if ((c & 0xe0) == 0xa0) {
+        kind = String;
+        length = c & 0x1f;
+    } else {
+        int size = 0;
+        switch (c) {
+        case 0xc0:
+            return QJSValue(QJSValue::NullValue);
+        case 0xc2:
+            return QJSValue(false);
+        case 0xc3:
+            return QJSValue(true);
+        case 0xca:
+        case 0xcb: {
+            if (!readBigEndian(p, end, c == 0xca ? 4 : 8, &value)) {
+                *ok = false;
+                return QJSValue();
+            }
+            if (c == 0xca) {
+                quint32 bits = quint32(value);
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                return QJSValue(double(f));
+            }
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            return QJSValue(d);
+        }
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+            if (!readBigEndian(p, end, 1 << (c - 0xcc), &value)) {
+                *ok = false;
+                return QJSValue();
+            }
+            return QJSValue(double(value));
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+            size = 1 << (c - 0xd0);
+            if (!readBigEndian(p, end, size, &value)) {
+                *ok = false;
+                return QJSValue();
+            }
+            // Sign extend from the encoded width
+            int shift = 64 - size * 8;
+            return QJSValue(double(qint64(value << shift) >> shift));
+        }
+        case 0xc4: case 0xc5: case 0xc6:
+            kind = Binary;
+            size = 1 << (c - 0xc4);
+            break;
+        case 0xc7: case 0xc8: case 0xc9:
+            kind = Extension;
+            size = 1 << (c - 0xc7);
+            break;
+        case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+            kind = Extension;
+            length = 1 << (c - 0xd4);
+            break;
+        case 0xd9: case 0xda: case 0xdb:
+            kind = String;
+            size = 1 << (c - 0xd9);
+            break;
+        case 0xdc: case 0xdd:
+            kind = Array;
+            size = c == 0xdc ? 2 : 4;
+            break;
+        case 0xde: case 0xdf:
+            kind = Map;
+            size = c == 0xde ? 2 : 4;
+            break;
+        default:
+            *ok = false;
+            return QJSValue();
+        }
+
+        if (size && !readBigEndian(p, end, size, &length)) {
+            *ok = false;
+            return QJSValue();
+        }
+    }
+
+    // Every element takes at least one byte, which bounds the length by
+    // what is left of the input before anything is allocated.
+    if (kind == Extension)
+        ++length; // the extension type
+    if (length > quint64(end - p)) {
+        *ok = false;
+        return QJSValue();
+    }
+
+    switch (kind) {
+    case String: {
+        QString string = QString::fromUtf8(p, int(length));
+        p += length;
+        return QJSValue(string);
+    }
+    case Binary: {
+        QByteArray bytes(p, int(length));
+        p += length;
+        return m_engine->toScriptValue<QByteArray>(bytes);
+    }
+    case Extension:
+        // Application specific types have no JS representation
+        p += length;
+        return QJSValue();
+    case Array: {
+        QJSValue array = m_engine->newArray(quint32(length));
+        for (quint32 i = 0; i < length && *ok; ++i)
+            array.setProperty(i, readValue(p, end, depth + 1, ok));
+        return array;
+    }
+    case Map: {
+        QJSValue object = m_engine->newObject();
+        for (quint32 i = 0; i < length && *ok; ++i) {
+            QString key = readValue(p, end, depth + 1, ok).toString();
+            QJSValue value = readValue(p, end, depth + 1, ok);
+            if (key != PROTO)
+                object.setProperty(key, value);
+        }
+        return object;
+    }
+    }
+
+    return QJSValue();
+}
+
+} } }
@@ -9,20 +9,33 @@
 #include "qpm.h"
 
 class QQmlEngine;
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+class QCborStreamReader;
+class QCborStreamWriter;
+#endif
 
 namespace com { namespace cutehacks { namespace duperagent {
 
-typedef QList<QPair<QString, QString> > QueryItems;
-
 class BodyCodec
 {
 public:
+    virtual ~BodyCodec() {}
+
     virtual QByteArray stringify(const QJSValue&) = 0;
     virtual QJSValue parse(const QByteArray&) = 0;
 
 protected:
     BodyCodec(QQmlEngine *);
+
+    // Pushes an object or array that is about to be written, or returns
+    // false if it is already being written further up
+    bool enter(const QJSValue &);
+    void leave() { m_stack.removeLast(); }
+
     QQmlEngine *m_engine;
+
+    // Objects and arrays currently being written, to detect cycles
+    QList<QJSValue> m_stack;
 };
 
 class JsonCodec : public BodyCodec
@@ -38,9 +51,9 @@ protected:
     QJSValue parseJsonObject(const QJsonObject &);
     QJSValue parseJsonValue(const QJsonValue &);
 
-    QJsonObject stringifyObject(const QJSValue &) const;
-    QJsonArray stringifyArray(const QJSValue &) const;
-    QJsonValue stringifyValue(const QJSValue &) const;
+    void writeValue(QByteArray &, const QJSValue &);
+    void writeObject(QByteArray &, const QJSValue &);
+    void writeArray(QByteArray &, const QJSValue &);
 };
 
 class FormUrlEncodedCodec : public BodyCodec
@@ -53,9 +66,35 @@ public:
     QJSValue parse(const QByteArray &);
 
 protected:
-    QueryItems stringifyObject(const QString&, const QJSValue &) const;
-    QueryItems stringifyArray(const QString&, const QJSValue &) const;
-    QueryItems stringifyValue(const QString&, const QJSValue &) const;
+    void writeValue(QByteArray &, QByteArray &, const QJSValue &) const;
+
+    void assign(QJSValue, const QString&, const QJSValue &) const;
+};
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+class CborCodec : public BodyCodec
+{
+public:
+    CborCodec(QQmlEngine *);
+    QByteArray stringify(const QJSValue &);
+    QJSValue parse(const QByteArray &);
+
+protected:
+    void writeValue(QCborStreamWriter &, const QJSValue &, int depth);
+    QJSValue readValue(QCborStreamReader &, int depth) const;
+};
+#endif
+
+class MessagePackCodec : public BodyCodec
+{
+public:
+    MessagePackCodec(QQmlEngine *);
+    QByteArray stringify(const QJSValue &);
+    QJSValue parse(const QByteArray &);
+
+protected:
+    void writeValue(QByteArray &, const QJSValue &, int depth);
+    QJSValue readValue(const char *&, const char *, int depth, bool *ok) const;
 };
 
 } } }
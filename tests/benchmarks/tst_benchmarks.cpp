@@ -0,0 +1,682 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QTextCodec>
+#include <QtCore/QThreadPool>
+#include <QtGui/QImage>
+#include <QtGui/QPainter>
+#include <QtNetwork/QNetworkCookie>
+#include <QtNetwork/QNetworkDiskCache>
+#include <QtQml/QQmlEngine>
+#include <QtTest/QtTest>
+
+#include "compressedcache.h"
+#include "config.h"
+#include "cookiejar.h"
+#include "imageutils.h"
+#include "memorycache.h"
+#include "microtaskqueue.h"
+#include "packcache.h"
+#include "promise.h"
+#include "promisemodule.h"
+#include "serialization.h"
+#include "textdecoder.h"
+
+using namespace com::cutehacks::duperagent;
+
+class tst_Benchmarks : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void decodeText_data();
+    void decodeText();
+    void decodeTextCodec_data();
+    void decodeTextCodec();
+    void jsonStringify_data();
+    void jsonStringify();
+    void jsonStringifyEngine_data();
+    void jsonStringifyEngine();
+    void formStringify_data();
+    void formStringify();
+    void cacheRead_data();
+    void cacheRead();
+    void cacheStartup_data();
+    void cacheStartup();
+    void cacheHitCompressed_data();
+    void cacheHitCompressed();
+    void cookieInsert_data();
+    void cookieInsert();
+    void cookieLookup_data();
+    void cookieLookup();
+    void coldStart_data();
+    void coldStart();
+    void promiseChain_data();
+    void promiseChain();
+    void promiseAll_data();
+    void promiseAll();
+    void imageBatch_data();
+    void imageBatch();
+};
+
+// Records how far below a reference point the stack was when called from
+// the last handler of a promise chain
+class StackProbe : public QObject
+{
+    Q_OBJECT
+
+public:
+    StackProbe() : base(0), depth(0) {}
+
+    Q_INVOKABLE void probe()
+    {
+        char here;
+        depth = qAbs(base - &here);
+    }
+
+    char *base;
+    qptrdiff depth;
+};
+
+static QByteArray asciiPayload(int size)
+{
+    QByteArray chunk("{\"id\":12345,\"name\":\"duperagent\",\"tags\":[\"http\",\"qml\"]},");
+    QByteArray data;
+    data.reserve(size + chunk.size());
+    while (data.size() < size)
+        data += chunk;
+    data.truncate(size);
+    return data;
+}
+
+static QByteArray utf8Payload(int size)
+{
+    QByteArray chunk = QString::fromUtf8("{\"city\":\"Tromsø\",\"greeting\":\"Привет\"},").toUtf8();
+    QByteArray data;
+    data.reserve(size + chunk.size());
+    while (data.size() < size)
+        data += chunk;
+    return data;
+}
+
+static void decodeRows()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<QByteArray>("charset");
+
+    QTest::newRow("ascii 1KB") << asciiPayload(1024) << QByteArray("utf-8");
+    QTest::newRow("ascii 1MB") << asciiPayload(1024 * 1024) << QByteArray("utf-8");
+    QTest::newRow("ascii 16MB") << asciiPayload(16 * 1024 * 1024) << QByteArray("utf-8");
+    QTest::newRow("utf-8 1MB") << utf8Payload(1024 * 1024) << QByteArray("utf-8");
+    QTest::newRow("latin-1 1MB") << asciiPayload(1024 * 1024) << QByteArray("iso-8859-1");
+    QTest::newRow("windows-1252 1MB") << asciiPayload(1024 * 1024) << QByteArray("windows-1252");
+}
+
+void tst_Benchmarks::decodeText_data()
+{
+    decodeRows();
+}
+
+void tst_Benchmarks::decodeText()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(QByteArray, charset);
+
+    QString expected = QTextCodec::codecForName(charset)->toUnicode(data);
+    QCOMPARE(com::cutehacks::duperagent::decodeText(data, charset), expected);
+
+    QBENCHMARK {
+        com::cutehacks::duperagent::decodeText(data, charset);
+    }
+}
+
+void tst_Benchmarks::decodeTextCodec_data()
+{
+    decodeRows();
+}
+
+// Baseline: the QTextCodec decoder path responses used previously
+void tst_Benchmarks::decodeTextCodec()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(QByteArray, charset);
+
+    QTextCodec *codec = QTextCodec::codecForName(charset);
+    QBENCHMARK {
+        QScopedPointer<QTextDecoder> decoder(codec->makeDecoder());
+        decoder->toUnicode(data);
+    }
+}
+
+// Builds an array of records similar to the sync payloads posted by apps
+static QJSValue jsonPayload(QQmlEngine *engine, int count)
+{
+    return engine->evaluate(QStringLiteral(
+        "(function(count) {"
+        "    var rows = [];"
+        "    for (var i = 0; i < count; ++i) {"
+        "        rows.push({ id: i, name: 'item ' + i, price: i * 1.25, active: i % 2 == 0,"
+        "                    tags: ['http', 'qml', 'Tromsø'], meta: { created: 1451606400 + i } });"
+        "    }"
+        "    return rows;"
+        "})")).call(QJSValueList() << count);
+}
+
+static void jsonRows()
+{
+    QTest::addColumn<int>("count");
+
+    QTest::newRow("100 records") << 100;
+    QTest::newRow("10k records") << 10000;
+    QTest::newRow("100k records") << 100000;
+}
+
+void tst_Benchmarks::jsonStringify_data()
+{
+    jsonRows();
+}
+
+void tst_Benchmarks::jsonStringify()
+{
+    QFETCH(int, count);
+
+    QQmlEngine engine;
+    QJSValue payload = jsonPayload(&engine, count);
+    JsonCodec codec(&engine);
+
+    QByteArray expected = engine.evaluate(QStringLiteral("JSON.stringify"))
+            .call(QJSValueList() << payload).toString().toUtf8();
+    QCOMPARE(codec.stringify(payload), expected);
+
+    QBENCHMARK {
+        codec.stringify(payload);
+    }
+}
+
+void tst_Benchmarks::jsonStringifyEngine_data()
+{
+    jsonRows();
+}
+
+// Baseline: the engine's own JSON.stringify() followed by the UTF-8 conversion
+void tst_Benchmarks::jsonStringifyEngine()
+{
+    QFETCH(int, count);
+
+    QQmlEngine engine;
+    QJSValue payload = jsonPayload(&engine, count);
+    QJSValue stringify = engine.evaluate(QStringLiteral("JSON.stringify"));
+
+    QBENCHMARK {
+        stringify.call(QJSValueList() << payload).toString().toUtf8();
+    }
+}
+
+void tst_Benchmarks::formStringify_data()
+{
+    QTest::addColumn<QString>("builder");
+    QTest::addColumn<int>("size");
+
+    // A flat object with many keys
+    QString wide = QStringLiteral(
+        "(function(size) {"
+        "    var o = {};"
+        "    for (var i = 0; i < size; ++i)"
+        "        o['field' + i] = 'value ' + i + ' & more';"
+        "    return o;"
+        "})");
+
+    // Objects nested size levels deep with a few values on every level
+    QString deep = QStringLiteral(
+        "(function(size) {"
+        "    var root = {}, o = root;"
+        "    for (var i = 0; i < size; ++i) {"
+        "        o.name = 'level ' + i; o.tags = ['a', 'b', 'ø']; o.id = i;"
+        "        o = o.child = {};"
+        "    }"
+        "    return root;"
+        "})");
+
+    QTest::newRow("wide 100") << wide << 100;
+    QTest::newRow("wide 10k") << wide << 10000;
+    QTest::newRow("deep 16") << deep << 16;
+    QTest::newRow("deep 128") << deep << 128;
+}
+
+void tst_Benchmarks::formStringify()
+{
+    QFETCH(QString, builder);
+    QFETCH(int, size);
+
+    QQmlEngine engine;
+    QJSValue payload = engine.evaluate(builder).call(QJSValueList() << size);
+    FormUrlEncodedCodec codec(&engine);
+
+    QBENCHMARK {
+        codec.stringify(payload);
+    }
+}
+
+static void fillCache(QAbstractNetworkCache *cache, int count, const QByteArray &body)
+{
+    QNetworkCacheMetaData::RawHeaderList headers;
+    headers.append(qMakePair(QByteArray("Content-Type"), QByteArray("application/json")));
+
+    for (int i = 0; i < count; ++i) {
+        QNetworkCacheMetaData metaData;
+        metaData.setUrl(QUrl(QStringLiteral("https://example.com/item/%1").arg(i)));
+        metaData.setSaveToDisk(true);
+        metaData.setExpirationDate(QDateTime::currentDateTimeUtc().addDays(1));
+        metaData.setRawHeaders(headers);
+
+        QIODevice *device = cache->prepare(metaData);
+        device->write(body);
+        cache->insert(device);
+    }
+}
+
+void tst_Benchmarks::cacheRead_data()
+{
+    QTest::addColumn<qint64>("memorySize");
+
+    QTest::newRow("disk") << Q_INT64_C(0);
+    QTest::newRow("memory + disk") << Q_INT64_C(8 * 1024 * 1024);
+}
+
+// Repeatedly reads a working set of small JSON responses, the pattern of an
+// app navigating back and forth between a few views.
+void tst_Benchmarks::cacheRead()
+{
+    QFETCH(qint64, memorySize);
+
+    const int count = 200;
+    QTemporaryDir dir;
+    QNetworkDiskCache *disk = new QNetworkDiskCache();
+    disk->setCacheDirectory(dir.path());
+    MemoryCache cache(memorySize, disk);
+    fillCache(&cache, count, asciiPayload(2048));
+
+    QBENCHMARK {
+        for (int i = 0; i < count; ++i) {
+            QUrl url(QStringLiteral("https://example.com/item/%1").arg(i));
+            QVERIFY(cache.metaData(url).isValid());
+            QScopedPointer<QIODevice> device(cache.data(url));
+            device->readAll();
+        }
+    }
+}
+
+static QAbstractNetworkCache *createCache(const QString &engine, const QString &path)
+{
+    if (engine == QLatin1String("pack"))
+        return new PackCache(path, 512 * 1024 * 1024);
+
+    QNetworkDiskCache *cache = new QNetworkDiskCache();
+    cache->setCacheDirectory(path);
+    cache->setMaximumCacheSize(512 * 1024 * 1024);
+    return cache;
+}
+
+void tst_Benchmarks::cacheStartup_data()
+{
+    QTest::addColumn<QString>("engine");
+    QTest::addColumn<int>("count");
+
+    QTest::newRow("disk 1k") << QString("disk") << 1000;
+    QTest::newRow("pack 1k") << QString("pack") << 1000;
+    QTest::newRow("disk 20k") << QString("disk") << 20000;
+    QTest::newRow("pack 20k") << QString("pack") << 20000;
+}
+
+// Opens a populated cache and looks up an entry, which is what the first
+// request of an app does. QNetworkDiskCache has to scan its directory to
+// find its size; the pack cache only maps its index.
+void tst_Benchmarks::cacheStartup()
+{
+    QFETCH(QString, engine);
+    QFETCH(int, count);
+
+    QTemporaryDir dir;
+    {
+        QScopedPointer<QAbstractNetworkCache> cache(createCache(engine, dir.path()));
+        fillCache(cache.data(), count, asciiPayload(1024));
+    }
+
+    QUrl url(QStringLiteral("https://example.com/item/%1").arg(count / 2));
+    QBENCHMARK {
+        QScopedPointer<QAbstractNetworkCache> cache(createCache(engine, dir.path()));
+        cache->cacheSize();
+        QVERIFY(cache->metaData(url).isValid());
+    }
+}
+
+void tst_Benchmarks::cacheHitCompressed_data()
+{
+    QTest::addColumn<QString>("engine");
+    QTest::addColumn<bool>("compress");
+
+    QTest::newRow("disk") << QString("disk") << false;
+    QTest::newRow("disk compressed") << QString("disk") << true;
+    QTest::newRow("pack") << QString("pack") << false;
+    QTest::newRow("pack compressed") << QString("pack") << true;
+}
+
+// Reads 16KB JSON responses straight from the disk cache, without a memory
+// tier in front, to show what decompression adds to a hit.
+void tst_Benchmarks::cacheHitCompressed()
+{
+    QFETCH(QString, engine);
+    QFETCH(bool, compress);
+
+    const int count = 100;
+    QTemporaryDir dir;
+    QScopedPointer<QAbstractNetworkCache> cache(createCache(engine, dir.path()));
+    if (compress)
+        cache.reset(new CompressedCache(cache.take()));
+    fillCache(cache.data(), count, asciiPayload(16 * 1024));
+    if (compress)
+        QVERIFY(cache->cacheSize() < count * 16 * 1024 / 2);
+
+    QBENCHMARK {
+        for (int i = 0; i < count; ++i) {
+            QUrl url(QStringLiteral("https://example.com/item/%1").arg(i));
+            QVERIFY(cache->metaData(url).isValid());
+            QScopedPointer<QIODevice> device(cache->data(url));
+            QCOMPARE(device->readAll().size(), 16 * 1024);
+        }
+    }
+}
+
+void tst_Benchmarks::cookieInsert_data()
+{
+    QTest::addColumn<int>("count");
+
+    QTest::newRow("20 cookies") << 20;
+    QTest::newRow("500 cookies") << 500;
+}
+
+// Stores the cookies of a burst of responses, like a login that sets a
+// couple of dozen cookies. Saving the jar is left to a timer, so the event
+// loop isn't run here; the final write is part of the measurement.
+void tst_Benchmarks::cookieInsert()
+{
+    QFETCH(int, count);
+
+    QTemporaryDir dir;
+    QList<QNetworkCookie> cookies;
+    for (int i = 0; i < count; ++i) {
+        QNetworkCookie cookie(QByteArray("cookie") + QByteArray::number(i), "value");
+        cookie.setDomain(QStringLiteral(".example.com"));
+        cookie.setPath(QStringLiteral("/"));
+        cookie.setExpirationDate(QDateTime::currentDateTimeUtc().addDays(30));
+        cookies.append(cookie);
+    }
+
+    CookieJar jar(dir.path() + QStringLiteral("/cookies.txt"));
+    QBENCHMARK {
+        foreach (const QNetworkCookie &cookie, cookies)
+            jar.insertCookie(cookie);
+        jar.flush();
+    }
+}
+
+void tst_Benchmarks::cookieLookup_data()
+{
+    QTest::addColumn<int>("domains");
+
+    QTest::newRow("10 domains") << 10;
+    QTest::newRow("300 domains") << 300;
+}
+
+// Builds the cookies for a request when the jar also holds ten cookies for
+// each of a number of unrelated sites, like third party embeds leave behind
+void tst_Benchmarks::cookieLookup()
+{
+    QFETCH(int, domains);
+
+    QTemporaryDir dir;
+    CookieJar jar(dir.path() + QStringLiteral("/cookies.txt"));
+    QDateTime expires = QDateTime::currentDateTimeUtc().addDays(30);
+    for (int d = 0; d < domains; ++d) {
+        for (int i = 0; i < 10; ++i) {
+            QNetworkCookie cookie(QByteArray("cookie") + QByteArray::number(i), "value");
+            cookie.setDomain(QStringLiteral(".site%1.com").arg(d));
+            cookie.setPath(QStringLiteral("/"));
+            cookie.setExpirationDate(expires);
+            jar.insertCookie(cookie);
+        }
+    }
+
+    QUrl url(QStringLiteral("https://www.site0.com/index.html"));
+    QBENCHMARK {
+        QCOMPARE(jar.cookiesForUrl(url).size(), 10);
+    }
+}
+
+void tst_Benchmarks::coldStart_data()
+{
+    QTest::addColumn<bool>("background");
+
+    QTest::newRow("synchronous") << false;
+    QTest::newRow("background") << true;
+}
+
+// Time from application start until the first request can be sent, with a
+// cache of 5000 responses and a jar of 1000 cookies on disk. The 100ms
+// sleep stands in for creating the QML engine and loading the UI, which
+// background initialization overlaps with opening the cache and jar.
+void tst_Benchmarks::coldStart()
+{
+    QFETCH(bool, background);
+
+    QTemporaryDir dir;
+    QVariantMap cacheOptions;
+    cacheOptions.insert(QStringLiteral("location"), dir.path() + QStringLiteral("/cache"));
+    QVariantMap jarOptions;
+    jarOptions.insert(QStringLiteral("location"), dir.path() + QStringLiteral("/cookies.txt"));
+    QVariantMap options;
+    options.insert(QStringLiteral("cache"), cacheOptions);
+    options.insert(QStringLiteral("cookieJar"), jarOptions);
+
+    Config config;
+    config.setOptions(options);
+    {
+        QScopedPointer<QAbstractNetworkCache> cache(config.createCache());
+        fillCache(cache.data(), 5000, asciiPayload(1024));
+
+        QScopedPointer<CookieJar> jar(config.createCookieJar());
+        QDateTime expires = QDateTime::currentDateTimeUtc().addDays(30);
+        for (int i = 0; i < 1000; ++i) {
+            QNetworkCookie cookie(QByteArray("cookie") + QByteArray::number(i), "value");
+            cookie.setDomain(QStringLiteral(".site%1.com").arg(i % 100));
+            cookie.setPath(QStringLiteral("/"));
+            cookie.setExpirationDate(expires);
+            jar->insertCookie(cookie);
+        }
+    }
+
+    QUrl url(QStringLiteral("https://example.com/item/2500"));
+    QBENCHMARK {
+        QScopedPointer<QAbstractNetworkCache> cache;
+        QScopedPointer<CookieJar> jar;
+        if (background) {
+            ConfigLoader loader(config);
+            loader.start();
+            QThread::msleep(100);
+            loader.wait();
+            cache.reset(loader.takeCache());
+            jar.reset(loader.takeCookieJar());
+        } else {
+            QThread::msleep(100);
+            cache.reset(config.createCache());
+            cache->cacheSize();
+            jar.reset(config.createCookieJar());
+        }
+        QVERIFY(cache->metaData(url).isValid());
+        QCOMPARE(jar->allCookies().size(), 1000);
+    }
+}
+
+void tst_Benchmarks::promiseChain_data()
+{
+    QTest::addColumn<int>("length");
+
+    QTest::newRow("10 handlers") << 10;
+    QTest::newRow("1000 handlers") << 1000;
+    QTest::newRow("10000 handlers") << 10000;
+}
+
+// Settles a promise at the head of a chain of then() handlers and returns
+// the stack used by the last handler.
+static qptrdiff settleChain(QQmlEngine *engine, QJSValue chain, int length)
+{
+    StackProbe stackProbe;
+    QJSValue probe = engine->newQObject(&stackProbe);
+    QQmlEngine::setObjectOwnership(&stackProbe, QQmlEngine::CppOwnership);
+
+    Promise *promise = new Promise(engine);
+    chain.call(QJSValueList() << promise->self() << length << probe);
+
+    char base;
+    stackProbe.base = &base;
+    promise->fulfill(0);
+    MicrotaskQueue::instance()->drain();
+    return stackProbe.depth;
+}
+
+// Settles a promise with a long chain of then() handlers. The handlers run
+// from the microtask queue one after another, so the stack used by the last
+// one stays close to what a chain of 10 handlers uses.
+void tst_Benchmarks::promiseChain()
+{
+    QFETCH(int, length);
+
+    QQmlEngine engine;
+    QJSValue chain = engine.evaluate(
+        "(function(p, length, probe) {"
+        "    for (var i = 0; i < length; i++)"
+        "        p = p.then(function(v) { return v + 1; });"
+        "    p.then(function(v) { probe.probe(); });"
+        "})");
+
+    qptrdiff depth = 0;
+    QBENCHMARK {
+        depth = settleChain(&engine, chain, length);
+    }
+
+    qptrdiff reference = settleChain(&engine, chain, 10);
+    QVERIFY(reference > 0);
+    QVERIFY2(depth <= 2 * reference,
+             qPrintable(QString("%1 bytes of stack used, %2 with 10 handlers")
+                        .arg(depth).arg(reference)));
+}
+
+void tst_Benchmarks::promiseAll_data()
+{
+    QTest::addColumn<int>("behavior");
+    QTest::addColumn<int>("count");
+
+    QTest::newRow("all 1k") << int(MultiPromiseExecutor::All) << 1000;
+    QTest::newRow("all 10k") << int(MultiPromiseExecutor::All) << 10000;
+    QTest::newRow("all 100k") << int(MultiPromiseExecutor::All) << 100000;
+    QTest::newRow("allSettled 1k") << int(MultiPromiseExecutor::AllSettled) << 1000;
+    QTest::newRow("allSettled 10k") << int(MultiPromiseExecutor::AllSettled) << 10000;
+    QTest::newRow("allSettled 100k") << int(MultiPromiseExecutor::AllSettled) << 100000;
+}
+
+// Combines pending promises and settles them one by one, which is the
+// combinators' worst case: they have to wait for every input.
+void tst_Benchmarks::promiseAll()
+{
+    QFETCH(int, behavior);
+    QFETCH(int, count);
+
+    QQmlEngine engine;
+    QBENCHMARK {
+        QList<Promise*> promises;
+        QJSValue array = engine.newArray(count);
+        for (int i = 0; i < count; ++i) {
+            Promise *promise = new Promise(&engine);
+            promises.append(promise);
+            array.setProperty(quint32(i), promise->self());
+        }
+
+        MultiPromiseExecutor *executor = new MultiPromiseExecutor(
+                    &engine, MultiPromiseExecutor::Behavior(behavior));
+        QJSValue result = executor->addIterable(array);
+
+        for (int i = 0; i < count; ++i)
+            promises.at(i)->fulfill(i);
+        MicrotaskQueue::instance()->drain();
+
+        QVERIFY(!result.property("then").isUndefined());
+    }
+}
+
+void tst_Benchmarks::imageBatch_data()
+{
+    QTest::addColumn<int>("concurrency");
+
+    QTest::newRow("1 thread") << 1;
+    QTest::newRow("all cores") << QThreadPool::globalInstance()->maxThreadCount();
+}
+
+// Makes upload thumbnails out of a folder of camera sized JPEGs, the way a
+// gallery would with ImageUtils.process()
+void tst_Benchmarks::imageBatch()
+{
+    QFETCH(int, concurrency);
+
+    const int count = 32;
+    QTemporaryDir dir;
+    QList<ImageReadSettings> settings;
+    QImage photo(2000, 1500, QImage::Format_RGB32);
+    for (int i = 0; i < count; ++i) {
+        QLinearGradient gradient(0, 0, photo.width(), photo.height());
+        gradient.setColorAt(0, QColor::fromHsv(i * 11 % 360, 200, 255));
+        gradient.setColorAt(1, QColor::fromHsv(i * 37 % 360, 255, 80));
+        QPainter painter(&photo);
+        painter.fillRect(photo.rect(), gradient);
+        painter.end();
+
+        QString fileName = dir.path() + QString("/photo%1.jpg").arg(i);
+        QVERIFY(photo.save(fileName, "jpg", 90));
+
+        ImageReadSettings s;
+        s.fileName = fileName;
+        s.scaledSize = QSize(320, 320);
+        s.aspectRatioMode = Qt::KeepAspectRatio;
+        s.format = "jpg";
+        s.quality = 80;
+        settings.append(s);
+    }
+
+    QQmlEngine engine;
+    qint64 images = 0;
+    qint64 elapsed = 0;
+    QBENCHMARK {
+        QElapsedTimer timer;
+        timer.start();
+        ImageBatch *batch = new ImageBatch(&engine, settings);
+        batch->setMaxConcurrent(concurrency);
+        QSignalSpy spy(batch, SIGNAL(finished()));
+        QJSValue result = batch->start();
+        QVERIFY(spy.wait(60000));
+        elapsed += timer.nsecsElapsed();
+        images += count;
+
+        // The batch holds on to its results until it is deleted, which has
+        // to happen while the engine is still around
+        QCoreApplication::sendPostedEvents(0, QEvent::DeferredDelete);
+    }
+
+    // Throughput in images per second is reported instead of the time spent
+    // per batch
+    QTest::setBenchmarkResult(images * 1e9 / qMax(qint64(1), elapsed), QTest::Events);
+}
+
+QTEST_MAIN(tst_Benchmarks)
+
+#include "tst_benchmarks.moc"
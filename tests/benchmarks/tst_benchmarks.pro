@@ -0,0 +1,8 @@
+TEMPLATE = app
+TARGET = tst_benchmarks
+CONFIG += warn_on testcase
+QT += testlib network qml
+SOURCES += tst_benchmarks.cpp
+
+INCLUDEPATH += $$PWD/../..
+include($$PWD/../../com_cutehacks_duperagent.pri)
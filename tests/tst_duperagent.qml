@@ -79,6 +79,29 @@ TestCase {
         async.wait(timeout);
     }
 
+    function test_post_json_values() {
+        var date = new Date(Date.UTC(2016, 0, 2, 3, 4, 5));
+        Http.Request
+            .post("https://httpbin.org/post")
+            .send({
+                text: "quote\" backslash\\ newline\n tab\t \u00f8 \u20ac \ud83d\ude00",
+                numbers: [0, -1, 1.5, 1e21, 9007199254740993, NaN],
+                nested: { flag: true, nothing: null, skipped: undefined, fn: function() {} },
+                date: date
+            })
+            .end(function(err, res){
+                verify(!err, err);
+                var json = res.body.json;
+                compare(json.text, "quote\" backslash\\ newline\n tab\t \u00f8 \u20ac \ud83d\ude00");
+                compare(json.numbers, [0, -1, 1.5, 1e21, 9007199254740993, null]);
+                compare(json.nested, { flag: true, nothing: null });
+                compare(json.date, date.toJSON());
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
     function test_post_form() {
         Http.Request
             .post("https://httpbin.org/post")
@@ -94,6 +117,29 @@ TestCase {
         async.wait(timeout);
     }
 
+    function test_post_form_nested() {
+        Http.Request
+            .post("https://httpbin.org/post")
+            .type("form")
+            .send({
+                text: "a+b & c=d ø",
+                user: { name: "duper", tags: ["x", "y"] },
+                empty: null
+            })
+            .end(function(err, res){
+                verify(!err, err);
+                compare(res.status, 200);
+                compare(res.body.form["text"], "a+b & c=d ø");
+                compare(res.body.form["user[name]"], "duper");
+                compare(res.body.form["user[tags][0]"], "x");
+                compare(res.body.form["user[tags][1]"], "y");
+                compare(res.body.form["empty"], "");
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
     function test_put() {
         Http.Request
             .put("https://httpbin.org/put")
@@ -327,6 +373,107 @@ TestCase {
         async.wait(timeout);
     }
 
+    function test_cache_stale_while_revalidate() {
+        var url = "https://httpbin.org/response-headers?Cache-Control=" +
+                encodeURIComponent("max-age=1, stale-while-revalidate=60");
+        Http.Request
+            .get(url)
+            .end(function(err, res){
+                compare(res.cacheStatus, "network");
+                done();
+            });
+
+        async.wait(timeout);
+        async.clear();
+
+        sleep(2000);
+
+        Http.Request
+            .get(url)
+            .end(function(err, res){
+                verify(!err, err);
+                verify(res.fromCache);
+                compare(res.cacheStatus, "stale");
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
+    function test_cache_immutable() {
+        var url = "https://httpbin.org/response-headers?Cache-Control=" +
+                encodeURIComponent("max-age=3600, immutable");
+        Http.Request
+            .get(url)
+            .end(function(err, res){
+                compare(res.cacheStatus, "network");
+                done();
+            });
+
+        async.wait(timeout);
+        async.clear();
+
+        Http.Request
+            .get(url)
+            .cacheLoad(Http.CacheControl.AlwaysNetwork)
+            .end(function(err, res){
+                verify(!err, err);
+                verify(res.fromCache);
+                compare(res.cacheStatus, "immutable");
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
+    function test_cache_inspector() {
+        var url = "https://httpbin.org/response-headers?Cache-Control=" +
+                encodeURIComponent("max-age=3600") + "&inspect=" + Date.now();
+        Http.Request
+            .get(url)
+            .end(function(err, res){
+                done();
+            });
+
+        async.wait(timeout);
+
+        var cache = Http.Request.cache;
+        var entry = cache.lookup(url);
+        verify(entry);
+        verify(entry.url.indexOf("httpbin.org/response-headers") >= 0);
+        verify(entry.size > 0);
+        verify(!entry.pinned);
+        verify(cache.size > 0);
+        verify(cache.misses > 0);
+
+        verify(cache.pin(url));
+        verify(cache.lookup(url).pinned);
+        verify(cache.hosts().some(function(h) { return h.host === "httpbin.org"; }));
+
+        verify(cache.pin(url, false));
+        verify(cache.remove(url));
+        compare(cache.lookup(url), null);
+    }
+
+    function test_prefetch() {
+        var url = "https://httpbin.org/response-headers?Cache-Control=" +
+                encodeURIComponent("max-age=3600") + "&prefetch=" + Date.now();
+        Http.Request.prefetch([url]);
+
+        wait(3000);
+
+        Http.Request
+            .get(url)
+            .cacheLoad(Http.CacheControl.AlwaysCache)
+            .end(function(err, res){
+                verify(!err, err);
+                verify(res.fromCache);
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
     function test_cache_load_always_cache() {
         sleep(5000);
 
@@ -427,6 +574,30 @@ TestCase {
         async.wait(timeout);
     }
 
+    function test_queue() {
+        var reported = 0;
+        function onFinished(id, err, res) {
+            reported++;
+        }
+        Http.Request.queue.finished.connect(onFinished);
+
+        Http.Request
+            .post("https://httpbin.org/post")
+            .send({ event: "queued" })
+            .queue()
+            .end(function(err, res){
+                verify(!err, err);
+                compare(res.body.json.event, "queued");
+                done();
+            });
+
+        async.wait(timeout);
+        Http.Request.queue.finished.disconnect(onFinished);
+
+        compare(reported, 1);
+        compare(Http.Request.queue.pending, 0);
+    }
+
     function test_multipart() {
         Http.Request
             .post("https://httpbin.org/post")
@@ -555,6 +726,76 @@ TestCase {
         compare(count, 3);
     }
 
+    function test_then_async() {
+        var order = [];
+        var p = Http.Promise.resolve(1);
+        p.then(function(value) {
+            order.push("then " + value);
+            return value + 1;
+        }).then(function(value) {
+            order.push("then " + value);
+            done();
+        });
+        order.push("sync");
+
+        async.wait(timeout);
+
+        compare(order, ["sync", "then 1", "then 2"]);
+    }
+
+    function test_then_native_promise() {
+        var p = Http.Request
+            .get("https://httpbin.org/get")
+            .then();
+
+        if (typeof Promise !== "undefined")
+            verify(p instanceof Promise);
+
+        p.then(function(value) {
+            compare(value.status, 200);
+            done();
+        });
+
+        async.wait(timeout);
+    }
+
+    function test_promise_all_settled() {
+        Http.Promise.allSettled([
+            Http.Promise.resolve(3),
+            1337,
+            Http.Promise.reject("error")
+        ]).then(function(results) {
+            compare(results.length, 3);
+            compare(results[0].status, "fulfilled");
+            compare(results[0].value, 3);
+            compare(results[1].value, 1337);
+            compare(results[2].status, "rejected");
+            compare(results[2].reason, "error");
+            done();
+        });
+
+        async.wait(timeout);
+    }
+
+    function test_promise_any() {
+        Http.Promise.any([
+            Http.Promise.reject("first"),
+            Http.Promise.resolve(3)
+        ]).then(function(value) {
+            compare(value, 3);
+            return Http.Promise.any([Http.Promise.reject("a"), Http.Promise.reject("b")]);
+        }).then(function() {
+            verify(false, "this should not be fulfilled!");
+        }, function(reason) {
+            compare(reason.name, "AggregateError");
+            compare(reason.errors.length, 2);
+            compare(reason.errors[1], "b");
+            done();
+        });
+
+        async.wait(timeout);
+    }
+
     function test_then_chaining_1() {
         var p1 = Http.Request
             .get("https://httpbin.org/get?req=1")
@@ -708,4 +949,155 @@ TestCase {
 
         async.wait(timeout);
     }
+
+    function test_responseType_arraybuffer_text() {
+        Http.Request
+            .get("https://httpbin.org/robots.txt")
+            .responseType(Http.ResponseType.ArrayBuffer)
+            .end(function(err, res){
+                verify(!err, err);
+                compare(res.status, 200);
+                compare(typeof(new ArrayBuffer(0)), typeof(res.body));
+                verify(res.text.indexOf("User-agent") >= 0);
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
+    function test_parse_form_urlencoded() {
+        // The data: URL is percent-decoded once before the body is parsed,
+        // so pct=%252541 reaches the codec as pct=%2541
+        Http.Request
+            .get("data:application/x-www-form-urlencoded,foo=bar&baz=qux+quux&pct=%252541" +
+                 "&arr[0]=1&arr[1]=2&obj[a][b]=c&obj[d]=e&list[]=x&list[]=y&dup=1&dup=2")
+            .end(function(err, res){
+                verify(!err, err);
+                compare(res.body.foo, "bar");
+                compare(res.body.baz, "qux quux");
+                compare(res.body.pct, "%41");
+                compare(res.body.arr.length, 2);
+                compare(res.body.arr[1], "2");
+                compare(res.body.obj.a.b, "c");
+                compare(res.body.obj.d, "e");
+                compare(res.body.list[0], "x");
+                compare(res.body.list[1], "y");
+                compare(res.body.dup[0], "1");
+                compare(res.body.dup[1], "2");
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
+    function test_abort_signal() {
+        var controller = Http.Request.abortController();
+        var errors = [];
+        var check = function(err) {
+            errors.push(err);
+            if (errors.length === 2)
+                done();
+        };
+
+        Http.Request
+            .get("https://httpbin.org/delay/5")
+            .signal(controller)
+            .end(function(err, res) {
+                check(err);
+            });
+        Http.Request
+            .get("https://httpbin.org/delay/5")
+            .signal(controller)
+            .then(function() {
+                verify(false, "this should not be fulfilled!");
+            }, check);
+
+        wait(200);
+        controller.abort("leaving");
+        verify(controller.aborted);
+
+        async.wait(timeout);
+
+        compare(errors[0].name, "AbortError");
+        compare(errors[1].name, "AbortError");
+        compare(errors[0].reason, "leaving");
+    }
+
+    function test_parse_multipart() {
+        var parts = [];
+        Http.Request
+            .get("data:multipart/mixed;boundary=XX," +
+                 "--XX%0D%0AContent-Type:%20application/json%0D%0A%0D%0A%7B%22a%22:1%7D" +
+                 "%0D%0A--XX%0D%0AX-Name:%20second%0D%0A%0D%0Ahello" +
+                 "%0D%0A--XX%0D%0AContent-Type:%20application/octet-stream%0D%0A%0D%0A%00%FF" +
+                 "%0D%0A--XX--%0D%0A")
+            .on("part", function(part) {
+                parts.push(part);
+            })
+            .end(function(err, res){
+                verify(!err, err);
+                compare(parts.length, 3);
+                compare(res.body.length, 3);
+                compare(res.body[0].header["content-type"], "application/json");
+                compare(res.body[0].body.a, 1);
+                compare(res.body[1].header["x-name"], "second");
+                compare(res.body[1].body, "hello");
+                compare(parts[1].text, "hello");
+                compare(res.body[2].body.byteLength, 2);
+                compare(new Uint8Array(res.body[2].body)[1], 255);
+                compare(new Uint8Array(res.body[1].data)[0], 104);
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
+    function test_parse_msgpack() {
+        Http.Request
+            .get("data:application/msgpack;base64,gqFhAaFik8PAoXg=")
+            .end(function(err, res){
+                verify(!err, err);
+                compare(res.body.a, 1);
+                compare(res.body.b, [true, null, "x"]);
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
+    function test_post_cyclic_cbor() {
+        var o = {};
+        o.a = o;
+        o.b = o;
+        Http.Request
+            .post("https://httpbin.org/post")
+            .type("cbor")
+            .send(o)
+            .end(function(err, res){
+                verify(!err, err);
+                // {"a": null, "b": null} as an indefinite length map
+                verify(res.body.data.indexOf("v2Fh9mFi9v8=") !== -1, res.body.data);
+                done();
+            });
+
+        async.wait(timeout);
+    }
+
+    function test_post_cyclic_msgpack() {
+        var o = {};
+        o.a = o;
+        o.b = [o];
+        Http.Request
+            .post("https://httpbin.org/post")
+            .type("msgpack")
+            .send(o)
+            .end(function(err, res){
+                verify(!err, err);
+                // {"a": nil, "b": [nil]}
+                verify(res.body.data.indexOf("gqFhwKFikcA=") !== -1, res.body.data);
+                done();
+            });
+
+        async.wait(timeout);
+    }
 }
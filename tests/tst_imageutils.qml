@@ -76,4 +76,79 @@ TestCase {
 
         async3.wait(timeout);
     }
+
+    function test_read_async() {
+        var imageUrl = "https://dummyimage.com/800x600/000/fff.jpg";
+
+        Http.Request
+            .get(imageUrl)
+            .then(function(res) {
+                var reader = Http.ImageUtils.createReader(res.body);
+                reader.setScaledSize(200, 150);
+                return reader.read({ async: true, transcode: { format: "png" } });
+            })
+            .then(function(scaled) {
+                compare(scaled.toJSON().indexOf("data:image/png;base64,"), 0);
+                var check = Http.ImageUtils.createReader(scaled.toJSON());
+                compare(check.size().width, 200);
+                compare(check.size().height, 150);
+                done();
+            });
+
+        async3.wait(timeout);
+    }
+
+    function test_process() {
+        var imageUrl = "https://dummyimage.com/800x600/000/fff.jpg";
+        var reported = 0;
+
+        Http.Request
+            .get(imageUrl)
+            .then(function(res) {
+                return Http.ImageUtils.process([res.body, "does-not-exist.jpg", res.body], {
+                    scaledSize: { width: 200, height: 200, mode: Image.PreserveAspectFit },
+                    transcode: { format: "png" },
+                    concurrency: 2,
+                    onResult: function(err, image, index) {
+                        reported++;
+                        compare(!!err, index === 1);
+                    }
+                });
+            })
+            .then(function(images) {
+                compare(reported, 3);
+                compare(images.length, 3);
+                compare(images[1], null);
+                var check = Http.ImageUtils.createReader(images[2].toJSON());
+                compare(check.size().width, 200);
+                compare(check.size().height, 150);
+                done();
+            });
+
+        async3.wait(timeout);
+    }
+
+    function test_image_provider() {
+        var imageUrl = "https://dummyimage.com/320x240/000/fff.png";
+
+        Http.Request
+            .get(imageUrl)
+            .end(function(err, res) {
+                verify(!err, err);
+                compare(res.body.indexOf("image://duperagent/"), 0);
+                var img = Qt.createQmlObject(
+                    'import QtQuick 2.3; Image { asynchronous: true }', test2);
+                img.statusChanged.connect(function() {
+                    if (img.status === Image.Ready) {
+                        compare(img.sourceSize.width, 320);
+                        compare(img.sourceSize.height, 240);
+                        img.destroy();
+                        done();
+                    }
+                });
+                img.source = res.body;
+            });
+
+        async3.wait(timeout);
+    }
 }
@@ -0,0 +1,49 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#include <QtCore/QTextCodec>
+
+#include "textdecoder.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+static QString decodeUtf8(const QByteArray &data)
+{
+    const char *p = data.constData();
+    int size = data.size();
+
+    // Skip the byte order mark, like the UTF-8 QTextCodec does
+    if (size >= 3 && uchar(p[0]) == 0xef && uchar(p[1]) == 0xbb && uchar(p[2]) == 0xbf) {
+        p += 3;
+        size -= 3;
+    }
+
+    // Qt's decoder already converts runs of ASCII with SIMD and handles the
+    // replacement of malformed sequences, so it is called directly instead
+    // of through a QTextDecoder
+    return QString::fromUtf8(p, size);
+}
+
+QString decodeText(const QByteArray &data, const QByteArray &charset)
+{
+    if (data.isEmpty())
+        return QString();
+
+    if (charset.isEmpty() || charset == "utf-8" || charset == "utf8"
+            || charset == "us-ascii" || charset == "ascii") {
+        return decodeUtf8(data);
+    }
+
+    if (charset == "iso-8859-1" || charset == "latin1")
+        return QString::fromLatin1(data);
+
+    // The codec is owned by Qt and toUnicode() keeps its conversion state on
+    // the stack, so nothing needs to be cleaned up here.
+    QTextCodec *codec = QTextCodec::codecForName(charset);
+    if (!codec)
+        return decodeUtf8(data);
+
+    return codec->toUnicode(data);
+}
+
+} } }
@@ -0,0 +1,22 @@
+// Copyright 2016 Cutehacks AS. All rights reserved.
+// License can be found in the LICENSE file.
+
+#ifndef TEXTDECODER_H
+#define TEXTDECODER_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+#include "qpm.h"
+
+namespace com { namespace cutehacks { namespace duperagent {
+
+// Decodes a response body using the given (lower-case) charset. UTF-8, ASCII
+// and Latin-1 go straight to QString's converters without looking up a
+// codec, everything else goes through QTextCodec. An empty or unknown
+// charset is treated as UTF-8.
+QString decodeText(const QByteArray &data, const QByteArray &charset);
+
+} } }
+
+#endif // TEXTDECODER_H